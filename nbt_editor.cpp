@@ -3,12 +3,46 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <memory>
 #include <ncurses.h>
 #include <stack>
 #include <cstdint>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <ctime>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <zlib.h>
+#include <malloc.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 
 enum class TagType : uint8_t {
     END = 0,
@@ -62,6 +96,7 @@ struct NBTValue {
     std::vector<int32_t> intArrayVal;
     std::vector<int64_t> longArrayVal;
     std::vector<std::shared_ptr<NBTTag>> listVal;
+    TagType listType = TagType::END;
     std::map<std::string, std::shared_ptr<NBTTag>> compoundVal;
     
     NBTValue(TagType t) : type(t) {}
@@ -81,291 +116,9526 @@ public:
     void setValueFromString(const std::string& str);
 };
 
+// Callbacks for streaming over NBT data without building a tree. name is
+// the compound key of the tag, or empty for list elements. Arrays are
+// delivered in slices so huge arrays need no full copy.
+class NBTEventHandler {
+public:
+    virtual ~NBTEventHandler() {}
+    
+    // Called before each tag. Returning false skips its payload unparsed,
+    // without any further events for it.
+    virtual bool enter(const std::string& name, TagType type) { (void)name; (void)type; return true; }
+    
+    virtual void beginCompound(const std::string& name) = 0;
+    virtual void endCompound() = 0;
+    virtual void beginList(const std::string& name, TagType elementType, int32_t length) = 0;
+    virtual void endList() = 0;
+    virtual void integer(const std::string& name, TagType type, int64_t value) = 0;
+    virtual void floating(const std::string& name, TagType type, double value) = 0;
+    virtual void string(const std::string& name, const std::string& value) = 0;
+    virtual void beginArray(const std::string& name, TagType type, int32_t length) = 0;
+    virtual void arrayValues(const int64_t* values, size_t count) = 0;
+    virtual void endArray() = 0;
+};
+
+enum class Compression : uint8_t {
+    NONE,
+    GZIP,
+    ZLIB
+};
+
+Compression detectCompression(const std::string& data);
+bool readFileBytes(const std::string& path, std::string& out);
+// Replaces path so that a crash or a full disk leaves either the old or the
+// new contents, never a truncated file: the data goes to a temp file in the
+// same directory, is synced and renamed over path, and the directory is
+// synced. With keepOld the previous file is kept as path + "_old".
+bool writeFileAtomic(const std::string& path, const char* data, size_t size, bool keepOld, std::string& error);
+// Whether NBT saves keep a .dat_old backup, set with NBTEDIT_KEEP_OLD.
+bool keepOldFiles();
+// Parses a size such as "64K", "512M" or "2G" (binary units) or plain bytes.
+// Returns false for anything else, or a size that does not fit.
+bool parseByteSize(const std::string& text, uint64_t& bytes);
+// Editor memory budget in bytes from NBTEDIT_MEMORY_BUDGET, 0 when unset.
+// validMemoryBudget reports a setting that is not a size on stderr, so the
+// editor can refuse to start rather than run without the budget.
+size_t memoryBudget();
+bool validMemoryBudget();
+// Approximate heap memory held by one tag, not counting its child tags.
+size_t tagFootprint(const NBTTag& tag);
+// Modification time in nanoseconds and size, for change detection.
+bool statFile(const std::string& path, int64_t& mtime, int64_t& size);
+bool inflateData(const char* data, size_t size, std::string& out, std::string& error);
+// level is a zlib compression level, 0 (store) to 9 (smallest).
+bool deflateData(const std::string& in, Compression compression, std::string& out, std::string& error,
+                 int level = Z_DEFAULT_COMPRESSION);
+
+// Read-only std::streambuf over an existing buffer, so decompressed data can
+// be parsed without copying it into a std::istringstream.
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const char* data, size_t size) {
+        char* p = const_cast<char*>(data);
+        setg(p, p, p + size);
+    }
+};
+
+// std::streambuf that inflates gzip or zlib data from another stream on
+// demand, using fixed-size buffers. Data with neither header is passed
+// through unchanged.
+class InflateStreamBuf : public std::streambuf {
+private:
+    std::istream& source;
+    z_stream stream;
+    bool passthrough = false;
+    bool finished = false;
+    std::vector<char> input;
+    std::vector<char> output;
+    
+    bool fillInput();
+    
+protected:
+    int_type underflow() override;
+    
+public:
+    explicit InflateStreamBuf(std::istream& src, size_t bufferSize = 1 << 16);
+    ~InflateStreamBuf();
+};
+
+// std::streambuf compressing everything written to it as gzip or zlib into
+// another stream, using fixed-size buffers. finish ends the compressed
+// stream; until then the output is incomplete.
+class DeflateStreamBuf : public std::streambuf {
+private:
+    std::ostream& sink;
+    z_stream stream;
+    std::vector<char> input;
+    std::vector<char> output;
+    bool finished = false;
+    
+    bool compress(int flush);
+    
+protected:
+    int_type overflow(int_type ch) override;
+    
+public:
+    DeflateStreamBuf(std::ostream& out, Compression compression, int level = Z_DEFAULT_COMPRESSION,
+                     size_t bufferSize = 1 << 16);
+    ~DeflateStreamBuf();
+    bool finish();
+};
+
+// Append-only std::streambuf writing into a caller-owned string, so
+// serialization can reuse the same buffer across files.
+class StringStreamBuf : public std::streambuf {
+private:
+    std::string& target;
+    
+protected:
+    int_type overflow(int_type ch) override {
+        if (ch != traits_type::eof()) {
+            target.push_back(static_cast<char>(ch));
+        }
+        return ch;
+    }
+    
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        target.append(s, static_cast<size_t>(n));
+        return n;
+    }
+    
+public:
+    explicit StringStreamBuf(std::string& out) : target(out) {}
+};
+
+// Append-only scratch file holding the payloads of subtrees evicted under a
+// memory budget. It is unlinked right after it is created, so it goes away
+// with the process.
+class SpillFile {
+private:
+    int fd = -1;
+    uint64_t size = 0;
+    
+public:
+    SpillFile() {}
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+    ~SpillFile();
+    
+    bool open(const std::string& dir);
+    bool append(const std::string& data, uint64_t& offset);
+    bool read(uint64_t offset, size_t length, std::string& out) const;
+};
+
+// Scoped timing span. With NBTEDIT_TRACE set to a file name, spans are
+// recorded into a buffer per thread and written to that file as Chrome
+// trace JSON (chrome://tracing, ui.perfetto.dev) when the program exits;
+// otherwise a span costs a branch. phase must be a string literal, or null
+// for no span. A span with a detail, such as the key of a subtree being
+// parsed, is shown under that name within its phase.
+class TraceSpan {
+private:
+    const char* phase;
+    const std::string* detail;
+    uint64_t start;
+    
+public:
+    explicit TraceSpan(const char* name, const std::string* what = nullptr);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// Whether NBTEDIT_TRACE is set.
+bool tracingEnabled();
+
+enum class AllocationPhase : uint8_t {
+    OTHER,
+    LOAD,
+    FLATTEN,
+    RENDER,
+    SAVE
+};
+
+// Attributes the heap allocations of this thread to phase until the scope
+// ends, for the NBTEDIT_ALLOC_STATS summary. Scopes nest; the innermost
+// phase wins.
+class AllocationScope {
+private:
+    AllocationPhase previous;
+    
+public:
+    explicit AllocationScope(AllocationPhase phase);
+    ~AllocationScope();
+    AllocationScope(const AllocationScope&) = delete;
+    AllocationScope& operator=(const AllocationScope&) = delete;
+};
+
+// With NBTEDIT_ALLOC_STATS set, counts every operator new and delete from
+// here on by phase and prints a summary to stderr on exit.
+void startAllocationStats();
+
+class FilePrefetcher;
+struct BenchmarkOptions;
+struct PipelineBenchmarkOptions;
+
+// Scratch buffers for loading and saving. Batch modes keep one per worker so
+// file contents and (de)compressed data reuse their allocations. Loads read
+// through prefetcher when one is set.
+struct IOBuffers {
+    std::string raw;
+    std::string data;
+    FilePrefetcher* prefetcher = nullptr;
+};
+
 class NBTFile {
 private:
     std::string filename;
     std::shared_ptr<NBTTag> rootTag;
-    bool compressed;
+    Compression compression;
+    std::string lastError;
+    std::string cacheDir;
+    
+    // Uncompressed files only: a hash of every PATCH_BLOCK bytes as last
+    // loaded or saved, with the file's mtime and size at that point, so a
+    // save that keeps the size rewrites only the bytes that changed.
+    std::vector<uint64_t> blockHashes;
+    int64_t diskMtime = 0;
+    int64_t diskSize = 0;
+    
+    void recordBlocks(const std::string& data, int64_t mtime);
+    bool patchInPlace(const std::string& data);
+    
+    std::string snapshotPath() const;
+    bool loadSnapshot(int64_t size, int64_t mtime);
+    // Hands the payload of a current, intact snapshot to consume. Returns
+    // false when there is none; consumed is what consume returned.
+    bool readSnapshot(int64_t size, int64_t mtime, const std::function<bool(const char*, size_t)>& consume,
+                      bool& consumed);
+    void storeSnapshot(const std::string& payload, int64_t mtime, int64_t size);
+    
+    // Subtrees evicted under a memory budget, by tag. The payload of each is
+    // in the spill file; the record is kept once the subtree is read back,
+    // so evicting it again unchanged needs no write.
+    struct EvictedTag {
+        std::weak_ptr<NBTTag> tag;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t hash;
+        size_t children;
+        bool resident;
+    };
+    std::unordered_map<const NBTTag*, EvictedTag> evicted;
+    std::shared_ptr<SpillFile> spill;
+    
+    const EvictedTag* findEvicted(const NBTTag& tag) const;
+    bool readEvicted(const EvictedTag& entry, std::string& payload);
+    bool materializeTree(NBTTag& tag);
     
-    void readTag(std::ifstream& file, std::shared_ptr<NBTTag>& tag);
-    void writeTag(std::ofstream& file, const std::shared_ptr<NBTTag>& tag);
+    void readTag(std::istream& file, std::shared_ptr<NBTTag>& tag);
+    void readPayload(std::istream& file, NBTTag& tag, int depth);
+    void readEvents(std::istream& file, NBTEventHandler& handler, TagType type, const std::string& name, int depth);
+    void skipPayload(std::istream& file, TagType type, int depth);
+    void writeTag(std::ostream& file, const std::shared_ptr<NBTTag>& tag);
+    void writePayload(std::ostream& file, const NBTTag& tag);
     
-    int8_t readByte(std::ifstream& file);
-    int16_t readShort(std::ifstream& file);
-    int32_t readInt(std::ifstream& file);
-    int64_t readLong(std::ifstream& file);
-    float readFloat(std::ifstream& file);
-    double readDouble(std::ifstream& file);
-    std::string readString(std::ifstream& file);
+    int8_t readByte(std::istream& file);
+    int16_t readShort(std::istream& file);
+    int32_t readInt(std::istream& file);
+    int64_t readLong(std::istream& file);
+    float readFloat(std::istream& file);
+    double readDouble(std::istream& file);
+    std::string readString(std::istream& file);
     
-    void writeByte(std::ofstream& file, int8_t value);
-    void writeShort(std::ofstream& file, int16_t value);
-    void writeInt(std::ofstream& file, int32_t value);
-    void writeLong(std::ofstream& file, int64_t value);
-    void writeFloat(std::ofstream& file, float value);
-    void writeDouble(std::ofstream& file, double value);
-    void writeString(std::ofstream& file, const std::string& value);
+    void writeByte(std::ostream& file, int8_t value);
+    void writeShort(std::ostream& file, int16_t value);
+    void writeInt(std::ostream& file, int32_t value);
+    void writeLong(std::ostream& file, int64_t value);
+    void writeFloat(std::ostream& file, float value);
+    void writeDouble(std::ostream& file, double value);
+    void writeString(std::ostream& file, const std::string& value);
+    
+    friend int runCodecBenchmark(const BenchmarkOptions& options);
     
 public:
-    NBTFile(const std::string& fname, bool isCompressed = true)
-        : filename(fname), compressed(isCompressed), rootTag(nullptr) {}
+    NBTFile(const std::string& fname, Compression comp = Compression::GZIP)
+        : filename(fname), rootTag(nullptr), compression(comp) {}
     
     bool load();
+    bool load(IOBuffers& buffers);
     bool save();
+    bool save(IOBuffers& buffers);
+    
+    // Parse/serialize an uncompressed NBT payload held in memory.
+    bool parse(const char* data, size_t size);
+    bool serialize(std::string& out);
+    
+    // Stream the document as events instead of building a tree. streamFile
+    // inflates the file incrementally, so memory use does not grow with it.
+    bool streamEvents(std::istream& in, NBTEventHandler& handler);
+    bool streamFile(NBTEventHandler& handler);
+    // Like streamFile, but from the snapshot when there is a current one.
+    // Either way the file's compression is kept for a later save.
+    bool streamLoad(NBTEventHandler& handler);
+    
+    // Keep inflated snapshots of large compressed files in dir, so opening
+    // them again skips reading and inflating the original.
+    void setCacheDir(const std::string& dir) { cacheDir = dir; }
     
-    std::shared_ptr<NBTTag> getRoot() { return rootTag; }
+    // Drops the children of a compound or list after writing its payload to
+    // a spill file in the cache directory (or /var/tmp), keeping only its
+    // offset and hash; materialize reads them back. Saving copies evicted
+    // subtrees from the spill file, so they need not be read back first.
+    bool evict(const std::shared_ptr<NBTTag>& tag);
+    bool materialize(NBTTag& tag);
+    bool materializeAll();
+    bool isEvicted(const NBTTag& tag) const { return findEvicted(tag) != nullptr; }
+    // Number of entries an evicted compound or list had.
+    size_t evictedCount(const NBTTag& tag) const;
+    
+    const std::string& getFilename() const { return filename; }
+    const std::string& getError() const { return lastError; }
+    Compression getCompression() const { return compression; }
+    void setCompression(Compression comp) { compression = comp; }
+    
+    std::shared_ptr<NBTTag> getRoot() const { return rootTag; }
     void setRoot(std::shared_ptr<NBTTag> root) { rootTag = root; }
 };
 
-class NBTEditor {
+// Documents smaller than this once inflated are cheap enough to load that
+// a snapshot is not worth the disk space.
+static const size_t SNAPSHOT_MIN_SIZE = 1 << 20;
+
+// Snapshot directory: $NBTEDIT_CACHE_DIR, else $XDG_CACHE_HOME/nbtedit or
+// ~/.cache/nbtedit. Empty when NBTEDIT_CACHE_DIR is "off".
+std::string defaultCacheDir();
+
+// Location of a tag inside a tree, as resolved from a path such as
+// "Inventory[0].id". parent is null for the root tag.
+struct TagRef {
+    std::shared_ptr<NBTTag> parent;
+    std::shared_ptr<NBTTag> tag;
+    std::string key;
+    int index = -1;
+};
+
+enum class PathStepKind : uint8_t {
+    KEY,
+    INDEX,
+    ALL,
+    FILTER
+};
+
+// One step of a compiled path: a compound key, a list or array index
+// (negative counts from the end), every element ([]), or a compound filter
+// the current tag has to match.
+struct PathStep {
+    PathStepKind kind;
+    std::string key;
+    int index = 0;
+    std::shared_ptr<NBTTag> filter;
+};
+
+// NBT path in the game's syntax, e.g. "Inventory[{id:\"minecraft:diamond\"}].Count",
+// "Pos[]", "Item{Count:1b}" or "{OnGround:1b}". A path is compiled once and
+// can then be matched against any number of trees. Matching only descends
+// into children the next step accepts, so its cost follows the matched
+// branches rather than the size of the tree.
+class NBTPath {
 private:
-    NBTFile nbtFile;
-    int currentRow = 0;
-    int scrollOffset = 0;
-    int maxVisibleRows = 0;
-    bool editing = false;
-    std::string editBuffer;
-    std::shared_ptr<NBTTag> selectedTag = nullptr;
-    std::vector<std::shared_ptr<NBTTag>> flatTagList;
-    bool modified = false;
+    std::string text;
+    std::vector<PathStep> steps;
     
-    void flattenTags(const std::shared_ptr<NBTTag>& tag, int depth = 0);
-    void refreshTagList();
-    void drawEditor();
-    void handleInput(int ch);
-    void editValue();
-    void saveChanges();
-    void addTag();
-    void deleteTag();
+public:
+    bool compile(const std::string& path, std::string& error);
+    
+    const std::string& getText() const { return text; }
+    const std::vector<PathStep>& getSteps() const { return steps; }
+    
+    void match(const std::shared_ptr<NBTTag>& root, std::vector<TagRef>& out) const;
+    // Continues matching at step from an already reached tag.
+    void matchFrom(const TagRef& at, size_t step, std::vector<TagRef>& out) const;
+    // The path without its last step, when that step is a plain key.
+    bool splitLastKey(NBTPath& parent, std::string& key) const;
+};
+
+// Subset match as used by path filters: every key of a filter compound must
+// match, and every element of a filter list must match some element.
+bool matchesFilter(const NBTTag& filter, const NBTTag& tag);
+
+// Single-target lookups; a path matching several tags is an error. Array
+// elements resolve to a detached tag with the array as parent.
+bool resolvePath(const std::shared_ptr<NBTTag>& root, const std::string& path, TagRef& ref, std::string& error);
+bool resolvePath(const std::shared_ptr<NBTTag>& root, const NBTPath& path, TagRef& ref, std::string& error);
+bool resolveParentPath(const std::shared_ptr<NBTTag>& root, const std::string& path, TagRef& ref, std::string& error);
+bool resolveParentPath(const std::shared_ptr<NBTTag>& root, const NBTPath& path, TagRef& ref, std::string& error);
+bool removeTag(const TagRef& ref);
+bool removeTags(std::vector<TagRef> refs);
+void storeArrayElement(const TagRef& ref);
+
+// Builds NBTTag trees from events, e.g. to materialise one subtree of an
+// otherwise streamed document.
+class NBTTreeBuilder : public NBTEventHandler {
+private:
+    std::vector<std::shared_ptr<NBTTag>> stack;
+    std::shared_ptr<NBTTag> root;
+    
+    std::shared_ptr<NBTTag> add(const std::string& name, TagType type);
     
 public:
-    NBTEditor(const std::string& filename) : nbtFile(filename) {}
-    void run();
+    void reset() { stack.clear(); root.reset(); }
+    bool done() const { return root && stack.empty(); }
+    std::shared_ptr<NBTTag> getRoot() const { return root; }
+    
+    void beginCompound(const std::string& name) override;
+    void endCompound() override { stack.pop_back(); }
+    void beginList(const std::string& name, TagType elementType, int32_t length) override;
+    void endList() override { stack.pop_back(); }
+    void integer(const std::string& name, TagType type, int64_t value) override;
+    void floating(const std::string& name, TagType type, double value) override;
+    void string(const std::string& name, const std::string& value) override;
+    void beginArray(const std::string& name, TagType type, int32_t length) override;
+    void arrayValues(const int64_t* values, size_t count) override;
+    void endArray() override { stack.pop_back(); }
 };
 
-std::string NBTValue::toString() const {
-    switch (type) {
-        case TagType::BYTE:
-            return std::to_string(byteVal);
-        case TagType::SHORT:
-            return std::to_string(shortVal);
-        case TagType::INT:
-            return std::to_string(intVal);
-        case TagType::LONG:
-            return std::to_string(longVal) + "L";
-        case TagType::FLOAT:
-            return std::to_string(floatVal) + "f";
-        case TagType::DOUBLE:
-            return std::to_string(doubleVal);
-        case TagType::STRING:
-            return "\"" + stringVal + "\"";
-        case TagType::BYTE_ARRAY:
-            return "[" + std::to_string(byteArrayVal.size()) + " bytes]";
-        case TagType::INT_ARRAY:
-            return "[" + std::to_string(intArrayVal.size()) + " ints]";
-        case TagType::LONG_ARRAY:
-            return "[" + std::to_string(longArrayVal.size()) + " longs]";
-        case TagType::LIST:
-            return "[" + std::to_string(listVal.size()) + " items]";
-        case TagType::COMPOUND:
-            return "{" + std::to_string(compoundVal.size()) + " entries}";
-        default:
-            return "";
+// Builds a tree on a loader thread for a UI thread to show while it grows.
+// Compounds and lists less than SHALLOW_DEPTH deep are handed over empty as
+// soon as they start; everything below them is built privately and handed
+// over once complete. The UI thread collects the handed-over tags with take
+// and attaches each to its parent, or makes it the root when it has none.
+class ProgressiveLoader : public NBTEventHandler {
+public:
+    struct Attach {
+        std::shared_ptr<NBTTag> parent;
+        std::shared_ptr<NBTTag> tag;
+    };
+    
+    // Tags at least this deep are complete once handed over.
+    static const size_t SHALLOW_DEPTH = 3;
+    
+private:
+    std::vector<std::shared_ptr<NBTTag>> shallow;
+    NBTTreeBuilder deep;
+    int deepLevel = 0;
+    std::vector<Attach> batch;
+    std::chrono::steady_clock::time_point lastFlush;
+    
+    std::mutex mutex;
+    std::vector<Attach> pending;
+    std::atomic<size_t> tags;
+    std::atomic<bool> cancelled;
+    
+    bool openShallow(const std::shared_ptr<NBTTag>& container);
+    void completed();
+    void attach(const std::shared_ptr<NBTTag>& tag);
+    void flush();
+    
+public:
+    ProgressiveLoader() : tags(0), cancelled(false) {}
+    
+    // Hands over whatever is still batched; call once the stream has ended.
+    void finish() { flush(); }
+    // Makes the stream stop at the next tag.
+    void cancel() { cancelled = true; }
+    size_t tagCount() const { return tags; }
+    bool take(std::vector<Attach>& out);
+    
+    bool enter(const std::string& name, TagType type) override;
+    void beginCompound(const std::string& name) override;
+    void endCompound() override;
+    void beginList(const std::string& name, TagType elementType, int32_t length) override;
+    void endList() override;
+    void integer(const std::string& name, TagType type, int64_t value) override;
+    void floating(const std::string& name, TagType type, double value) override;
+    void string(const std::string& name, const std::string& value) override;
+    void beginArray(const std::string& name, TagType type, int32_t length) override;
+    void arrayValues(const int64_t* values, size_t count) override { deep.arrayValues(values, count); }
+    void endArray() override;
+};
+
+// Runs a compiled path over an event stream. Subtrees no step can reach are
+// skipped without parsing them; only matches, and the subtrees a filter has
+// to look at, are built as trees and handed to the callback.
+class PathStreamMatcher : public NBTEventHandler {
+private:
+    struct Frame {
+        std::vector<size_t> states;
+        bool list;
+        int32_t length;
+        int32_t next;
+    };
+    
+    const NBTPath& path;
+    std::function<void(const TagRef&)> onMatch;
+    std::vector<Frame> frames;
+    std::vector<size_t> pending;
+    std::vector<size_t> captureStates;
+    NBTTreeBuilder builder;
+    bool capturing = false;
+    
+    void captured();
+    
+public:
+    PathStreamMatcher(const NBTPath& p, const std::function<void(const TagRef&)>& callback)
+        : path(p), onMatch(callback) {}
+    
+    void reset();
+    
+    bool enter(const std::string& name, TagType type) override;
+    void beginCompound(const std::string& name) override;
+    void endCompound() override;
+    void beginList(const std::string& name, TagType elementType, int32_t length) override;
+    void endList() override;
+    void integer(const std::string& name, TagType type, int64_t value) override;
+    void floating(const std::string& name, TagType type, double value) override;
+    void string(const std::string& name, const std::string& value) override;
+    void beginArray(const std::string& name, TagType type, int32_t length) override;
+    void arrayValues(const int64_t* values, size_t count) override;
+    void endArray() override;
+};
+
+enum class EditOpKind : uint8_t {
+    GET,
+    SET,
+    DEL
+};
+
+struct EditOp {
+    EditOpKind kind;
+    std::string path;
+    std::string value;
+    std::shared_ptr<const NBTPath> compiled;
+};
+
+bool parseEditOps(const std::vector<std::string>& args, std::vector<EditOp>& ops, std::string& error);
+bool parseEditOpLine(const std::string& line, EditOp& op, std::string& error);
+
+// Applies get/set/del operations to a loaded NBTFile. Used by the headless
+// command line mode; the caller decides whether to save afterwards.
+class NBTCommandRunner {
+private:
+    NBTFile& nbtFile;
+    bool changed = false;
+    
+public:
+    NBTCommandRunner(NBTFile& file) : nbtFile(file) {}
+    
+    bool apply(const EditOp& op, std::ostream& out, std::string& error);
+    bool applySet(const TagRef& ref, const EditOp& op, std::string& error);
+    bool prepareSet(const TagRef& ref, const EditOp& op, std::shared_ptr<NBTTag>& result, std::string& error);
+    void storeSet(const TagRef& ref, const std::shared_ptr<NBTTag>& result);
+    bool isChanged() const { return changed; }
+};
+
+int runHeadless(const std::string& filename, const std::vector<EditOp>& ops);
+
+static const int REGION_CHUNKS = 1024;
+static const size_t REGION_SECTOR = 4096;
+
+struct RegionChunk {
+    int index;
+    uint32_t timestamp;
+    bool external;
+    bool dirty = false;
+    NBTFile nbt;
+    // Set by writers that produce compressed chunks without building a
+    // tree: saved as is, with region compression type encodedType.
+    std::string encoded;
+    uint8_t encodedType = 0;
+    
+    RegionChunk(const std::string& regionName, int idx, uint32_t time)
+        : index(idx), timestamp(time), external(false), nbt(regionName, Compression::ZLIB) {}
+};
+
+// Anvil region file (.mca): an 8 KiB header of chunk locations and
+// timestamps followed by individually compressed chunk payloads in 4 KiB
+// sectors. Chunks too large for the region live in c.<x>.<z>.mcc files.
+class RegionFile {
+private:
+    std::string filename;
+    int regionX = 0;
+    int regionZ = 0;
+    std::vector<RegionChunk> chunks;
+    std::vector<uint32_t> locations;
+    std::vector<uint32_t> timestamps;
+    std::ifstream stream;
+    std::string lastError;
+    // The file's mtime and size when locations was last read or written.
+    int64_t diskMtime = 0;
+    int64_t diskSize = 0;
+    
+    std::string externalChunkPath(int index) const;
+    bool encodeChunk(RegionChunk& chunk, IOBuffers& buffers, const std::string*& payload, uint8_t& type);
+    bool saveInPlace(IOBuffers& buffers);
+    
+public:
+    RegionFile(const std::string& fname);
+    
+    // Reads only the header; chunks can then be fetched one at a time with
+    // readChunk, so streaming consumers never hold the whole region.
+    bool loadHeader();
+    bool hasChunk(int index) const { return !locations.empty() && locations[index] != 0; }
+    uint32_t getTimestamp(int index) const { return timestamps.empty() ? 0 : timestamps[index]; }
+    // The payload is returned as stored; compression, when given, receives
+    // how it is encoded.
+    bool readChunk(int index, std::string& payload, bool* external = nullptr, Compression* compression = nullptr);
+    int getRegionX() const { return regionX; }
+    int getRegionZ() const { return regionZ; }
+    
+    bool load();
+    bool load(IOBuffers& buffers);
+    bool save();
+    bool save(IOBuffers& buffers);
+    
+    std::vector<RegionChunk>& getChunks() { return chunks; }
+    // Adds a chunk already compressed with region compression type type
+    // (1 gzip, 2 zlib, 3 none), taking payload. For a region that was not
+    // loaded, save then writes these chunks as the whole file.
+    // A zero timestamp is replaced with the time of the save.
+    void addEncodedChunk(int index, uint32_t timestamp, bool external, std::string& payload, uint8_t type);
+    std::string chunkLabel(int index) const;
+    const std::string& getFilename() const { return filename; }
+    const std::string& getError() const { return lastError; }
+};
+
+// Fixed set of workers, each with its own task deque. A worker takes tasks
+// from the front of its own deque and, once that is empty, steals from the
+// back of the others, so a few slow files do not leave cores idle.
+class WorkStealingPool {
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+    
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    
+    bool pop(size_t worker, size_t& task);
+    bool steal(size_t thief, size_t& task);
+    
+public:
+    explicit WorkStealingPool(size_t threadCount);
+    
+    size_t size() const { return queues.size(); }
+    
+    // Runs fn(task, worker) for every task in order. Tasks are dealt out
+    // round-robin, so put the most expensive ones first.
+    void run(const std::vector<size_t>& order, const std::function<void(size_t, size_t)>& fn);
+};
+
+// Minimal io_uring over the raw system calls: one submission and one
+// completion ring, filled and drained by a single thread.
+class IoUring {
+private:
+    int fd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned queued = 0;
+    
+public:
+    IoUring() {}
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    ~IoUring();
+    
+    bool init(unsigned entries);
+    
+    // Null when the submission ring is full.
+    io_uring_sqe* getSqe();
+    // Submits queued entries and waits for at least one completion.
+    bool submitAndWait();
+    // Entries published to the ring that the kernel has not taken yet.
+    unsigned unsubmitted() const { return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE); }
+    // Waits for a completion without submitting anything.
+    bool waitCompletion();
+    bool popCompletion(io_uring_cqe& cqe);
+};
+
+// Reads a known list of files ahead of the workers that parse them, so
+// open and read latency overlaps with decompression and parsing instead of
+// stalling every worker once per file. One thread keeps up to depth files
+// in flight through io_uring; where that is unavailable (or
+// NBTEDIT_IO_URING=off), a few threads do blocking reads. Files are read in
+// list order, which should match the order the workers take them in.
+class FilePrefetcher {
+private:
+    enum class FileState : uint8_t {
+        PENDING,
+        READING,
+        READY,
+        TAKEN
+    };
+    
+    struct Entry {
+        FileState state = FileState::PENDING;
+        bool ok = false;
+        // Nobody will take it: finish drops the data instead of keeping it.
+        bool skipped = false;
+        int fd = -1;
+        size_t done = 0;
+        std::string data;
+    };
+    
+    std::vector<std::string> paths;
+    std::unordered_map<std::string, size_t> indices;
+    std::vector<Entry> entries;
+    size_t depth;
+    size_t byteBudget;
+    
+    std::mutex mutex;
+    std::condition_variable readyChanged;
+    std::condition_variable spaceChanged;
+    size_t next = 0;
+    size_t reading = 0;
+    size_t readyBytes = 0;
+    bool stopping = false;
+    bool usingRing = false;
+    std::vector<std::thread> threads;
+    
+    bool claim(size_t& index, bool wait);
+    void finish(size_t index, bool ok);
+    void runRing(IoUring* ring);
+    void runBlocking();
+    
+public:
+    explicit FilePrefetcher(const std::vector<std::string>& files, size_t depth = 64,
+                            size_t byteBudget = 256 << 20);
+    ~FilePrefetcher();
+    
+    // Drop-in for readFileBytes. Files not in the list, and files no
+    // reader has started on yet, are read by the caller.
+    bool read(const std::string& path, std::string& out);
+    // For a listed file that will not be read after all (a snapshot was
+    // used, or the caller gave up on it): frees its buffer and byte budget
+    // and keeps it from being started, so later files are not held back.
+    void skip(const std::string& path);
+    const char* backend() const { return usingRing ? "io_uring" : "threads"; }
+};
+
+struct BatchFileResult {
+    std::string output;
+    std::string errors;
+    size_t documents = 0;
+    size_t matched = 0;
+    size_t modified = 0;
+    size_t failed = 0;
+};
+
+// Applies the same operations to every playerdata, region, entities and poi
+// file below a world directory. A document is only edited when all paths
+// resolve in it; documents where they do not are skipped, not failed.
+class WorldBatch {
+private:
+    std::string worldDir;
+    std::vector<EditOp> ops;
+    size_t threadCount;
+    bool dryRun = false;
+    
+    void processDocument(NBTFile& doc, const std::string& label, BatchFileResult& result, bool& failed);
+    void processFile(const std::string& path, IOBuffers& buffers, BatchFileResult& result);
+    
+public:
+    WorldBatch(const std::string& dir, const std::vector<EditOp>& operations, size_t threads)
+        : worldDir(dir), ops(operations), threadCount(threads) {}
+    
+    void setDryRun(bool value) { dryRun = value; }
+    int run();
+};
+
+std::vector<std::string> findWorldFiles(const std::string& worldDir);
+
+// Streams a path query over .dat and .mca files (directories are searched
+// like a world) and prints every match as SNBT, one line each.
+int runQuery(const std::string& path, const std::vector<std::string>& inputs, size_t threads);
+
+enum class DaemonOp : uint8_t {
+    GET = 1,
+    SET,
+    DEL,
+    QUERY,
+    SAVE,
+    RELOAD,
+    STATUS,
+    SHUTDOWN
+};
+
+// One request to the daemon. chunk is a region chunk index (0-1023) for
+// .mca files and -1 otherwise.
+struct DaemonRequest {
+    DaemonOp op;
+    int32_t chunk = -1;
+    std::string file;
+    std::string path;
+    std::string value;
+};
+
+// Frames on the daemon socket. Every frame is a big-endian u32 payload
+// length followed by the payload. Requests: u8 op, i32 chunk, then file,
+// path and value as u32 length + bytes. Responses: u8 status (0 = ok) and
+// the output or error text as u32 length + bytes.
+void encodeDaemonRequest(const DaemonRequest& request, std::string& frame);
+bool decodeDaemonRequest(const std::string& payload, DaemonRequest& request);
+bool decodeDaemonResponse(const std::string& payload, bool& ok, std::string& body);
+void encodeDaemonResponse(bool ok, const std::string& body, std::string& frame);
+
+// Long-running server that keeps parsed files and regions in memory and
+// answers requests on a Unix domain socket, so repeated tool invocations
+// skip process startup and parsing. Clients are served from one poll()
+// loop; a cached file is reloaded when it changes on disk, unless it has
+// unsaved edits.
+class NBTDaemon {
+private:
+    struct CachedFile {
+        std::unique_ptr<NBTFile> nbt;
+        std::unique_ptr<RegionFile> region;
+        int64_t mtime = 0;
+        int64_t size = 0;
+        bool dirty = false;
+    };
+    
+    struct Connection {
+        int fd;
+        std::string input;
+        std::string output;
+    };
+    
+    std::string socketPath;
+    std::map<std::string, CachedFile> cache;
+    IOBuffers buffers;
+    bool running = true;
+    
+    CachedFile* open(const std::string& file, std::string& error);
+    NBTFile* document(CachedFile& cached, int32_t chunk, std::string& error);
+    bool handle(const DaemonRequest& request, std::string& body);
+    
+public:
+    explicit NBTDaemon(const std::string& path) : socketPath(path) {}
+    
+    int run();
+};
+
+int runDaemonClient(const std::string& socketPath, const DaemonRequest& request);
+
+// Per-region statistics for the stats report: chunk sizes before and after
+// inflating, InhabitedTime, and entity and block entity counts by id.
+struct RegionStats {
+    struct Chunk {
+        int index;
+        uint32_t compressed;
+        uint32_t raw;
+        bool external;
+    };
+    
+    std::string file;
+    std::vector<Chunk> chunks;
+    std::vector<int64_t> inhabited;
+    std::map<std::string, uint64_t> entities;
+    std::map<std::string, uint64_t> blockEntities;
+    std::string errors;
+};
+
+// Gathers RegionStats for every .mca file below the given worlds or region
+// directories on the worker pool and prints a per-region and world report.
+// Chunk figures come from region/ files only; entities/ files (1.17+) add
+// their entity counts and poi/ files are skipped.
+int runStats(const std::vector<std::string>& inputs, size_t threads, size_t top);
+
+// Inverted index of the string values in a world (item and entity ids,
+// names, ...): each value maps to the documents, player files or region
+// chunks, and generalised paths such as "Inventory[].id" where it occurs.
+// The index is stored as gzipped NBT and updated incrementally: files with
+// an unchanged mtime and size, and region chunks with an unchanged
+// timestamp, keep their postings without being read.
+class WorldIndex {
+private:
+    struct FileEntry {
+        std::string path;
+        int64_t mtime;
+        int64_t size;
+    };
+    
+    struct Document {
+        uint32_t file;
+        int32_t chunk;
+        uint32_t timestamp;
+    };
+    
+    std::string worldDir;
+    std::string indexPath;
+    std::vector<FileEntry> files;
+    std::vector<Document> documents;
+    std::vector<std::string> paths;
+    // value -> (document, path) pairs, flattened and sorted by document
+    std::map<std::string, std::vector<int32_t>> terms;
+    std::string lastError;
+    
+    std::string documentLabel(const Document& doc) const;
+    
+public:
+    WorldIndex(const std::string& dir, const std::string& file);
+    
+    bool load();
+    bool save();
+    int build(size_t threads, bool full);
+    int query(const std::string& value, const std::string& pathFilter);
+    const std::string& getError() const { return lastError; }
+};
+
+struct OptimizeOptions {
+    // Keys dropped wherever they hold this value, e.g. FallFlying 0b.
+    std::multimap<std::string, std::shared_ptr<NBTTag>> defaults;
+    // Namespaces of the installed plugins. When set, BukkitValues and
+    // PublicBukkitValues entries of any other plugin are dropped.
+    std::vector<std::string> plugins;
+    bool keepPlugins = true;
+    // Output compression; files keep their own when unset.
+    bool recompress = false;
+    Compression compression = Compression::GZIP;
+    int level = Z_DEFAULT_COMPRESSION;
+    bool dryRun = false;
+    // Drop empty compounds and lists stored under a key. Never applies to
+    // item components or "!key" removal markers, where empty is the value.
+    bool pruneEmpty = false;
+};
+
+// Event handler re-encoding NBT while dropping what the optimize command
+// removes: empty compounds and lists under compound keys (when asked to),
+// keys holding a configured default value, data of plugins that are not installed, and
+// empty item stacks (air or a zero count) in slotted lists such as
+// Inventory. Each tag is written as it arrives and cut from the output
+// again once it turns out to be removable, so a document is optimized in
+// the single pass that parses it. Elements of lists without slots are
+// positional and always kept.
+class NBTOptimizer : public NBTEventHandler {
+private:
+    struct Frame {
+        bool list;
+        bool plugins;
+        size_t start;
+        size_t lengthOffset;
+        int32_t children;
+        bool slot;
+        bool emptyItem;
+        // An item's component map, whose entries are meaningful even when
+        // empty (minecraft:unbreakable: {}).
+        bool components;
+        // Empty but still data: a component, or a "!key" removal marker.
+        bool meaningful;
+    };
+    
+    std::string& out;
+    const OptimizeOptions& options;
+    std::vector<Frame> frames;
+    TagType arrayType = TagType::END;
+    
+    size_t header(const std::string& name, TagType type);
+    void open(const std::string& name, TagType type, bool list);
+    void close();
+    void finish(size_t start, bool drop);
+    bool isDefault(const std::string& name, TagType type, int64_t integer, double floating,
+                   const std::string* string) const;
+    
+public:
+    size_t removed = 0;
+    
+    NBTOptimizer(std::string& output, const OptimizeOptions& opts) : out(output), options(opts) {}
+    
+    bool enter(const std::string& name, TagType type) override;
+    void beginCompound(const std::string& name) override { open(name, TagType::COMPOUND, false); }
+    void endCompound() override { close(); }
+    void beginList(const std::string& name, TagType elementType, int32_t length) override;
+    void endList() override { close(); }
+    void integer(const std::string& name, TagType type, int64_t value) override;
+    void floating(const std::string& name, TagType type, double value) override;
+    void string(const std::string& name, const std::string& value) override;
+    void beginArray(const std::string& name, TagType type, int32_t length) override;
+    void arrayValues(const int64_t* values, size_t count) override;
+    void endArray() override;
+};
+
+bool addOptimizeDefault(OptimizeOptions& options, const std::string& key, const std::string& value, std::string& error);
+bool loadOptimizeDefaults(OptimizeOptions& options, const std::string& path, std::string& error);
+int runOptimize(const std::vector<std::string>& inputs, const OptimizeOptions& options, size_t threads);
+
+struct BenchmarkOptions {
+    size_t samples = 20;
+    size_t warmup = 3;
+    // Only run benchmarks whose name contains this.
+    std::string filter;
+    // One JSON object per benchmark instead of a table.
+    bool json = false;
+};
+
+// Throughput of every NBTFile reader and writer primitive and of the array
+// paths of readPayload/writePayload, on deterministic synthetic input.
+int runCodecBenchmark(const BenchmarkOptions& options);
+
+// Event handler writing binary NBT, the inverse of NBTFile::streamEvents.
+// Lists are written with the length given to beginList. Output collects in
+// a reusable buffer which, given a sink, is flushed to it every 64 KiB so
+// documents of any size stream through.
+class NBTBinaryWriter : public NBTEventHandler {
+private:
+    std::string out;
+    std::ostream* sink;
+    uint64_t flushed = 0;
+    std::vector<bool> lists;
+    TagType arrayType = TagType::END;
+    
+    void header(const std::string& name, TagType type);
+    void maybeFlush() { if (sink && out.size() >= (1 << 16)) flush(); }
+    
+public:
+    explicit NBTBinaryWriter(std::ostream* target = nullptr) : sink(target) {}
+    
+    // Output not yet flushed; everything when there is no sink.
+    std::string& data() { return out; }
+    // Bytes written, flushed or not.
+    uint64_t size() const { return flushed + out.size(); }
+    void flush();
+    
+    void beginCompound(const std::string& name) override;
+    void endCompound() override;
+    void beginList(const std::string& name, TagType elementType, int32_t length) override;
+    void endList() override { lists.pop_back(); }
+    void integer(const std::string& name, TagType type, int64_t value) override;
+    void floating(const std::string& name, TagType type, double value) override;
+    void string(const std::string& name, const std::string& value) override;
+    void beginArray(const std::string& name, TagType type, int32_t length) override;
+    void arrayValues(const int64_t* values, size_t count) override;
+    void endArray() override { maybeFlush(); }
+};
+
+enum class CorpusKind : uint8_t {
+    PLAYER,     // player file with full inventories and a recipe book
+    CHUNK,      // terrain chunk: sections with palettes and block state arrays
+    ENTITIES,   // entity chunk full of mobs
+    PLUGIN,     // deeply nested plugin data under BukkitValues
+    FLAT        // one huge compound of scalars
+};
+
+bool parseCorpusKind(const std::string& name, CorpusKind& kind);
+const char* corpusKindName(CorpusKind kind);
+
+// Generates NBT documents shaped like real server data as events, so they
+// can be written out or built into trees directly. Everything derives from
+// the seed: the same seed, kind and size always give the same document.
+// A document reaches about the requested serialized size by repeating its
+// natural repeating part (recipes, sections, entities, blobs or keys).
+class CorpusGenerator {
+private:
+    uint64_t state;
+    NBTEventHandler* out = nullptr;
+    // Serialized size emitted so far, and whether each open container is a
+    // list, whose elements have no type and name header.
+    uint64_t bytes = 0;
+    std::vector<bool> lists;
+    
+    uint64_t next();
+    uint32_t below(uint32_t bound) { return static_cast<uint32_t>((next() >> 32) * bound >> 32); }
+    template <size_t N>
+    const char* pick(const char* const (&names)[N]) { return names[below(N)]; }
+    double unit() { return static_cast<double>(next() >> 11) / 9007199254740992.0; }
+    std::string word(size_t minLength, size_t maxLength);
+    
+    void named(const std::string& name);
+    void beginCompound(const std::string& name);
+    void endCompound();
+    void beginList(const std::string& name, TagType elementType, int32_t length);
+    void endList();
+    void integer(const std::string& name, TagType type, int64_t value);
+    void floating(const std::string& name, TagType type, double value);
+    void string(const std::string& name, const std::string& value);
+    void array(const std::string& name, TagType type, const std::vector<int64_t>& values);
+    void doubles(const std::string& name, TagType type, const double* values, int count);
+    
+    void item(int slot);
+    void player(uint64_t target);
+    void section(int y);
+    void chunk(uint64_t target, int x, int z);
+    void entity(int x, int z);
+    void entities(uint64_t target, int x, int z);
+    void blob(int depth);
+    void plugin(uint64_t target);
+    void flat(uint64_t target);
+    
+public:
+    explicit CorpusGenerator(uint64_t seed) : state(seed) {}
+    
+    // Emits one document of about target bytes; x and z place chunks.
+    void generate(CorpusKind kind, uint64_t target, NBTEventHandler& handler, int x = 0, int z = 0);
+};
+
+// Streams one generated document of about size bytes to path; written is its
+// uncompressed size.
+bool generateFile(CorpusKind kind, const std::string& path, uint64_t size, uint64_t seed, Compression compression,
+                  uint64_t& written, std::string& error);
+// Writes a generated document to output or, for a .mca output, a region of
+// chunk or entity documents adding up to about size bytes uncompressed.
+int runGenerate(CorpusKind kind, const std::string& output, uint64_t size, uint64_t seed, Compression compression);
+
+struct PipelineBenchmarkOptions {
+    std::vector<CorpusKind> kinds = { CorpusKind::PLAYER, CorpusKind::CHUNK, CorpusKind::ENTITIES,
+                                      CorpusKind::PLUGIN, CorpusKind::FLAT };
+    std::vector<uint64_t> sizes = { 64 << 10, 1 << 20, 16 << 20 };
+    // Value edits per sample, made the way the editor makes them.
+    size_t edits = 10;
+    size_t samples = 5;
+    size_t warmup = 1;
+    uint64_t seed = 1;
+    // Where the corpus files are written; they are removed afterwards.
+    std::string dir = "/var/tmp";
+    bool json = false;
+};
+
+// Times opening, editing and saving generated documents in NBTEditor, per
+// phase: read, inflate, parse, flatten, edit, serialize, deflate, write.
+int runPipelineBenchmark(const PipelineBenchmarkOptions& options);
+
+// Number formatting shared by the text exporters. Floats and doubles use the
+// shortest precision that round-trips and always contain a '.' or exponent;
+// non-finite values are spelled NaN, Infinity and -Infinity like Java does.
+void appendInteger(std::string& out, int64_t value);
+void appendFloat(std::string& out, float value);
+void appendDouble(std::string& out, double value);
+
+// Writes NBTTag trees as SNBT, the stringified form used by /data and
+// commands. Output is appended to a caller-owned buffer; when a sink is
+// given, the buffer is flushed to it whenever it grows past flushThreshold,
+// so exporting a huge tree needs only a bounded amount of memory.
+class SNBTWriter {
+private:
+    std::string& out;
+    bool pretty;
+    std::ostream* sink;
+    size_t flushThreshold = 1 << 20;
+    
+    void writeTag(const NBTTag& tag, int depth);
+    void writeKey(const std::string& key);
+    void writeQuoted(const std::string& str);
+    void newline(int depth);
+    void maybeFlush();
+    
+public:
+    SNBTWriter(std::string& buffer, bool prettyPrint = false, std::ostream* output = nullptr)
+        : out(buffer), pretty(prettyPrint), sink(output) {}
+    
+    void write(const NBTTag& tag);
+    void flush();
+};
+
+std::string toSNBT(const NBTTag& tag, bool pretty = false);
+int runSNBTExport(const std::string& filename, const std::string& path, bool pretty);
+
+// Parses SNBT text into NBTTag trees: compounds with quoted or bare keys,
+// lists, typed arrays ([B;...], [I;...], [L;...]), quoted strings and
+// numbers with the b/s/L/f/d suffixes. Bare words that are not numbers are
+// strings, as in the game.
+class SNBTParser {
+private:
+    const char* begin;
+    const char* pos;
+    const char* end;
+    
+    [[noreturn]] void fail(const std::string& message);
+    void skipWhitespace();
+    void expect(char c);
+    std::shared_ptr<NBTTag> parseValue(const std::string& name, int depth);
+    std::shared_ptr<NBTTag> parseCompound(const std::string& name, int depth);
+    std::shared_ptr<NBTTag> parseList(const std::string& name, int depth);
+    std::shared_ptr<NBTTag> parseArray(const std::string& name, char kind);
+    std::shared_ptr<NBTTag> parseScalar(const std::string& name);
+    std::string parseQuoted();
+    std::string parseBareWord();
+    std::string parseKey();
+    
+public:
+    SNBTParser(const char* data, size_t size) : begin(data), pos(data), end(data + size) {}
+    
+    // Parses exactly one value; trailing non-blank text is an error.
+    bool parse(std::shared_ptr<NBTTag>& result, std::string& error, const std::string& name = "");
+    // Parses one value at the start of the text and reports its length.
+    bool parsePrefix(std::shared_ptr<NBTTag>& result, std::string& error, size_t& consumed);
+};
+
+bool parseSNBT(const std::string& text, std::shared_ptr<NBTTag>& result, std::string& error);
+int runSNBTImport(const std::string& input, const std::string& output, Compression compression);
+
+struct JSONExportOptions {
+    // Wrap every scalar and array as {"type":"int","value":...} so the NBT
+    // type survives the conversion.
+    bool typedValues = false;
+    // Emit longs as strings, for consumers that parse numbers as doubles.
+    bool longsAsStrings = false;
+};
+
+// Event handler writing JSON. Output goes to a reusable buffer that is
+// flushed to the sink every 64 KiB, so memory stays bounded regardless of
+// document size.
+class JSONWriter : public NBTEventHandler {
+private:
+    std::ostream& sink;
+    std::string out;
+    JSONExportOptions options;
+    
+    struct Frame {
+        bool compound;
+        bool first;
+        bool longs;
+    };
+    std::vector<Frame> frames;
+    // Bytes handed to the sink so far, and where the open document began.
+    uint64_t written = 0;
+    uint64_t documentStart = 0;
+    
+    void separator(const std::string& name);
+    void writeString(const std::string& str);
+    void beginTyped(TagType type);
+    void maybeFlush();
+    
+public:
+    JSONWriter(std::ostream& output, const JSONExportOptions& opts);
+    
+    void beginCompound(const std::string& name) override;
+    void endCompound() override;
+    void beginList(const std::string& name, TagType elementType, int32_t length) override;
+    void endList() override;
+    void integer(const std::string& name, TagType type, int64_t value) override;
+    void floating(const std::string& name, TagType type, double value) override;
+    void string(const std::string& name, const std::string& value) override;
+    void beginArray(const std::string& name, TagType type, int32_t length) override;
+    void arrayValues(const int64_t* values, size_t count) override;
+    void endArray() override;
+    
+    // Writes raw JSON text (used for envelopes around region chunks).
+    void raw(const std::string& text);
+    void flush();
+    
+    // Brackets one output line. discardDocument takes back a document that
+    // failed halfway: output still buffered is dropped, and when part of it
+    // was flushed already a regular-file stdout is truncated back to where
+    // the line began; any other sink gets the line ended and an
+    // {"error":...} record after it. Either way the writer is reset for the
+    // next document, while memory stays bounded by the 64 KiB flushes.
+    void beginDocument();
+    void endDocument();
+    void discardDocument(const std::string& error);
+};
+
+int runJSONExport(const std::vector<std::string>& files, const JSONExportOptions& options);
+
+// Structural hash of a subtree (type, keys and values). With a cache, the
+// hash of every visited node is kept so repeated comparisons are O(1).
+typedef std::unordered_map<const NBTTag*, uint64_t> TagHashCache;
+uint64_t hashTag(const NBTTag& tag, TagHashCache* cache = nullptr);
+
+// Deep structural equality, with the same rules as hashTag (the tag's own
+// name is ignored, floats compare by bits). Equal hashes only mean "probably
+// equal"; anything that acts on equality confirms it with this.
+bool tagsEqual(const NBTTag& a, const NBTTag& b);
+
+void appendPathKey(std::string& path, const std::string& key);
+void appendPathIndex(std::string& path, size_t index);
+
+// Brings current up to date with updated in place. Subtrees whose hash is
+// unchanged keep their tag objects, so pointers into the tree stay valid.
+// Returns the tag to use in current's place and counts replaced tags.
+std::shared_ptr<NBTTag> mergeTree(const std::shared_ptr<NBTTag>& current, const std::shared_ptr<NBTTag>& updated,
+                                  TagHashCache& currentHashes, TagHashCache& updatedHashes, size_t& replaced);
+
+enum class PatchOpKind : uint8_t {
+    TEST,
+    ADD,
+    REMOVE,
+    REPLACE,
+    SPLICE
+};
+
+// One line of a patch. value is SNBT; SPLICE replaces deleteCount elements
+// of a list or array at start with the elements of value.
+struct PatchOp {
+    PatchOpKind kind;
+    std::string path;
+    std::string value;
+    int32_t start = 0;
+    int32_t deleteCount = 0;
+};
+
+std::string formatPatchOp(const PatchOp& op);
+
+// Computes a patch turning one tree into another. Identical subtrees are
+// skipped by hash; list elements are aligned by LCS over element hashes so
+// an insertion in the middle of a list is a single splice.
+class NBTDiff {
+private:
+    std::vector<PatchOp>& ops;
+    bool withTests;
+    TagHashCache hashes;
+    
+    void emit(PatchOpKind kind, const std::string& path, const std::string& value, int32_t start = 0, int32_t deleteCount = 0);
+    void diffTag(const std::string& path, const NBTTag& a, const NBTTag& b);
+    void diffCompound(const std::string& path, const NBTTag& a, const NBTTag& b);
+    void diffList(const std::string& path, const NBTTag& a, const NBTTag& b);
+    void diffArray(const std::string& path, const NBTTag& a, const NBTTag& b);
+    
+public:
+    NBTDiff(std::vector<PatchOp>& out, bool tests) : ops(out), withTests(tests) {}
+    
+    void diff(const NBTTag& a, const NBTTag& b);
+};
+
+int runDiff(const std::string& oldPath, const std::string& newPath, bool withTests, size_t threads);
+
+// A patch as written by 'diff': operations for a single file, or one
+// section per "file <relative path>" line.
+struct PatchSection {
+    std::string file;
+    std::vector<PatchOp> ops;
+};
+
+bool parsePatchOp(const std::string& line, PatchOp& op, std::string& error);
+bool parsePatch(std::istream& in, std::vector<PatchSection>& sections, std::string& error);
+bool applyPatchOp(NBTFile& nbtFile, const PatchOp& op, std::string& error);
+int runPatch(const std::string& patchPath, const std::vector<std::string>& targets, bool dryRun, size_t threads);
+
+// Write-ahead log of the editor's unsaved edits, as patch operations in
+// <file>.journal. Each edit is appended and synced before it is applied, so
+// after a crash reopening the file replays them; saving removes the log.
+// The first line records the mtime and size of the file the edits apply to,
+// and a journal written against another version of the file is not replayed.
+class EditJournal {
+private:
+    std::string path;
+    int fd = -1;
+    
+public:
+    explicit EditJournal(const std::string& file) : path(file + ".journal") {}
+    EditJournal(const EditJournal&) = delete;
+    EditJournal& operator=(const EditJournal&) = delete;
+    ~EditJournal();
+    
+    const std::string& getPath() const { return path; }
+    
+    // Reads the operations of an earlier session. A journal for another
+    // version of the file is moved aside to <file>.journal.stale. A line
+    // that does not parse ends the journal: the edits before it are still
+    // returned, with error set, and the rest is moved to <file>.journal.bad.
+    bool load(int64_t mtime, int64_t size, std::vector<PatchOp>& ops, std::string& error);
+    // Refuses an edit whose record would not read back as the same edit.
+    bool append(const PatchOp& op, int64_t mtime, int64_t size, std::string& error);
+    void clear();
+};
+
+class NBTEditor {
+private:
+    NBTFile nbtFile;
+    int currentRow = 0;
+    int scrollOffset = 0;
+    int maxVisibleRows = 0;
+    bool editing = false;
+    std::string editBuffer;
+    std::shared_ptr<NBTTag> selectedTag = nullptr;
+    std::vector<std::shared_ptr<NBTTag>> flatTagList;
+    bool modified = false;
+    std::vector<std::shared_ptr<NBTTag>> searchResults;
+    size_t searchIndex = 0;
+    
+    // The file's directory is watched rather than the file itself, so a
+    // writer that replaces it by renaming a new file over it is seen too.
+    int watchFd = -1;
+    int64_t loadedMtime = 0;
+    int64_t loadedSize = 0;
+    bool changedOnDisk = false;
+    std::string statusMessage;
+    
+    // The file is parsed on loadThread while the UI already shows, and can
+    // navigate, what has been parsed so far. Edits wait for the whole tree.
+    ProgressiveLoader loader;
+    std::thread loadThread;
+    std::atomic<bool> loading;
+    bool loadSucceeded = false;
+    std::chrono::steady_clock::time_point nextRefresh;
+    
+    EditJournal journal;
+    
+    // Compounds and lists can be folded to one row. With a memory budget
+    // they start folded, and while the tree is over budget the folded
+    // subtrees folded longest ago are evicted from memory (see
+    // NBTFile::evict) and read back when unfolded.
+    struct FoldState {
+        std::weak_ptr<NBTTag> tag;
+        bool collapsed;
+        uint64_t tick;
+    };
+    struct EvictionCandidate {
+        std::shared_ptr<NBTTag> tag;
+        uint64_t tick;
+        size_t bytes;
+    };
+    std::unordered_map<const NBTTag*, FoldState> folds;
+    uint64_t foldTick = 0;
+    size_t budget = 0;
+    
+    bool isCollapsed(const std::shared_ptr<NBTTag>& tag) const;
+    bool setCollapsed(const std::shared_ptr<NBTTag>& tag, bool collapsed);
+    void fold(int ch);
+    bool reveal(const std::shared_ptr<NBTTag>& tag);
+    size_t measureTree(const std::shared_ptr<NBTTag>& tag, int depth, bool outer,
+                       std::vector<EvictionCandidate>& candidates);
+    void enforceBudget();
+    
+    void flattenTags(const std::shared_ptr<NBTTag>& tag, int depth = 0);
+    void refreshTagList();
+    void drawEditor();
+    void handleInput(int ch);
+    void editValue();
+    void saveChanges();
+    bool applyEdit(const PatchOp& op);
+    void replayJournal();
+    void addTag();
+    void pasteSNBT();
+    void deleteTag();
+    void search();
+    void nextMatch();
+    void startWatching();
+    void checkForChanges();
+    void reloadFromDisk();
+    void startLoading();
+    bool updateLoading();
+    
+    friend int runPipelineBenchmark(const PipelineBenchmarkOptions& options);
+    
+public:
+    NBTEditor(const std::string& filename)
+        : nbtFile(filename), loading(false), journal(filename), budget(memoryBudget()) {
+        nbtFile.setCacheDir(defaultCacheDir());
+    }
+    ~NBTEditor();
+    void run();
+};
+
+std::string NBTValue::toString() const {
+    switch (type) {
+        case TagType::BYTE:
+            return std::to_string(byteVal);
+        case TagType::SHORT:
+            return std::to_string(shortVal);
+        case TagType::INT:
+            return std::to_string(intVal);
+        case TagType::LONG:
+            return std::to_string(longVal) + "L";
+        case TagType::FLOAT:
+            return std::to_string(floatVal) + "f";
+        case TagType::DOUBLE:
+            return std::to_string(doubleVal);
+        case TagType::STRING:
+            return "\"" + stringVal + "\"";
+        case TagType::BYTE_ARRAY:
+            return "[" + std::to_string(byteArrayVal.size()) + " bytes]";
+        case TagType::INT_ARRAY:
+            return "[" + std::to_string(intArrayVal.size()) + " ints]";
+        case TagType::LONG_ARRAY:
+            return "[" + std::to_string(longArrayVal.size()) + " longs]";
+        case TagType::LIST:
+            return "[" + std::to_string(listVal.size()) + " items]";
+        case TagType::COMPOUND:
+            return "{" + std::to_string(compoundVal.size()) + " entries}";
+        default:
+            return "";
+    }
+}
+
+std::string NBTTag::toString(int indent) const {
+    std::string indentStr(indent * 2, ' ');
+    std::string result = indentStr + tagTypeToString(type);
+    
+    if (!name.empty()) {
+        result += "(\"" + name + "\")";
+    }
+    
+    result += ": " + value.toString();
+    return result;
+}
+
+// Throws std::invalid_argument unless all of str is the number and
+// std::out_of_range when it does not fit the tag's type.
+void NBTTag::setValueFromString(const std::string& str) {
+    size_t pos = 0;
+    auto integer = [&](long long low, long long high) {
+        long long parsed = std::stoll(str, &pos);
+        if (pos != str.size()) throw std::invalid_argument(str);
+        if (parsed < low || parsed > high) throw std::out_of_range(str);
+        return parsed;
+    };
+    switch (type) {
+        case TagType::BYTE:
+            value.byteVal = static_cast<int8_t>(integer(INT8_MIN, INT8_MAX));
+            break;
+        case TagType::SHORT:
+            value.shortVal = static_cast<int16_t>(integer(INT16_MIN, INT16_MAX));
+            break;
+        case TagType::INT:
+            value.intVal = static_cast<int32_t>(integer(INT32_MIN, INT32_MAX));
+            break;
+        case TagType::LONG:
+            value.longVal = integer(LLONG_MIN, LLONG_MAX);
+            break;
+        case TagType::FLOAT:
+            value.floatVal = std::stof(str, &pos);
+            if (pos != str.size()) throw std::invalid_argument(str);
+            break;
+        case TagType::DOUBLE:
+            value.doubleVal = std::stod(str, &pos);
+            if (pos != str.size()) throw std::invalid_argument(str);
+            break;
+        case TagType::STRING:
+            value.stringVal = str;
+            break;
+        default:
+            break;
+    }
+}
+
+int8_t NBTFile::readByte(std::istream& file) {
+    int8_t value;
+    file.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return value;
+}
+
+int16_t NBTFile::readShort(std::istream& file) {
+    int16_t value;
+    file.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return ((value & 0xFF) << 8) | ((value & 0xFF00) >> 8);
+}
+
+int32_t NBTFile::readInt(std::istream& file) {
+    int32_t value;
+    file.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return ((value & 0xFF) << 24) | 
+           ((value & 0xFF00) << 8) | 
+           ((value & 0xFF0000) >> 8) | 
+           ((value & 0xFF000000) >> 24);
+}
+
+int64_t NBTFile::readLong(std::istream& file) {
+    int64_t value;
+    file.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return ((value & 0xFFLL) << 56) | 
+           ((value & 0xFF00LL) << 40) | 
+           ((value & 0xFF0000LL) << 24) | 
+           ((value & 0xFF000000LL) << 8) | 
+           ((value & 0xFF00000000LL) >> 8) | 
+           ((value & 0xFF0000000000LL) >> 24) | 
+           ((value & 0xFF000000000000LL) >> 40) | 
+           ((value & 0xFF00000000000000LL) >> 56);
+}
+
+float NBTFile::readFloat(std::istream& file) {
+    int32_t intValue = readInt(file);
+    float value;
+    std::memcpy(&value, &intValue, sizeof(value));
+    return value;
+}
+
+double NBTFile::readDouble(std::istream& file) {
+    int64_t longValue = readLong(file);
+    double value;
+    std::memcpy(&value, &longValue, sizeof(value));
+    return value;
+}
+
+std::string NBTFile::readString(std::istream& file) {
+    uint16_t length = static_cast<uint16_t>(readShort(file));
+    std::string value(length, '\0');
+    file.read(&value[0], length);
+    return value;
+}
+
+void NBTFile::writeByte(std::ostream& file, int8_t value) {
+    file.write(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+void NBTFile::writeShort(std::ostream& file, int16_t value) {
+    int16_t beValue = ((value & 0xFF) << 8) | ((value & 0xFF00) >> 8);
+    file.write(reinterpret_cast<char*>(&beValue), sizeof(beValue));
+}
+
+void NBTFile::writeInt(std::ostream& file, int32_t value) {
+    int32_t beValue = ((value & 0xFF) << 24) | 
+                      ((value & 0xFF00) << 8) | 
+                      ((value & 0xFF0000) >> 8) | 
+                      ((value & 0xFF000000) >> 24);
+    file.write(reinterpret_cast<char*>(&beValue), sizeof(beValue));
+}
+
+void NBTFile::writeLong(std::ostream& file, int64_t value) {
+    int64_t beValue = ((value & 0xFFLL) << 56) | 
+                      ((value & 0xFF00LL) << 40) | 
+                      ((value & 0xFF0000LL) << 24) | 
+                      ((value & 0xFF000000LL) << 8) | 
+                      ((value & 0xFF00000000LL) >> 8) | 
+                      ((value & 0xFF0000000000LL) >> 24) | 
+                      ((value & 0xFF000000000000LL) >> 40) | 
+                      ((value & 0xFF00000000000000LL) >> 56);
+    file.write(reinterpret_cast<char*>(&beValue), sizeof(beValue));
+}
+
+void NBTFile::writeFloat(std::ostream& file, float value) {
+    int32_t intValue;
+    std::memcpy(&intValue, &value, sizeof(value));
+    writeInt(file, intValue);
+}
+
+void NBTFile::writeDouble(std::ostream& file, double value) {
+    int64_t longValue;
+    std::memcpy(&longValue, &value, sizeof(value));
+    writeLong(file, longValue);
+}
+
+void NBTFile::writeString(std::ostream& file, const std::string& value) {
+    if (value.length() > 0xFFFF) {
+        throw std::runtime_error("string of " + std::to_string(value.length()) + " bytes exceeds the 65535 byte limit");
+    }
+    writeShort(file, static_cast<int16_t>(static_cast<uint16_t>(value.length())));
+    file.write(value.c_str(), value.length());
+}
+
+static const int MAX_NBT_DEPTH = 512;
+
+void NBTFile::readTag(std::istream& file, std::shared_ptr<NBTTag>& tag) {
+    TagType type = static_cast<TagType>(readByte(file));
+    if (type == TagType::END) {
+        tag = nullptr;
+        return;
+    }
+    if (static_cast<uint8_t>(type) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+        throw std::runtime_error("invalid tag type " + std::to_string(static_cast<int>(type)));
+    }
+
+    std::string name = readString(file);
+    tag = std::make_shared<NBTTag>(type, name);
+    readPayload(file, *tag, 0);
+}
+
+void NBTFile::readPayload(std::istream& file, NBTTag& tag, int depth) {
+    if (depth > MAX_NBT_DEPTH) {
+        throw std::runtime_error("NBT nesting deeper than " + std::to_string(MAX_NBT_DEPTH));
+    }
+
+    switch (tag.type) {
+        case TagType::BYTE:
+            tag.value.byteVal = readByte(file);
+            break;
+        case TagType::SHORT:
+            tag.value.shortVal = readShort(file);
+            break;
+        case TagType::INT:
+            tag.value.intVal = readInt(file);
+            break;
+        case TagType::LONG:
+            tag.value.longVal = readLong(file);
+            break;
+        case TagType::FLOAT:
+            tag.value.floatVal = readFloat(file);
+            break;
+        case TagType::DOUBLE:
+            tag.value.doubleVal = readDouble(file);
+            break;
+        case TagType::STRING:
+            tag.value.stringVal = readString(file);
+            break;
+        case TagType::BYTE_ARRAY: {
+            int32_t length = readInt(file);
+            if (length < 0) throw std::runtime_error("negative byte array length");
+            tag.value.byteArrayVal.resize(length);
+            if (length > 0) {
+                file.read(reinterpret_cast<char*>(tag.value.byteArrayVal.data()), length);
+            }
+            break;
+        }
+        case TagType::INT_ARRAY: {
+            int32_t length = readInt(file);
+            if (length < 0) throw std::runtime_error("negative int array length");
+            tag.value.intArrayVal.resize(length);
+            for (int32_t i = 0; i < length; i++) {
+                tag.value.intArrayVal[i] = readInt(file);
+            }
+            break;
+        }
+        case TagType::LONG_ARRAY: {
+            int32_t length = readInt(file);
+            if (length < 0) throw std::runtime_error("negative long array length");
+            tag.value.longArrayVal.resize(length);
+            for (int32_t i = 0; i < length; i++) {
+                tag.value.longArrayVal[i] = readLong(file);
+            }
+            break;
+        }
+        case TagType::LIST: {
+            TagType elementType = static_cast<TagType>(readByte(file));
+            int32_t length = readInt(file);
+            if (static_cast<uint8_t>(elementType) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+                throw std::runtime_error("invalid list element type " + std::to_string(static_cast<int>(elementType)));
+            }
+            if (length < 0) throw std::runtime_error("negative list length");
+            tag.value.listType = elementType;
+            for (int32_t i = 0; i < length; i++) {
+                auto item = std::make_shared<NBTTag>(elementType, "");
+                readPayload(file, *item, depth + 1);
+                tag.value.listVal.push_back(item);
+            }
+            break;
+        }
+        case TagType::COMPOUND: {
+            while (true) {
+                TagType childType = static_cast<TagType>(readByte(file));
+                if (childType == TagType::END) break;
+                if (static_cast<uint8_t>(childType) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+                    throw std::runtime_error("invalid tag type " + std::to_string(static_cast<int>(childType)));
+                }
+                std::string childName = readString(file);
+                auto child = std::make_shared<NBTTag>(childType, childName);
+                // Top-level subtrees get a span each, to see which one is slow.
+                TraceSpan span(depth == 0 ? "parse" : nullptr, &childName);
+                readPayload(file, *child, depth + 1);
+                tag.value.compoundVal[childName] = child;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void NBTFile::writeTag(std::ostream& file, const std::shared_ptr<NBTTag>& tag) {
+    writeByte(file, static_cast<int8_t>(tag->type));
+    writeString(file, tag->name);
+    writePayload(file, *tag);
+}
+
+void NBTFile::writePayload(std::ostream& file, const NBTTag& tag) {
+    if (!evicted.empty() && (tag.type == TagType::COMPOUND || tag.type == TagType::LIST)) {
+        const EvictedTag* entry = findEvicted(tag);
+        std::string payload;
+        if (entry) {
+            if (!readEvicted(*entry, payload)) throw std::runtime_error(lastError);
+            file.write(payload.data(), payload.size());
+            return;
+        }
+    }
+    
+    switch (tag.type) {
+        case TagType::BYTE:
+            writeByte(file, tag.value.byteVal);
+            break;
+        case TagType::SHORT:
+            writeShort(file, tag.value.shortVal);
+            break;
+        case TagType::INT:
+            writeInt(file, tag.value.intVal);
+            break;
+        case TagType::LONG:
+            writeLong(file, tag.value.longVal);
+            break;
+        case TagType::FLOAT:
+            writeFloat(file, tag.value.floatVal);
+            break;
+        case TagType::DOUBLE:
+            writeDouble(file, tag.value.doubleVal);
+            break;
+        case TagType::STRING:
+            writeString(file, tag.value.stringVal);
+            break;
+        case TagType::BYTE_ARRAY:
+            writeInt(file, static_cast<int32_t>(tag.value.byteArrayVal.size()));
+            file.write(reinterpret_cast<const char*>(tag.value.byteArrayVal.data()), tag.value.byteArrayVal.size());
+            break;
+        case TagType::INT_ARRAY:
+            writeInt(file, static_cast<int32_t>(tag.value.intArrayVal.size()));
+            for (int32_t v : tag.value.intArrayVal) {
+                writeInt(file, v);
+            }
+            break;
+        case TagType::LONG_ARRAY:
+            writeInt(file, static_cast<int32_t>(tag.value.longArrayVal.size()));
+            for (int64_t v : tag.value.longArrayVal) {
+                writeLong(file, v);
+            }
+            break;
+        case TagType::LIST: {
+            TagType elementType = tag.value.listVal.empty() ? tag.value.listType : tag.value.listVal[0]->type;
+            writeByte(file, static_cast<int8_t>(elementType));
+            writeInt(file, static_cast<int32_t>(tag.value.listVal.size()));
+            for (const auto& item : tag.value.listVal) {
+                if (item->type != elementType) {
+                    throw std::runtime_error("list contains mixed tag types");
+                }
+                writePayload(file, *item);
+            }
+            break;
+        }
+        case TagType::COMPOUND:
+            for (const auto& pair : tag.value.compoundVal) {
+                writeByte(file, static_cast<int8_t>(pair.second->type));
+                writeString(file, pair.first);
+                writePayload(file, *pair.second);
+            }
+            writeByte(file, static_cast<int8_t>(TagType::END));
+            break;
+        default:
+            break;
+    }
+}
+
+Compression detectCompression(const std::string& data) {
+    if (data.size() >= 2 && static_cast<uint8_t>(data[0]) == 0x1F && static_cast<uint8_t>(data[1]) == 0x8B) {
+        return Compression::GZIP;
+    }
+    if (data.size() >= 2 && static_cast<uint8_t>(data[0]) == 0x78 &&
+        ((static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1])) % 31 == 0) {
+        return Compression::ZLIB;
+    }
+    return Compression::NONE;
+}
+
+bool statFile(const std::string& path, int64_t& mtime, int64_t& size) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    size = st.st_size;
+    return true;
+}
+
+bool readFileBytes(const std::string& path, std::string& out) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    file.seekg(0, std::ios::end);
+    std::streamoff size = file.tellg();
+    if (size < 0) return false;
+    file.seekg(0, std::ios::beg);
+
+    out.resize(static_cast<size_t>(size));
+    if (size > 0) {
+        file.read(&out[0], size);
+    }
+    return static_cast<bool>(file);
+}
+
+static bool syncDirectory(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0 || errno == EINVAL;
+    close(fd);
+    return ok;
+}
+
+bool writeFileAtomic(const std::string& path, const char* data, size_t size, bool keepOld, std::string& error) {
+    // Replace the file a symlink points to, not the link.
+    std::string target = path;
+    struct stat st;
+    bool exists = lstat(path.c_str(), &st) == 0;
+    if (exists && S_ISLNK(st.st_mode)) {
+        char* resolved = realpath(path.c_str(), nullptr);
+        if (resolved) {
+            target = resolved;
+            free(resolved);
+        }
+        exists = stat(target.c_str(), &st) == 0;
+    }
+    size_t slash = target.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : target.substr(0, slash);
+
+    static std::atomic<unsigned> counter(0);
+    std::string temp = target + ".tmp" + std::to_string(getpid()) + "." + std::to_string(counter++);
+    mode_t mode = exists ? (st.st_mode & 07777) : 0666;
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd < 0) {
+        error = "cannot create " + temp + ": " + strerror(errno);
+        return false;
+    }
+    if (exists) {
+        // The umask applies to open; keep exactly the original permissions,
+        // and the owner where we are allowed to.
+        if (fchmod(fd, mode) != 0 || (fchown(fd, st.st_uid, st.st_gid) != 0 && errno != EPERM)) {
+            error = "cannot set permissions of " + temp + ": " + strerror(errno);
+            close(fd);
+            unlink(temp.c_str());
+            return false;
+        }
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += static_cast<size_t>(n);
+    }
+    if (written < size || fsync(fd) != 0) {
+        error = "write to " + temp + " failed: " + strerror(errno);
+        close(fd);
+        unlink(temp.c_str());
+        return false;
+    }
+    if (close(fd) != 0) {
+        error = "write to " + temp + " failed: " + strerror(errno);
+        unlink(temp.c_str());
+        return false;
+    }
+
+    std::string old = target + "_old";
+    bool movedOld = false;
+    if (keepOld && exists) {
+        // A second link to the old file, so target itself is never missing.
+        // File systems without hard links get a rename instead, which leaves
+        // target missing (but the old contents kept) until the next rename.
+        unlink(old.c_str());
+        if (link(target.c_str(), old.c_str()) != 0) {
+            if (rename(target.c_str(), old.c_str()) != 0) {
+                error = "cannot keep " + old + ": " + strerror(errno);
+                unlink(temp.c_str());
+                return false;
+            }
+            movedOld = true;
+        }
+    }
+    if (rename(temp.c_str(), target.c_str()) != 0) {
+        error = "cannot replace " + target + ": " + strerror(errno);
+        unlink(temp.c_str());
+        // Put the old file back rather than leave target missing.
+        if (movedOld && rename(old.c_str(), target.c_str()) != 0) {
+            error += "; the previous contents are in " + old;
+        }
+        return false;
+    }
+    // The new contents are in place either way; only their durability
+    // across a crash is in doubt.
+    if (!syncDirectory(dir)) {
+        std::cerr << "warning: cannot sync " << dir << ": " << strerror(errno) << std::endl;
+    }
+    return true;
+}
+
+bool keepOldFiles() {
+    static const bool keep = [] {
+        const char* setting = std::getenv("NBTEDIT_KEEP_OLD");
+        return setting && *setting && strcmp(setting, "0") != 0 && strcmp(setting, "off") != 0;
+    }();
+    return keep;
+}
+
+static bool readSource(const std::string& path, IOBuffers& buffers) {
+    return buffers.prefetcher ? buffers.prefetcher->read(path, buffers.raw) : readFileBytes(path, buffers.raw);
+}
+
+// zlib allocates its window and state on init. Batch runs inflate thousands
+// of files per thread, so each thread keeps its streams and resets them.
+struct ThreadZStreams {
+    z_stream inflater;
+    z_stream deflaters[2];
+    bool inflaterReady = false;
+    bool deflaterReady[2] = {false, false};
+    int deflaterLevel[2] = {Z_DEFAULT_COMPRESSION, Z_DEFAULT_COMPRESSION};
+    
+    ~ThreadZStreams() {
+        if (inflaterReady) inflateEnd(&inflater);
+        for (int i = 0; i < 2; i++) {
+            if (deflaterReady[i]) deflateEnd(&deflaters[i]);
+        }
+    }
+};
+
+static ThreadZStreams& threadZStreams() {
+    thread_local ThreadZStreams streams;
+    return streams;
+}
+
+bool inflateData(const char* data, size_t size, std::string& out, std::string& error) {
+    TraceSpan span("inflate");
+    ThreadZStreams& streams = threadZStreams();
+    z_stream& stream = streams.inflater;
+    if (!streams.inflaterReady) {
+        std::memset(&stream, 0, sizeof(stream));
+        // 15 + 32: accept both gzip and zlib headers.
+        if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+            error = "inflateInit2 failed";
+            return false;
+        }
+        streams.inflaterReady = true;
+    } else {
+        inflateReset(&stream);
+    }
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = static_cast<uInt>(size);
+
+    out.clear();
+    size_t produced = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        if (out.size() - produced < 16384) {
+            out.resize(std::max<size_t>(out.size() * 2, size * 4 + 16384));
+        }
+        stream.next_out = reinterpret_cast<Bytef*>(&out[produced]);
+        stream.avail_out = static_cast<uInt>(out.size() - produced);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        produced = out.size() - stream.avail_out;
+        if (ret == Z_STREAM_END) break;
+        if (ret != Z_OK || (stream.avail_in == 0 && stream.avail_out != 0)) {
+            error = std::string("inflate failed: ") + (stream.msg ? stream.msg : "truncated data");
+            return false;
+        }
+    }
+
+    out.resize(produced);
+    return true;
+}
+
+bool deflateData(const std::string& in, Compression compression, std::string& out, std::string& error, int level) {
+    TraceSpan span("deflate");
+    if (compression == Compression::NONE) {
+        out = in;
+        return true;
+    }
+
+    ThreadZStreams& streams = threadZStreams();
+    int slot = compression == Compression::GZIP ? 0 : 1;
+    z_stream& stream = streams.deflaters[slot];
+    if (!streams.deflaterReady[slot]) {
+        std::memset(&stream, 0, sizeof(stream));
+        int windowBits = compression == Compression::GZIP ? 15 + 16 : 15;
+        if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error = "deflateInit2 failed";
+            return false;
+        }
+        streams.deflaterReady[slot] = true;
+        streams.deflaterLevel[slot] = level;
+    } else {
+        deflateReset(&stream);
+        if (streams.deflaterLevel[slot] != level) {
+            if (deflateParams(&stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+                error = "deflateParams failed";
+                return false;
+            }
+            streams.deflaterLevel[slot] = level;
+        }
+    }
+
+    out.resize(deflateBound(&stream, in.size()) + 32);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    stream.avail_in = static_cast<uInt>(in.size());
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+
+    int ret = deflate(&stream, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        error = "deflate failed";
+        return false;
+    }
+    out.resize(stream.total_out);
+    return true;
+}
+
+DeflateStreamBuf::DeflateStreamBuf(std::ostream& out, Compression compression, int level, size_t bufferSize)
+    : sink(out), input(bufferSize), output(bufferSize) {
+    std::memset(&stream, 0, sizeof(stream));
+    int windowBits = compression == Compression::GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    setp(input.data(), input.data() + input.size());
+}
+
+DeflateStreamBuf::~DeflateStreamBuf() {
+    deflateEnd(&stream);
+}
+
+// Compresses what has been written since the last call.
+bool DeflateStreamBuf::compress(int flush) {
+    TraceSpan span("deflate");
+    stream.next_in = reinterpret_cast<Bytef*>(pbase());
+    stream.avail_in = static_cast<uInt>(pptr() - pbase());
+    int ret;
+    do {
+        stream.next_out = reinterpret_cast<Bytef*>(output.data());
+        stream.avail_out = static_cast<uInt>(output.size());
+        ret = deflate(&stream, flush);
+        if (ret == Z_STREAM_ERROR) return false;
+        sink.write(output.data(), output.size() - stream.avail_out);
+    } while (stream.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    setp(input.data(), input.data() + input.size());
+    return static_cast<bool>(sink);
+}
+
+DeflateStreamBuf::int_type DeflateStreamBuf::overflow(int_type ch) {
+    if (finished || !compress(Z_NO_FLUSH)) return traits_type::eof();
+    if (ch != traits_type::eof()) {
+        *pptr() = static_cast<char>(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+bool DeflateStreamBuf::finish() {
+    if (finished) return true;
+    finished = true;
+    return compress(Z_FINISH);
+}
+
+InflateStreamBuf::InflateStreamBuf(std::istream& src, size_t bufferSize)
+    : source(src), input(bufferSize), output(bufferSize) {
+    std::memset(&stream, 0, sizeof(stream));
+    setg(output.data(), output.data(), output.data());
+
+    fillInput();
+    const unsigned char* head = reinterpret_cast<const unsigned char*>(input.data());
+    bool gzip = stream.avail_in >= 2 && head[0] == 0x1F && head[1] == 0x8B;
+    bool zlib = stream.avail_in >= 2 && head[0] == 0x78 && ((head[0] << 8) | head[1]) % 31 == 0;
+    passthrough = !gzip && !zlib;
+    if (!passthrough && inflateInit2(&stream, 15 + 32) != Z_OK) {
+        throw std::runtime_error("inflateInit2 failed");
+    }
+}
+
+InflateStreamBuf::~InflateStreamBuf() {
+    if (!passthrough) inflateEnd(&stream);
+}
+
+bool InflateStreamBuf::fillInput() {
+    source.read(input.data(), input.size());
+    stream.next_in = reinterpret_cast<Bytef*>(input.data());
+    stream.avail_in = static_cast<uInt>(source.gcount());
+    return stream.avail_in > 0;
+}
+
+InflateStreamBuf::int_type InflateStreamBuf::underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    TraceSpan span("inflate");
+
+    if (passthrough) {
+        // The first block was read before we knew the data is uncompressed.
+        if (stream.avail_in == 0 && !fillInput()) return traits_type::eof();
+        char* data = reinterpret_cast<char*>(stream.next_in);
+        setg(data, data, data + stream.avail_in);
+        stream.avail_in = 0;
+        return traits_type::to_int_type(*gptr());
+    }
+
+    while (!finished) {
+        if (stream.avail_in == 0 && !fillInput()) {
+            throw std::runtime_error("truncated compressed data");
+        }
+        stream.next_out = reinterpret_cast<Bytef*>(output.data());
+        stream.avail_out = static_cast<uInt>(output.size());
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            finished = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            throw std::runtime_error(std::string("inflate failed: ") + (stream.msg ? stream.msg : "corrupt data"));
+        }
+        size_t produced = output.size() - stream.avail_out;
+        if (produced > 0) {
+            setg(output.data(), output.data(), output.data() + produced);
+            return traits_type::to_int_type(*gptr());
+        }
+    }
+    return traits_type::eof();
+}
+
+bool NBTFile::parse(const char* data, size_t size) {
+    TraceSpan span("parse");
+    MemoryStreamBuf buffer(data, size);
+    std::istream stream(&buffer);
+    stream.exceptions(std::ios::failbit | std::ios::badbit);
+
+    try {
+        std::shared_ptr<NBTTag> root;
+        readTag(stream, root);
+        if (!root) {
+            lastError = "file does not start with a named tag";
+            return false;
+        }
+        rootTag = root;
+    } catch (const std::ios_base::failure&) {
+        lastError = "unexpected end of data";
+        return false;
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return false;
+    }
+    return true;
+}
+
+void NBTFile::readEvents(std::istream& file, NBTEventHandler& handler, TagType type, const std::string& name, int depth) {
+    if (depth > MAX_NBT_DEPTH) {
+        throw std::runtime_error("NBT nesting deeper than " + std::to_string(MAX_NBT_DEPTH));
+    }
+    if (!handler.enter(name, type)) {
+        skipPayload(file, type, depth);
+        return;
+    }
+
+    switch (type) {
+        case TagType::BYTE:
+            handler.integer(name, type, readByte(file));
+            break;
+        case TagType::SHORT:
+            handler.integer(name, type, readShort(file));
+            break;
+        case TagType::INT:
+            handler.integer(name, type, readInt(file));
+            break;
+        case TagType::LONG:
+            handler.integer(name, type, readLong(file));
+            break;
+        case TagType::FLOAT:
+            handler.floating(name, type, readFloat(file));
+            break;
+        case TagType::DOUBLE:
+            handler.floating(name, type, readDouble(file));
+            break;
+        case TagType::STRING:
+            handler.string(name, readString(file));
+            break;
+        case TagType::BYTE_ARRAY:
+        case TagType::INT_ARRAY:
+        case TagType::LONG_ARRAY: {
+            int32_t length = readInt(file);
+            if (length < 0) throw std::runtime_error("negative array length");
+            handler.beginArray(name, type, length);
+            int64_t slice[1024];
+            int32_t remaining = length;
+            while (remaining > 0) {
+                size_t count = std::min<size_t>(remaining, 1024);
+                for (size_t i = 0; i < count; i++) {
+                    slice[i] = type == TagType::BYTE_ARRAY ? readByte(file) :
+                               type == TagType::INT_ARRAY ? readInt(file) : readLong(file);
+                }
+                handler.arrayValues(slice, count);
+                remaining -= static_cast<int32_t>(count);
+            }
+            handler.endArray();
+            break;
+        }
+        case TagType::LIST: {
+            TagType elementType = static_cast<TagType>(readByte(file));
+            int32_t length = readInt(file);
+            if (static_cast<uint8_t>(elementType) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+                throw std::runtime_error("invalid list element type " + std::to_string(static_cast<int>(elementType)));
+            }
+            if (length < 0) throw std::runtime_error("negative list length");
+            handler.beginList(name, elementType, length);
+            static const std::string noName;
+            for (int32_t i = 0; i < length; i++) {
+                readEvents(file, handler, elementType, noName, depth + 1);
+            }
+            handler.endList();
+            break;
+        }
+        case TagType::COMPOUND: {
+            handler.beginCompound(name);
+            while (true) {
+                TagType childType = static_cast<TagType>(readByte(file));
+                if (childType == TagType::END) break;
+                if (static_cast<uint8_t>(childType) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+                    throw std::runtime_error("invalid tag type " + std::to_string(static_cast<int>(childType)));
+                }
+                std::string childName = readString(file);
+                TraceSpan span(depth == 0 ? "parse" : nullptr, &childName);
+                readEvents(file, handler, childType, childName, depth + 1);
+            }
+            handler.endCompound();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void skipBytes(std::istream& file, int64_t count) {
+    while (count > 0) {
+        std::streamsize chunk = static_cast<std::streamsize>(std::min<int64_t>(count, 1 << 30));
+        file.ignore(chunk);
+        if (file.gcount() != chunk) {
+            throw std::runtime_error("unexpected end of data");
+        }
+        count -= chunk;
+    }
+}
+
+static int64_t payloadSize(TagType type) {
+    switch (type) {
+        case TagType::BYTE: return 1;
+        case TagType::SHORT: return 2;
+        case TagType::INT:
+        case TagType::FLOAT: return 4;
+        case TagType::LONG:
+        case TagType::DOUBLE: return 8;
+        default: return -1;
+    }
+}
+
+// Consumes a payload without decoding it; fixed-size data is skipped in one
+// go, so pruned subtrees cost little more than the bytes they occupy.
+void NBTFile::skipPayload(std::istream& file, TagType type, int depth) {
+    if (depth > MAX_NBT_DEPTH) {
+        throw std::runtime_error("NBT nesting deeper than " + std::to_string(MAX_NBT_DEPTH));
+    }
+
+    int64_t size = payloadSize(type);
+    if (size > 0) {
+        skipBytes(file, size);
+        return;
+    }
+
+    switch (type) {
+        case TagType::STRING:
+            skipBytes(file, static_cast<uint16_t>(readShort(file)));
+            break;
+        case TagType::BYTE_ARRAY:
+        case TagType::INT_ARRAY:
+        case TagType::LONG_ARRAY: {
+            int32_t length = readInt(file);
+            if (length < 0) throw std::runtime_error("negative array length");
+            skipBytes(file, static_cast<int64_t>(length) *
+                            (type == TagType::BYTE_ARRAY ? 1 : type == TagType::INT_ARRAY ? 4 : 8));
+            break;
+        }
+        case TagType::LIST: {
+            TagType elementType = static_cast<TagType>(readByte(file));
+            int32_t length = readInt(file);
+            if (static_cast<uint8_t>(elementType) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+                throw std::runtime_error("invalid list element type " + std::to_string(static_cast<int>(elementType)));
+            }
+            if (length < 0) throw std::runtime_error("negative list length");
+            int64_t elementSize = payloadSize(elementType);
+            if (elementSize > 0) {
+                skipBytes(file, elementSize * length);
+            } else if (elementType != TagType::END) {
+                for (int32_t i = 0; i < length; i++) {
+                    skipPayload(file, elementType, depth + 1);
+                }
+            }
+            break;
+        }
+        case TagType::COMPOUND:
+            while (true) {
+                TagType childType = static_cast<TagType>(readByte(file));
+                if (childType == TagType::END) break;
+                if (static_cast<uint8_t>(childType) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+                    throw std::runtime_error("invalid tag type " + std::to_string(static_cast<int>(childType)));
+                }
+                skipBytes(file, static_cast<uint16_t>(readShort(file)));
+                skipPayload(file, childType, depth + 1);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+bool NBTFile::streamEvents(std::istream& in, NBTEventHandler& handler) {
+    TraceSpan span("parse");
+    in.exceptions(std::ios::failbit | std::ios::badbit);
+    try {
+        TagType type = static_cast<TagType>(readByte(in));
+        if (type == TagType::END || static_cast<uint8_t>(type) > static_cast<uint8_t>(TagType::LONG_ARRAY)) {
+            lastError = "file does not start with a named tag";
+            return false;
+        }
+        std::string name = readString(in);
+        readEvents(in, handler, type, name, 0);
+    } catch (const std::ios_base::failure&) {
+        lastError = "unexpected end of data";
+        return false;
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool NBTFile::streamFile(NBTEventHandler& handler) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        lastError = "cannot read " + filename;
+        return false;
+    }
+    char magic[2];
+    file.read(magic, sizeof(magic));
+    compression = detectCompression(std::string(magic, static_cast<size_t>(file.gcount())));
+    file.clear();
+    file.seekg(0);
+
+    try {
+        InflateStreamBuf buffer(file);
+        std::istream stream(&buffer);
+        return streamEvents(stream, handler);
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return false;
+    }
+}
+
+bool NBTFile::streamLoad(NBTEventHandler& handler) {
+    TraceSpan span("load");
+    AllocationScope scope(AllocationPhase::LOAD);
+    int64_t snapshotMtime = 0;
+    int64_t snapshotSize = 0;
+    if (!cacheDir.empty() && statFile(filename, snapshotMtime, snapshotSize)) {
+        // Once events have been delivered from the snapshot, falling back to
+        // the file would deliver them twice.
+        bool streamed = false;
+        auto consume = [&](const char* payload, size_t length) {
+            MemoryStreamBuf memory(payload, length);
+            std::istream stream(&memory);
+            return streamEvents(stream, handler);
+        };
+        if (readSnapshot(snapshotSize, snapshotMtime, consume, streamed)) return streamed;
+    }
+
+    // Uncompressed files are read whole, for the hashes in-place saves need.
+    int64_t mtime = 0;
+    int64_t size = 0;
+    std::ifstream file(filename, std::ios::binary);
+    char magic[2] = {0, 0};
+    file.read(magic, sizeof(magic));
+    if (detectCompression(std::string(magic, static_cast<size_t>(file.gcount()))) != Compression::NONE ||
+        !statFile(filename, mtime, size)) {
+        return streamFile(handler);
+    }
+    file.close();
+    std::string data;
+    if (!readFileBytes(filename, data)) {
+        lastError = "cannot read " + filename;
+        return false;
+    }
+    compression = Compression::NONE;
+    MemoryStreamBuf memory(data.data(), data.size());
+    std::istream stream(&memory);
+    if (!streamEvents(stream, handler)) return false;
+    if (static_cast<size_t>(size) == data.size()) recordBlocks(data, mtime);
+    return true;
+}
+
+bool NBTFile::serialize(std::string& out) {
+    TraceSpan span("serialize");
+    if (!rootTag) {
+        lastError = "nothing to save";
+        return false;
+    }
+
+    out.clear();
+    StringStreamBuf buffer(out);
+    std::ostream stream(&buffer);
+    try {
+        writeTag(stream, rootTag);
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool NBTFile::load() {
+    IOBuffers buffers;
+    return load(buffers);
+}
+
+bool NBTFile::load(IOBuffers& buffers) {
+    TraceSpan span("load");
+    AllocationScope scope(AllocationPhase::LOAD);
+    int64_t mtime = 0;
+    int64_t size = 0;
+    bool statted = statFile(filename, mtime, size);
+    bool cacheable = !cacheDir.empty() && statted;
+    if (cacheable && loadSnapshot(size, mtime)) {
+        if (buffers.prefetcher) buffers.prefetcher->skip(filename);
+        return true;
+    }
+
+    if (!readSource(filename, buffers)) {
+        lastError = "cannot read " + filename;
+        return false;
+    }
+
+    compression = detectCompression(buffers.raw);
+    if (compression == Compression::NONE) {
+        if (!parse(buffers.raw.data(), buffers.raw.size())) return false;
+        // Stat'ed before reading, so a change in between shows at save time.
+        if (statted && static_cast<size_t>(size) == buffers.raw.size()) recordBlocks(buffers.raw, mtime);
+        return true;
+    }
+
+    if (!inflateData(buffers.raw.data(), buffers.raw.size(), buffers.data, lastError) ||
+        !parse(buffers.data.data(), buffers.data.size())) {
+        return false;
+    }
+    // Keyed by the stat from before reading: if the file changed in
+    // between, the snapshot is stale on arrival and simply never matches.
+    if (cacheable && buffers.data.size() >= SNAPSHOT_MIN_SIZE && static_cast<size_t>(size) == buffers.raw.size()) {
+        storeSnapshot(buffers.data, mtime, size);
+    }
+    return true;
+}
+
+bool NBTFile::save() {
+    IOBuffers buffers;
+    return save(buffers);
+}
+
+bool NBTFile::save(IOBuffers& buffers) {
+    TraceSpan span("save");
+    AllocationScope scope(AllocationPhase::SAVE);
+    if (!serialize(buffers.data)) {
+        return false;
+    }
+    if (compression == Compression::NONE && !keepOldFiles() && patchInPlace(buffers.data)) {
+        return true;
+    }
+
+    const std::string* output = &buffers.data;
+    if (compression != Compression::NONE) {
+        if (!deflateData(buffers.data, compression, buffers.raw, lastError)) {
+            return false;
+        }
+        output = &buffers.raw;
+    }
+
+    if (!writeFileAtomic(filename, output->data(), output->size(), keepOldFiles(), lastError)) {
+        return false;
+    }
+    int64_t mtime, size;
+    blockHashes.clear();
+    if (!statFile(filename, mtime, size)) return true;
+    if (compression == Compression::NONE) {
+        recordBlocks(buffers.data, mtime);
+    }
+    if (!cacheDir.empty() && compression != Compression::NONE && buffers.data.size() >= SNAPSHOT_MIN_SIZE) {
+        storeSnapshot(buffers.data, mtime, size);
+    }
+    return true;
+}
+
+static bool isPathKeyEnd(char c) {
+    return c == '.' || c == '[' || c == ']' || c == '{' || c == '}' || c == '"' || c == '\'' ||
+           c == ' ' || c == '\t';
+}
+
+bool NBTPath::compile(const std::string& path, std::string& error) {
+    text = path;
+    steps.clear();
+
+    size_t pos = 0;
+    auto parseFilter = [&](std::shared_ptr<NBTTag>& filter) {
+        SNBTParser parser(path.data() + pos, path.size() - pos);
+        size_t consumed = 0;
+        if (!parser.parsePrefix(filter, error, consumed)) {
+            error = "bad filter in path: " + error;
+            return false;
+        }
+        pos += consumed;
+        return true;
+    };
+    auto parseKey = [&](std::string& key) {
+        key.clear();
+        if (pos < path.size() && (path[pos] == '"' || path[pos] == '\'')) {
+            char quote = path[pos++];
+            while (pos < path.size() && path[pos] != quote) {
+                char c = path[pos++];
+                if (c == '\\' && pos < path.size()) {
+                    c = path[pos++];
+                    c = c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c;
+                }
+                key += c;
+            }
+            if (pos >= path.size()) {
+                error = "unterminated quoted key in path";
+                return false;
+            }
+            pos++;
+            return true;
+        }
+        while (pos < path.size() && !isPathKeyEnd(path[pos])) {
+            key += path[pos++];
+        }
+        if (key.empty()) {
+            error = "empty key in path at offset " + std::to_string(pos);
+            return false;
+        }
+        return true;
+    };
+
+    // A lone "." (or a leading one) is the root, as in earlier versions.
+    if (pos < path.size() && path[pos] == '.') pos++;
+    bool keyAllowed = true;
+    if (pos < path.size() && path[pos] == '{') {
+        PathStep step;
+        step.kind = PathStepKind::FILTER;
+        if (!parseFilter(step.filter)) return false;
+        steps.push_back(step);
+        keyAllowed = false;
+    }
+
+    while (pos < path.size()) {
+        char c = path[pos];
+        if (c == '[') {
+            pos++;
+            PathStep step;
+            if (pos < path.size() && path[pos] == ']') {
+                step.kind = PathStepKind::ALL;
+                steps.push_back(step);
+            } else if (pos < path.size() && path[pos] == '{') {
+                step.kind = PathStepKind::ALL;
+                steps.push_back(step);
+                step.kind = PathStepKind::FILTER;
+                if (!parseFilter(step.filter)) return false;
+                steps.push_back(step);
+            } else {
+                size_t close = path.find(']', pos);
+                std::string number = path.substr(pos, close == std::string::npos ? std::string::npos : close - pos);
+                char* endPtr = nullptr;
+                errno = 0;
+                long index = number.empty() ? 0 : std::strtol(number.c_str(), &endPtr, 10);
+                if (number.empty() || *endPtr != '\0' || errno == ERANGE || index < INT_MIN || index > INT_MAX) {
+                    error = "bad index in path: [" + number + "]";
+                    return false;
+                }
+                step.kind = PathStepKind::INDEX;
+                step.index = static_cast<int>(index);
+                steps.push_back(step);
+                pos = close;
+            }
+            if (pos >= path.size() || path[pos] != ']') {
+                error = "missing ']' in path";
+                return false;
+            }
+            pos++;
+            keyAllowed = false;
+        } else if (c == '{') {
+            if (steps.empty() || steps.back().kind != PathStepKind::KEY) {
+                error = "a compound filter must follow a key";
+                return false;
+            }
+            PathStep step;
+            step.kind = PathStepKind::FILTER;
+            if (!parseFilter(step.filter)) return false;
+            steps.push_back(step);
+        } else if (c == '.' || keyAllowed) {
+            if (c == '.') pos++;
+            PathStep step;
+            step.kind = PathStepKind::KEY;
+            if (!parseKey(step.key)) return false;
+            steps.push_back(step);
+            keyAllowed = false;
+        } else {
+            error = std::string("unexpected '") + c + "' in path at offset " + std::to_string(pos);
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::shared_ptr<NBTTag> arrayElement(const NBTTag& array, size_t index) {
+    switch (array.type) {
+        case TagType::BYTE_ARRAY: {
+            auto tag = std::make_shared<NBTTag>(TagType::BYTE, "");
+            tag->value.byteVal = array.value.byteArrayVal[index];
+            return tag;
+        }
+        case TagType::INT_ARRAY: {
+            auto tag = std::make_shared<NBTTag>(TagType::INT, "");
+            tag->value.intVal = array.value.intArrayVal[index];
+            return tag;
+        }
+        default: {
+            auto tag = std::make_shared<NBTTag>(TagType::LONG, "");
+            tag->value.longVal = array.value.longArrayVal[index];
+            return tag;
+        }
+    }
+}
+
+static size_t elementCount(const NBTTag& tag) {
+    switch (tag.type) {
+        case TagType::LIST: return tag.value.listVal.size();
+        case TagType::BYTE_ARRAY: return tag.value.byteArrayVal.size();
+        case TagType::INT_ARRAY: return tag.value.intArrayVal.size();
+        case TagType::LONG_ARRAY: return tag.value.longArrayVal.size();
+        default: return 0;
+    }
+}
+
+void NBTPath::match(const std::shared_ptr<NBTTag>& root, std::vector<TagRef>& out) const {
+    if (!root) return;
+    TagRef ref;
+    ref.tag = root;
+    matchFrom(ref, 0, out);
+}
+
+void NBTPath::matchFrom(const TagRef& at, size_t step, std::vector<TagRef>& out) const {
+    if (step == steps.size()) {
+        out.push_back(at);
+        return;
+    }
+
+    const PathStep& current = steps[step];
+    const std::shared_ptr<NBTTag>& node = at.tag;
+    TagRef next;
+    next.parent = node;
+    switch (current.kind) {
+        case PathStepKind::KEY: {
+            if (node->type != TagType::COMPOUND) return;
+            auto it = node->value.compoundVal.find(current.key);
+            if (it == node->value.compoundVal.end()) return;
+            next.tag = it->second;
+            next.key = current.key;
+            matchFrom(next, step + 1, out);
+            return;
+        }
+        case PathStepKind::INDEX:
+        case PathStepKind::ALL: {
+            if (node->type != TagType::LIST && node->type != TagType::BYTE_ARRAY &&
+                node->type != TagType::INT_ARRAY && node->type != TagType::LONG_ARRAY) {
+                return;
+            }
+            int count = static_cast<int>(elementCount(*node));
+            int first = 0;
+            int last = count;
+            if (current.kind == PathStepKind::INDEX) {
+                first = current.index < 0 ? current.index + count : current.index;
+                if (first < 0 || first >= count) return;
+                last = first + 1;
+            }
+            for (int i = first; i < last; i++) {
+                next.tag = node->type == TagType::LIST ? node->value.listVal[i] : arrayElement(*node, i);
+                next.index = i;
+                matchFrom(next, step + 1, out);
+            }
+            return;
+        }
+        case PathStepKind::FILTER:
+            if (matchesFilter(*current.filter, *node)) {
+                matchFrom(at, step + 1, out);
+            }
+            return;
+    }
+}
+
+bool NBTPath::splitLastKey(NBTPath& parent, std::string& key) const {
+    if (steps.empty() || steps.back().kind != PathStepKind::KEY) {
+        return false;
+    }
+    parent.text = text;
+    parent.steps.assign(steps.begin(), steps.end() - 1);
+    key = steps.back().key;
+    return true;
+}
+
+bool matchesFilter(const NBTTag& filter, const NBTTag& tag) {
+    if (filter.type != tag.type) return false;
+
+    switch (filter.type) {
+        case TagType::COMPOUND:
+            for (const auto& pair : filter.value.compoundVal) {
+                auto it = tag.value.compoundVal.find(pair.first);
+                if (it == tag.value.compoundVal.end() || !matchesFilter(*pair.second, *it->second)) {
+                    return false;
+                }
+            }
+            return true;
+        case TagType::LIST: {
+            const auto& wanted = filter.value.listVal;
+            const auto& items = tag.value.listVal;
+            if (wanted.empty()) return items.empty();
+            for (const auto& want : wanted) {
+                bool found = false;
+                for (const auto& item : items) {
+                    if (matchesFilter(*want, *item)) {
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) return false;
+            }
+            return true;
+        }
+        default:
+            return hashTag(filter) == hashTag(tag) && tagsEqual(filter, tag);
+    }
+}
+
+bool resolvePath(const std::shared_ptr<NBTTag>& root, const std::string& path, TagRef& ref, std::string& error) {
+    NBTPath compiled;
+    return compiled.compile(path, error) && resolvePath(root, compiled, ref, error);
+}
+
+bool resolvePath(const std::shared_ptr<NBTTag>& root, const NBTPath& path, TagRef& ref, std::string& error) {
+    std::vector<TagRef> matches;
+    path.match(root, matches);
+    if (matches.size() != 1) {
+        error = matches.empty() ? "no such tag: " + path.getText()
+                                : "path matches " + std::to_string(matches.size()) + " tags: " + path.getText();
+        return false;
+    }
+    ref = matches[0];
+    return true;
+}
+
+bool resolveParentPath(const std::shared_ptr<NBTTag>& root, const std::string& path, TagRef& ref, std::string& error) {
+    NBTPath compiled;
+    return compiled.compile(path, error) && resolveParentPath(root, compiled, ref, error);
+}
+
+// Like resolvePath, but the last key may be missing from its compound, in
+// which case ref.tag is null and ref.parent/ref.key say where to create it.
+bool resolveParentPath(const std::shared_ptr<NBTTag>& root, const NBTPath& path, TagRef& ref, std::string& error) {
+    std::vector<TagRef> matches;
+    path.match(root, matches);
+    if (!matches.empty()) {
+        return resolvePath(root, path, ref, error);
+    }
+
+    NBTPath parentPath;
+    std::string key;
+    TagRef parentRef;
+    std::string parentError;
+    if (!path.splitLastKey(parentPath, key) || !resolvePath(root, parentPath, parentRef, parentError) ||
+        parentRef.tag->type != TagType::COMPOUND) {
+        error = "no such tag: " + path.getText();
+        return false;
+    }
+
+    ref = TagRef();
+    ref.parent = parentRef.tag;
+    ref.key = key;
+    return true;
+}
+
+std::shared_ptr<NBTTag> NBTTreeBuilder::add(const std::string& name, TagType type) {
+    auto tag = std::make_shared<NBTTag>(type, name);
+    if (stack.empty()) {
+        root = tag;
+    } else if (stack.back()->type == TagType::COMPOUND) {
+        stack.back()->value.compoundVal[name] = tag;
+    } else {
+        stack.back()->value.listVal.push_back(tag);
+    }
+    return tag;
+}
+
+void NBTTreeBuilder::beginCompound(const std::string& name) {
+    stack.push_back(add(name, TagType::COMPOUND));
+}
+
+void NBTTreeBuilder::beginList(const std::string& name, TagType elementType, int32_t length) {
+    auto tag = add(name, TagType::LIST);
+    tag->value.listType = elementType;
+    tag->value.listVal.reserve(static_cast<size_t>(length));
+    stack.push_back(tag);
+}
+
+void NBTTreeBuilder::integer(const std::string& name, TagType type, int64_t value) {
+    auto tag = add(name, type);
+    switch (type) {
+        case TagType::BYTE: tag->value.byteVal = static_cast<int8_t>(value); break;
+        case TagType::SHORT: tag->value.shortVal = static_cast<int16_t>(value); break;
+        case TagType::INT: tag->value.intVal = static_cast<int32_t>(value); break;
+        default: tag->value.longVal = value; break;
+    }
+}
+
+void NBTTreeBuilder::floating(const std::string& name, TagType type, double value) {
+    auto tag = add(name, type);
+    if (type == TagType::FLOAT) {
+        tag->value.floatVal = static_cast<float>(value);
+    } else {
+        tag->value.doubleVal = value;
+    }
+}
+
+void NBTTreeBuilder::string(const std::string& name, const std::string& value) {
+    add(name, TagType::STRING)->value.stringVal = value;
+}
+
+void NBTTreeBuilder::beginArray(const std::string& name, TagType type, int32_t length) {
+    auto tag = add(name, type);
+    size_t count = static_cast<size_t>(length);
+    if (type == TagType::BYTE_ARRAY) tag->value.byteArrayVal.reserve(count);
+    else if (type == TagType::INT_ARRAY) tag->value.intArrayVal.reserve(count);
+    else tag->value.longArrayVal.reserve(count);
+    stack.push_back(tag);
+}
+
+void NBTTreeBuilder::arrayValues(const int64_t* values, size_t count) {
+    NBTValue& array = stack.back()->value;
+    for (size_t i = 0; i < count; i++) {
+        switch (stack.back()->type) {
+            case TagType::BYTE_ARRAY: array.byteArrayVal.push_back(static_cast<int8_t>(values[i])); break;
+            case TagType::INT_ARRAY: array.intArrayVal.push_back(static_cast<int32_t>(values[i])); break;
+            default: array.longArrayVal.push_back(values[i]); break;
+        }
+    }
+}
+
+bool ProgressiveLoader::enter(const std::string& name, TagType type) {
+    (void)name;
+    (void)type;
+    if (cancelled) throw std::runtime_error("loading cancelled");
+    // Handing over every 20ms keeps the screen filling in steadily, also
+    // while a large subtree is being built; the clock is only read every
+    // 1024 tags.
+    if ((++tags & 1023) == 1) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastFlush >= std::chrono::milliseconds(20)) {
+            flush();
+            lastFlush = now;
+        }
+    }
+    return true;
+}
+
+// Starts a container at shallow depth as an empty tag of its own, so the UI
+// can show it before its contents are parsed.
+bool ProgressiveLoader::openShallow(const std::shared_ptr<NBTTag>& container) {
+    if (deepLevel > 0 || shallow.size() >= SHALLOW_DEPTH) return false;
+    attach(container);
+    shallow.push_back(container);
+    return true;
+}
+
+// Called after every event that may end a privately built subtree.
+void ProgressiveLoader::completed() {
+    if (deepLevel == 0) {
+        attach(deep.getRoot());
+        deep.reset();
+    }
+}
+
+void ProgressiveLoader::attach(const std::shared_ptr<NBTTag>& tag) {
+    batch.push_back(Attach{shallow.empty() ? nullptr : shallow.back(), tag});
+}
+
+void ProgressiveLoader::flush() {
+    if (batch.empty()) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.insert(pending.end(), batch.begin(), batch.end());
+    batch.clear();
+}
+
+bool ProgressiveLoader::take(std::vector<Attach>& out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out.swap(pending);
+    pending.clear();
+    return !out.empty();
+}
+
+void ProgressiveLoader::beginCompound(const std::string& name) {
+    if (openShallow(std::make_shared<NBTTag>(TagType::COMPOUND, name))) return;
+    deep.beginCompound(name);
+    deepLevel++;
+}
+
+void ProgressiveLoader::endCompound() {
+    if (deepLevel == 0) {
+        shallow.pop_back();
+        return;
+    }
+    deep.endCompound();
+    deepLevel--;
+    completed();
+}
+
+void ProgressiveLoader::beginList(const std::string& name, TagType elementType, int32_t length) {
+    auto list = std::make_shared<NBTTag>(TagType::LIST, name);
+    list->value.listType = elementType;
+    if (openShallow(list)) return;
+    deep.beginList(name, elementType, length);
+    deepLevel++;
+}
+
+void ProgressiveLoader::endList() {
+    if (deepLevel == 0) {
+        shallow.pop_back();
+        return;
+    }
+    deep.endList();
+    deepLevel--;
+    completed();
+}
+
+void ProgressiveLoader::integer(const std::string& name, TagType type, int64_t value) {
+    deep.integer(name, type, value);
+    completed();
+}
+
+void ProgressiveLoader::floating(const std::string& name, TagType type, double value) {
+    deep.floating(name, type, value);
+    completed();
+}
+
+void ProgressiveLoader::string(const std::string& name, const std::string& value) {
+    deep.string(name, value);
+    completed();
+}
+
+void ProgressiveLoader::beginArray(const std::string& name, TagType type, int32_t length) {
+    deep.beginArray(name, type, length);
+    deepLevel++;
+}
+
+void ProgressiveLoader::endArray() {
+    deep.endArray();
+    deepLevel--;
+    completed();
+}
+
+void PathStreamMatcher::reset() {
+    frames.clear();
+    pending.clear();
+    builder.reset();
+    capturing = false;
+}
+
+// States are the number of path steps matched so far. A tag is descended
+// into while some state still needs a key or element below it; it is built
+// as a tree once a state is complete or reaches a filter, and skipped when
+// no state survives.
+bool PathStreamMatcher::enter(const std::string& name, TagType type) {
+    if (capturing) return true;
+
+    const std::vector<PathStep>& steps = path.getSteps();
+    std::vector<size_t> states;
+    if (frames.empty()) {
+        states.push_back(0);
+    } else {
+        Frame& parent = frames.back();
+        int32_t position = parent.list ? parent.next++ : -1;
+        for (size_t state : parent.states) {
+            const PathStep& step = steps[state];
+            bool accepted = false;
+            switch (step.kind) {
+                case PathStepKind::KEY:
+                    accepted = !parent.list && step.key == name;
+                    break;
+                case PathStepKind::INDEX:
+                    accepted = parent.list && (step.index < 0 ? step.index + parent.length : step.index) == position;
+                    break;
+                case PathStepKind::ALL:
+                    accepted = parent.list;
+                    break;
+                case PathStepKind::FILTER:
+                    break;
+            }
+            if (accepted) states.push_back(state + 1);
+        }
+    }
+
+    bool array = type == TagType::BYTE_ARRAY || type == TagType::INT_ARRAY || type == TagType::LONG_ARRAY;
+    bool capture = false;
+    pending.clear();
+    for (size_t state : states) {
+        if (state == steps.size() || steps[state].kind == PathStepKind::FILTER) {
+            capture = true;
+        } else if (steps[state].kind == PathStepKind::KEY) {
+            if (type == TagType::COMPOUND) pending.push_back(state);
+        } else if (type == TagType::LIST) {
+            pending.push_back(state);
+        } else if (array) {
+            capture = true;
+        }
+    }
+
+    if (capture) {
+        capturing = true;
+        captureStates = states;
+        builder.reset();
+        return true;
+    }
+    return !pending.empty();
+}
+
+void PathStreamMatcher::captured() {
+    if (!builder.done()) return;
+
+    capturing = false;
+    TagRef ref;
+    ref.tag = builder.getRoot();
+    ref.key = ref.tag->name;
+    std::vector<TagRef> matches;
+    for (size_t state : captureStates) {
+        path.matchFrom(ref, state, matches);
+    }
+    for (const auto& match : matches) {
+        onMatch(match);
+    }
+    builder.reset();
+}
+
+void PathStreamMatcher::beginCompound(const std::string& name) {
+    if (capturing) {
+        builder.beginCompound(name);
+        return;
+    }
+    Frame frame = { pending, false, 0, 0 };
+    frames.push_back(frame);
+}
+
+void PathStreamMatcher::endCompound() {
+    if (capturing) {
+        builder.endCompound();
+        captured();
+        return;
+    }
+    frames.pop_back();
+}
+
+void PathStreamMatcher::beginList(const std::string& name, TagType elementType, int32_t length) {
+    if (capturing) {
+        builder.beginList(name, elementType, length);
+        return;
+    }
+    Frame frame = { pending, true, length, 0 };
+    frames.push_back(frame);
+}
+
+void PathStreamMatcher::endList() {
+    if (capturing) {
+        builder.endList();
+        captured();
+        return;
+    }
+    frames.pop_back();
+}
+
+void PathStreamMatcher::integer(const std::string& name, TagType type, int64_t value) {
+    builder.integer(name, type, value);
+    captured();
+}
+
+void PathStreamMatcher::floating(const std::string& name, TagType type, double value) {
+    builder.floating(name, type, value);
+    captured();
+}
+
+void PathStreamMatcher::string(const std::string& name, const std::string& value) {
+    builder.string(name, value);
+    captured();
+}
+
+void PathStreamMatcher::beginArray(const std::string& name, TagType type, int32_t length) {
+    builder.beginArray(name, type, length);
+}
+
+void PathStreamMatcher::arrayValues(const int64_t* values, size_t count) {
+    builder.arrayValues(values, count);
+}
+
+void PathStreamMatcher::endArray() {
+    builder.endArray();
+    captured();
+}
+
+bool removeTag(const TagRef& ref) {
+    if (!ref.parent) return false;
+
+    if (ref.parent->type == TagType::COMPOUND) {
+        return ref.parent->value.compoundVal.erase(ref.key) > 0;
+    }
+    if (ref.parent->type == TagType::LIST) {
+        auto& items = ref.parent->value.listVal;
+        if (ref.index < 0 || ref.index >= static_cast<int>(items.size())) return false;
+        items.erase(items.begin() + ref.index);
+        return true;
+    }
+    if (ref.index < 0 || ref.index >= static_cast<int>(elementCount(*ref.parent))) return false;
+    switch (ref.parent->type) {
+        case TagType::BYTE_ARRAY:
+            ref.parent->value.byteArrayVal.erase(ref.parent->value.byteArrayVal.begin() + ref.index);
+            return true;
+        case TagType::INT_ARRAY:
+            ref.parent->value.intArrayVal.erase(ref.parent->value.intArrayVal.begin() + ref.index);
+            return true;
+        case TagType::LONG_ARRAY:
+            ref.parent->value.longArrayVal.erase(ref.parent->value.longArrayVal.begin() + ref.index);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Removes every match of a path. Elements go from the highest index down so
+// earlier removals do not shift the later ones.
+bool removeTags(std::vector<TagRef> refs) {
+    for (const auto& ref : refs) {
+        if (!ref.parent) return false;
+    }
+    std::stable_sort(refs.begin(), refs.end(), [](const TagRef& a, const TagRef& b) { return a.index > b.index; });
+    for (const auto& ref : refs) {
+        removeTag(ref);
+    }
+    return true;
+}
+
+// Array elements are matched as detached tags; this writes an edited one
+// back into its array.
+void storeArrayElement(const TagRef& ref) {
+    if (!ref.parent || !ref.tag) return;
+    switch (ref.parent->type) {
+        case TagType::BYTE_ARRAY:
+            ref.parent->value.byteArrayVal[ref.index] = ref.tag->value.byteVal;
+            break;
+        case TagType::INT_ARRAY:
+            ref.parent->value.intArrayVal[ref.index] = ref.tag->value.intVal;
+            break;
+        case TagType::LONG_ARRAY:
+            ref.parent->value.longArrayVal[ref.index] = ref.tag->value.longVal;
+            break;
+        default:
+            break;
+    }
+}
+
+static EditOpKind parseEditOpKind(const std::string& word, bool& ok) {
+    ok = true;
+    if (word == "get") return EditOpKind::GET;
+    if (word == "set") return EditOpKind::SET;
+    if (word == "del") return EditOpKind::DEL;
+    ok = false;
+    return EditOpKind::GET;
+}
+
+bool parseEditOps(const std::vector<std::string>& args, std::vector<EditOp>& ops, std::string& error) {
+    size_t i = 0;
+    while (i < args.size()) {
+        bool ok;
+        EditOp op;
+        op.kind = parseEditOpKind(args[i], ok);
+        if (!ok) {
+            error = "unknown operation '" + args[i] + "' (expected get, set or del)";
+            return false;
+        }
+        if (i + 1 >= args.size()) {
+            error = "missing path for '" + args[i] + "'";
+            return false;
+        }
+        op.path = args[i + 1];
+        auto compiled = std::make_shared<NBTPath>();
+        if (!compiled->compile(op.path, error)) {
+            return false;
+        }
+        op.compiled = compiled;
+        i += 2;
+        if (op.kind == EditOpKind::SET) {
+            if (i >= args.size()) {
+                error = "missing value for 'set " + op.path + "'";
+                return false;
+            }
+            op.value = args[i++];
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
+// A path in an operation line ends at the first blank outside quotes,
+// brackets and filter braces.
+static size_t scanPathEnd(const std::string& line, size_t pos) {
+    char quote = 0;
+    int depth = 0;
+    while (pos < line.size() && (quote || depth > 0 || (line[pos] != ' ' && line[pos] != '\t'))) {
+        char c = line[pos];
+        if (quote) {
+            if (c == '\\') pos++;
+            else if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if ((c == ']' || c == '}') && depth > 0) {
+            depth--;
+        }
+        pos++;
+    }
+    return std::min(pos, line.size());
+}
+
+bool parseEditOpLine(const std::string& line, EditOp& op, std::string& error) {
+    size_t pos = line.find_first_not_of(" \t");
+    if (pos == std::string::npos) {
+        error = "empty operation";
+        return false;
+    }
+    size_t end = line.find_first_of(" \t", pos);
+    bool ok;
+    op.kind = parseEditOpKind(line.substr(pos, end - pos), ok);
+    if (!ok) {
+        error = "unknown operation '" + line.substr(pos, end - pos) + "'";
+        return false;
+    }
+
+    pos = line.find_first_not_of(" \t", end);
+    if (pos == std::string::npos) {
+        error = "missing path";
+        return false;
+    }
+    end = scanPathEnd(line, pos);
+    op.path = line.substr(pos, end - pos);
+    auto compiled = std::make_shared<NBTPath>();
+    if (!compiled->compile(op.path, error)) {
+        return false;
+    }
+    op.compiled = compiled;
+
+    op.value.clear();
+    pos = line.find_first_not_of(" \t", end);
+    if (pos != std::string::npos) {
+        op.value = line.substr(pos);
+    }
+    if (op.kind == EditOpKind::SET && pos == std::string::npos) {
+        error = "missing value for 'set " + op.path + "'";
+        return false;
+    }
+    return true;
+}
+
+bool NBTCommandRunner::apply(const EditOp& op, std::ostream& out, std::string& error) {
+    NBTPath local;
+    const NBTPath* path = op.compiled.get();
+    if (!path) {
+        if (!local.compile(op.path, error)) return false;
+        path = &local;
+    }
+
+    std::vector<TagRef> matches;
+    path->match(nbtFile.getRoot(), matches);
+    if (matches.empty()) {
+        TagRef ref;
+        if (op.kind == EditOpKind::SET && resolveParentPath(nbtFile.getRoot(), *path, ref, error)) {
+            return applySet(ref, op, error);
+        }
+        error = "no such tag: " + op.path;
+        return false;
+    }
+
+    // A path with wildcards or filters acts on every tag it matches.
+    switch (op.kind) {
+        case EditOpKind::GET:
+            for (const auto& ref : matches) {
+                out << toSNBT(*ref.tag) << "\n";
+            }
+            return true;
+        case EditOpKind::SET: {
+            // Every match is validated before any is changed, so a value
+            // that fits some matches but not others leaves the tree as is.
+            std::vector<std::shared_ptr<NBTTag>> results(matches.size());
+            for (size_t i = 0; i < matches.size(); i++) {
+                if (!prepareSet(matches[i], op, results[i], error)) return false;
+            }
+            for (size_t i = 0; i < matches.size(); i++) {
+                storeSet(matches[i], results[i]);
+            }
+            return true;
+        }
+        case EditOpKind::DEL:
+            if (!removeTags(matches)) {
+                error = "cannot delete the root tag";
+                return false;
+            }
+            changed = true;
+            return true;
+    }
+    return false;
+}
+
+bool NBTCommandRunner::applySet(const TagRef& ref, const EditOp& op, std::string& error) {
+    std::shared_ptr<NBTTag> result;
+    if (!prepareSet(ref, op, result, error)) return false;
+    storeSet(ref, result);
+    return true;
+}
+
+// Scalars keep their type and take the value as plain text (so strings
+// need no quoting). New tags and compound/list/array values are SNBT.
+// Builds the new tag in result without touching the tree.
+bool NBTCommandRunner::prepareSet(const TagRef& ref, const EditOp& op, std::shared_ptr<NBTTag>& result, std::string& error) {
+    bool container = !ref.tag || ref.tag->type == TagType::COMPOUND || ref.tag->type == TagType::LIST ||
+                     ref.tag->type == TagType::BYTE_ARRAY || ref.tag->type == TagType::INT_ARRAY ||
+                     ref.tag->type == TagType::LONG_ARRAY;
+    if (!container) {
+        result = std::make_shared<NBTTag>(ref.tag->type, ref.tag->name);
+        try {
+            result->setValueFromString(op.value);
+        } catch (const std::exception&) {
+            error = "invalid " + tagTypeToString(ref.tag->type) + " value '" + op.value + "'";
+            return false;
+        }
+        return true;
+    }
+
+    SNBTParser parser(op.value.data(), op.value.size());
+    if (!parser.parse(result, error, ref.key)) {
+        return false;
+    }
+    if (ref.tag && result->type != ref.tag->type) {
+        error = "expected " + tagTypeToString(ref.tag->type) + " value, got " + tagTypeToString(result->type);
+        return false;
+    }
+    return true;
+}
+
+void NBTCommandRunner::storeSet(const TagRef& ref, const std::shared_ptr<NBTTag>& result) {
+    if (ref.tag) {
+        ref.tag->value = result->value;
+        storeArrayElement(ref);
+    } else {
+        ref.parent->value.compoundVal[ref.key] = result;
+    }
+    changed = true;
+}
+
+int runHeadless(const std::string& filename, const std::vector<EditOp>& ops) {
+    NBTFile nbtFile(filename);
+    nbtFile.setCacheDir(defaultCacheDir());
+    if (!nbtFile.load()) {
+        std::cerr << filename << ": " << nbtFile.getError() << std::endl;
+        return 1;
+    }
+
+    NBTCommandRunner runner(nbtFile);
+    bool failed = false;
+    for (size_t i = 0; i < ops.size(); i++) {
+        std::string error;
+        if (!runner.apply(ops[i], std::cout, error)) {
+            std::cerr << "operation " << (i + 1) << " (" << ops[i].path << "): " << error << std::endl;
+            failed = true;
+        }
+    }
+
+    // All-or-nothing: a file is only written when every operation succeeded.
+    if (failed) {
+        if (runner.isChanged()) {
+            std::cerr << filename << ": not saved due to errors" << std::endl;
+        }
+        return 1;
+    }
+    if (runner.isChanged() && !nbtFile.save()) {
+        std::cerr << filename << ": " << nbtFile.getError() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t readBE32(const std::string& data, size_t offset) {
+    return (static_cast<uint32_t>(static_cast<uint8_t>(data[offset])) << 24) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(data[offset + 1])) << 16) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(data[offset + 2])) << 8) |
+           static_cast<uint32_t>(static_cast<uint8_t>(data[offset + 3]));
+}
+
+static void writeBE32(std::string& data, size_t offset, uint32_t value) {
+    data[offset] = static_cast<char>(value >> 24);
+    data[offset + 1] = static_cast<char>(value >> 16);
+    data[offset + 2] = static_cast<char>(value >> 8);
+    data[offset + 3] = static_cast<char>(value);
+}
+
+static std::string baseName(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static std::string dirName(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+static bool endsWith(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+RegionFile::RegionFile(const std::string& fname) : filename(fname) {
+    if (std::sscanf(baseName(fname).c_str(), "r.%d.%d.mca", &regionX, &regionZ) != 2) {
+        regionX = 0;
+        regionZ = 0;
+    }
+}
+
+std::string RegionFile::externalChunkPath(int index) const {
+    return dirName(filename) + "/c." + std::to_string(regionX * 32 + index % 32) + "." +
+           std::to_string(regionZ * 32 + index / 32) + ".mcc";
+}
+
+std::string RegionFile::chunkLabel(int index) const {
+    return "chunk " + std::to_string(regionX * 32 + index % 32) + "," + std::to_string(regionZ * 32 + index / 32);
+}
+
+bool RegionFile::load() {
+    IOBuffers buffers;
+    return load(buffers);
+}
+
+bool RegionFile::load(IOBuffers& buffers) {
+    TraceSpan span("load");
+    AllocationScope scope(AllocationPhase::LOAD);
+    chunks.clear();
+    locations.clear();
+    timestamps.clear();
+    bool statted = statFile(filename, diskMtime, diskSize);
+    if (!readSource(filename, buffers)) {
+        lastError = "cannot read " + filename;
+        return false;
+    }
+
+    const std::string& raw = buffers.raw;
+    if (raw.empty()) {
+        return true;
+    }
+    if (raw.size() < 2 * REGION_SECTOR) {
+        lastError = "truncated region header";
+        return false;
+    }
+    // Stat'ed before reading, so a change in between shows at save time.
+    if (statted && static_cast<size_t>(diskSize) == raw.size()) {
+        locations.resize(REGION_CHUNKS);
+        timestamps.resize(REGION_CHUNKS);
+        for (int i = 0; i < REGION_CHUNKS; i++) {
+            locations[i] = readBE32(raw, i * 4);
+            timestamps[i] = readBE32(raw, REGION_SECTOR + i * 4);
+        }
+    }
+
+    std::string external;
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        uint32_t location = readBE32(raw, i * 4);
+        if (location == 0) continue;
+
+        size_t offset = static_cast<size_t>(location >> 8) * REGION_SECTOR;
+        if (offset < 2 * REGION_SECTOR || offset + 5 > raw.size()) {
+            lastError = chunkLabel(i) + ": bad sector offset";
+            return false;
+        }
+        uint32_t length = readBE32(raw, offset);
+        uint8_t type = static_cast<uint8_t>(raw[offset + 4]);
+        if (length == 0 || offset + 4 + length > raw.size()) {
+            lastError = chunkLabel(i) + ": bad chunk length";
+            return false;
+        }
+
+        chunks.emplace_back(filename, i, readBE32(raw, REGION_SECTOR + i * 4));
+        RegionChunk& chunk = chunks.back();
+
+        const char* payload = raw.data() + offset + 5;
+        size_t payloadSize = length - 1;
+        if (type & 0x80) {
+            if (!readFileBytes(externalChunkPath(i), external)) {
+                lastError = chunkLabel(i) + ": cannot read " + externalChunkPath(i);
+                return false;
+            }
+            chunk.external = true;
+            payload = external.data();
+            payloadSize = external.size();
+            type &= 0x7F;
+        }
+
+        Compression compression;
+        switch (type) {
+            case 1: compression = Compression::GZIP; break;
+            case 2: compression = Compression::ZLIB; break;
+            case 3: compression = Compression::NONE; break;
+            default:
+                lastError = chunkLabel(i) + ": unsupported compression type " + std::to_string(type);
+                return false;
+        }
+        chunk.nbt.setCompression(compression);
+
+        bool parsed;
+        if (compression == Compression::NONE) {
+            parsed = chunk.nbt.parse(payload, payloadSize);
+        } else {
+            std::string error;
+            if (!inflateData(payload, payloadSize, buffers.data, error)) {
+                lastError = chunkLabel(i) + ": " + error;
+                return false;
+            }
+            parsed = chunk.nbt.parse(buffers.data.data(), buffers.data.size());
+        }
+        if (!parsed) {
+            lastError = chunkLabel(i) + ": " + chunk.nbt.getError();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RegionFile::loadHeader() {
+    stream.open(filename, std::ios::binary);
+    if (!stream) {
+        lastError = "cannot read " + filename;
+        return false;
+    }
+
+    std::string header(2 * REGION_SECTOR, '\0');
+    stream.read(&header[0], header.size());
+    locations.assign(REGION_CHUNKS, 0);
+    timestamps.assign(REGION_CHUNKS, 0);
+    if (stream.gcount() == 0) {
+        return true;
+    }
+    if (static_cast<size_t>(stream.gcount()) < header.size()) {
+        lastError = "truncated region header";
+        return false;
+    }
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        locations[i] = readBE32(header, i * 4);
+        timestamps[i] = readBE32(header, REGION_SECTOR + i * 4);
+    }
+    return true;
+}
+
+bool RegionFile::readChunk(int index, std::string& payload, bool* external, Compression* compression) {
+    if (!hasChunk(index)) {
+        lastError = chunkLabel(index) + ": not present";
+        return false;
+    }
+
+    std::string head(5, '\0');
+    stream.clear();
+    stream.seekg(static_cast<std::streamoff>(locations[index] >> 8) * REGION_SECTOR);
+    stream.read(&head[0], 5);
+    uint32_t length = stream ? readBE32(head, 0) : 0;
+    uint8_t type = static_cast<uint8_t>(head[4]);
+    if (length == 0 || length > 255 * REGION_SECTOR) {
+        lastError = chunkLabel(index) + ": bad chunk length";
+        return false;
+    }
+    if ((type & 0x7F) < 1 || (type & 0x7F) > 3) {
+        lastError = chunkLabel(index) + ": unsupported compression type " + std::to_string(type & 0x7F);
+        return false;
+    }
+
+    if (external) *external = (type & 0x80) != 0;
+    if (compression) {
+        uint8_t kind = type & 0x7F;
+        *compression = kind == 1 ? Compression::GZIP : kind == 2 ? Compression::ZLIB : Compression::NONE;
+    }
+    if (type & 0x80) {
+        if (!readFileBytes(externalChunkPath(index), payload)) {
+            lastError = chunkLabel(index) + ": cannot read " + externalChunkPath(index);
+            return false;
+        }
+        return true;
+    }
+
+    payload.resize(length - 1);
+    stream.read(&payload[0], length - 1);
+    if (!stream) {
+        lastError = chunkLabel(index) + ": truncated chunk";
+        return false;
+    }
+    return true;
+}
+
+bool RegionFile::save() {
+    IOBuffers buffers;
+    return save(buffers);
+}
+
+void RegionFile::addEncodedChunk(int index, uint32_t timestamp, bool external, std::string& payload, uint8_t type) {
+    chunks.emplace_back(filename, index, timestamp);
+    RegionChunk& chunk = chunks.back();
+    chunk.external = external;
+    chunk.dirty = timestamp == 0;
+    chunk.encoded.swap(payload);
+    chunk.encodedType = type;
+}
+
+bool RegionFile::encodeChunk(RegionChunk& chunk, IOBuffers& buffers, const std::string*& payload, uint8_t& type) {
+    if (chunk.encodedType != 0) {
+        payload = &chunk.encoded;
+        type = chunk.encodedType;
+        return true;
+    }
+    NBTFile& nbt = chunk.nbt;
+    if (!nbt.serialize(buffers.data)) {
+        lastError = chunkLabel(chunk.index) + ": " + nbt.getError();
+        return false;
+    }
+    payload = &buffers.data;
+    if (nbt.getCompression() != Compression::NONE) {
+        std::string error;
+        if (!deflateData(buffers.data, nbt.getCompression(), buffers.raw, error)) {
+            lastError = chunkLabel(chunk.index) + ": " + error;
+            return false;
+        }
+        payload = &buffers.raw;
+    }
+    type = nbt.getCompression() == Compression::GZIP ? 1 : nbt.getCompression() == Compression::ZLIB ? 2 : 3;
+    return true;
+}
+
+// Writes only the dirty chunks, each into sectors that were free when the
+// file was read (or appended), and then their header entries, syncing in
+// between: until its entry is written, a chunk stays at its old place.
+// The old sectors of rewritten chunks become free for the next save.
+// Returns false, leaving the file readable as before, when the whole file
+// has to be rewritten instead: the file changed since it was read, a chunk
+// was removed, a chunk is or becomes external, or so many chunks changed
+// that appending them would bloat the file.
+bool RegionFile::saveInPlace(IOBuffers& buffers) {
+    int64_t mtime, size;
+    if (locations.empty() || !statFile(filename, mtime, size) || mtime != diskMtime || size != diskSize) {
+        return false;
+    }
+    std::vector<char> present(REGION_CHUNKS, 0);
+    size_t dirty = 0;
+    for (const auto& chunk : chunks) {
+        present[chunk.index] = 1;
+        if (chunk.dirty) {
+            if (chunk.external) return false;
+            dirty++;
+        }
+    }
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        if (locations[i] != 0 && !present[i]) return false;
+    }
+    if (dirty * 4 > chunks.size()) return false;
+
+    size_t fileSectors = (static_cast<size_t>(diskSize) + REGION_SECTOR - 1) / REGION_SECTOR;
+    std::vector<char> used(std::max<size_t>(fileSectors, 2), 0);
+    used[0] = used[1] = 1;
+    for (uint32_t location : locations) {
+        size_t start = location >> 8;
+        size_t end = std::min(start + (location & 0xFF), used.size());
+        for (size_t sector = start; sector < end; sector++) used[sector] = 1;
+    }
+
+    struct Placement {
+        size_t chunk;
+        size_t sector;
+        std::string record;
+    };
+    std::vector<Placement> placements;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (!chunks[i].dirty) continue;
+        const std::string* payload;
+        uint8_t type;
+        if (!encodeChunk(chunks[i], buffers, payload, type)) return false;
+        size_t sectors = (payload->size() + 5 + REGION_SECTOR - 1) / REGION_SECTOR;
+        if (sectors > 255) return false;
+
+        Placement placement;
+        placement.chunk = i;
+        placement.record.resize(5);
+        writeBE32(placement.record, 0, static_cast<uint32_t>(payload->size() + 1));
+        placement.record[4] = static_cast<char>(type);
+        placement.record += *payload;
+        placement.record.resize(sectors * REGION_SECTOR, '\0');
+
+        // First fit among the free sectors, else at the end of the file.
+        size_t run = 0;
+        size_t sector = 2;
+        for (; sector < used.size() && run < sectors; sector++) {
+            run = used[sector] ? 0 : run + 1;
+        }
+        placement.sector = run == sectors ? sector - sectors : used.size() - run;
+        used.resize(std::max(used.size(), placement.sector + sectors), 0);
+        for (size_t j = 0; j < sectors; j++) used[placement.sector + j] = 1;
+        placements.push_back(std::move(placement));
+    }
+
+    int fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (const auto& placement : placements) {
+        ok = ok && pwrite(fd, placement.record.data(), placement.record.size(), placement.sector * REGION_SECTOR) ==
+                       static_cast<ssize_t>(placement.record.size());
+    }
+    ok = ok && fdatasync(fd) == 0;
+
+    // Each entry is its own 4-byte write, so none can be torn.
+    uint32_t now = static_cast<uint32_t>(std::time(nullptr));
+    std::string entry(4, '\0');
+    for (const auto& placement : placements) {
+        int index = chunks[placement.chunk].index;
+        uint32_t location = static_cast<uint32_t>((placement.sector << 8) | (placement.record.size() / REGION_SECTOR));
+        writeBE32(entry, 0, location);
+        ok = ok && pwrite(fd, entry.data(), 4, index * 4) == 4;
+        writeBE32(entry, 0, now);
+        ok = ok && pwrite(fd, entry.data(), 4, REGION_SECTOR + index * 4) == 4;
+        if (ok) {
+            locations[index] = location;
+            timestamps[index] = now;
+        }
+    }
+    ok = ok && fdatasync(fd) == 0;
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0;
+    close(fd);
+    if (!ok) return false;
+
+    diskMtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    diskSize = st.st_size;
+    for (const auto& placement : placements) {
+        chunks[placement.chunk].timestamp = now;
+        chunks[placement.chunk].dirty = false;
+    }
+    return true;
+}
+
+bool RegionFile::save(IOBuffers& buffers) {
+    TraceSpan span("save");
+    AllocationScope scope(AllocationPhase::SAVE);
+    if (saveInPlace(buffers)) {
+        return true;
+    }
+
+    std::string out(2 * REGION_SECTOR, '\0');
+    uint32_t now = static_cast<uint32_t>(std::time(nullptr));
+
+    for (auto& chunk : chunks) {
+        const std::string* payload;
+        uint8_t type;
+        if (!encodeChunk(chunk, buffers, payload, type)) {
+            return false;
+        }
+        size_t sectors = (payload->size() + 5 + REGION_SECTOR - 1) / REGION_SECTOR;
+        bool external = sectors > 255;
+        if (external) {
+            if (!writeFileAtomic(externalChunkPath(chunk.index), payload->data(), payload->size(), false, lastError)) {
+                return false;
+            }
+            sectors = 1;
+        } else if (chunk.external) {
+            std::remove(externalChunkPath(chunk.index).c_str());
+        }
+        chunk.external = external;
+
+        size_t sectorOffset = out.size() / REGION_SECTOR;
+        size_t start = out.size();
+        out.resize(start + 5);
+        writeBE32(out, start, external ? 1 : static_cast<uint32_t>(payload->size() + 1));
+        out[start + 4] = static_cast<char>(external ? (type | 0x80) : type);
+        if (!external) {
+            out.append(*payload);
+        }
+        out.resize(start + sectors * REGION_SECTOR, '\0');
+
+        if (chunk.dirty) {
+            chunk.timestamp = now;
+            chunk.dirty = false;
+        }
+        writeBE32(out, chunk.index * 4, static_cast<uint32_t>((sectorOffset << 8) | sectors));
+        writeBE32(out, REGION_SECTOR + chunk.index * 4, chunk.timestamp);
+    }
+
+    if (!writeFileAtomic(filename, out.data(), out.size(), false, lastError)) {
+        return false;
+    }
+    locations.assign(REGION_CHUNKS, 0);
+    timestamps.assign(REGION_CHUNKS, 0);
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        locations[i] = readBE32(out, i * 4);
+        timestamps[i] = readBE32(out, REGION_SECTOR + i * 4);
+    }
+    if (!statFile(filename, diskMtime, diskSize)) locations.clear();
+    return true;
+}
+
+WorkStealingPool::WorkStealingPool(size_t threadCount) {
+    if (threadCount == 0) threadCount = 1;
+    for (size_t i = 0; i < threadCount; i++) {
+        queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+    }
+}
+
+bool WorkStealingPool::pop(size_t worker, size_t& task) {
+    WorkerQueue& queue = *queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) return false;
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool WorkStealingPool::steal(size_t thief, size_t& task) {
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkerQueue& victim = *queues[(thief + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::run(const std::vector<size_t>& order, const std::function<void(size_t, size_t)>& fn) {
+    for (size_t i = 0; i < order.size(); i++) {
+        queues[i % queues.size()]->tasks.push_back(order[i]);
+    }
+
+    // No task creates new tasks, so a worker that finds every queue empty
+    // is done.
+    auto work = [&](size_t worker) {
+        size_t task;
+        while (pop(worker, task) || steal(worker, task)) {
+            fn(task, worker);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < queues.size(); i++) {
+        threads.emplace_back(work, i);
+    }
+    work(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+IoUring::~IoUring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (fd >= 0) close(fd);
+}
+
+bool IoUring::init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) return false;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) return false;
+    cqRing = single ? sqRing
+                    : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) return false;
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* mapped = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (mapped == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe*>(mapped);
+
+    char* sq = static_cast<char*>(sqRing);
+    char* cq = static_cast<char*>(cqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    unsigned tail = *sqTail + queued;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) return nullptr;
+    unsigned slot = tail & *sqMask;
+    sqArray[slot] = slot;
+    queued++;
+    memset(&sqes[slot], 0, sizeof(io_uring_sqe));
+    return &sqes[slot];
+}
+
+bool IoUring::submitAndWait() {
+    unsigned submit = queued;
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+    for (;;) {
+        long result = syscall(__NR_io_uring_enter, fd, submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (result >= 0) return true;
+        if (errno != EINTR) return false;
+        // The kernel took the entries before the interruption.
+        submit = 0;
+    }
+}
+
+bool IoUring::waitCompletion() {
+    for (;;) {
+        long result = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (result >= 0) return true;
+        if (errno != EINTR) return false;
+    }
+}
+
+bool IoUring::popCompletion(io_uring_cqe& cqe) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+    cqe = cqes[head & *cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+FilePrefetcher::FilePrefetcher(const std::vector<std::string>& files, size_t depth, size_t byteBudget)
+    : depth(std::max<size_t>(1, depth)), byteBudget(byteBudget) {
+    for (const auto& file : files) {
+        if (indices.emplace(file, paths.size()).second) paths.push_back(file);
+    }
+    entries.resize(paths.size());
+    if (paths.empty()) return;
+
+    const char* setting = getenv("NBTEDIT_IO_URING");
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if ((!setting || strcmp(setting, "off") != 0) && ring->init(static_cast<unsigned>(this->depth))) {
+        usingRing = true;
+        IoUring* owned = ring.release();
+        threads.emplace_back([this, owned] {
+            runRing(owned);
+            delete owned;
+        });
+        return;
+    }
+    size_t readers = std::min<size_t>(16, std::min(this->depth, paths.size()));
+    for (size_t i = 0; i < readers; i++) {
+        threads.emplace_back(&FilePrefetcher::runBlocking, this);
+    }
+}
+
+FilePrefetcher::~FilePrefetcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    spaceChanged.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Picks the next file nobody has started on, once fewer than depth files
+// are being read and the ones read but not yet taken fit in the byte
+// budget. Without wait, gives up instead of blocking.
+bool FilePrefetcher::claim(size_t& index, bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        while (next < entries.size() && entries[next].state != FileState::PENDING) next++;
+        if (stopping || next == entries.size()) return false;
+        if (reading < depth && readyBytes < byteBudget) break;
+        if (!wait) return false;
+        spaceChanged.wait(lock);
+    }
+    index = next++;
+    entries[index].state = FileState::READING;
+    reading++;
+    return true;
+}
+
+void FilePrefetcher::finish(size_t index, bool ok) {
+    Entry& entry = entries[index];
+    if (entry.fd >= 0) {
+        close(entry.fd);
+        entry.fd = -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.ok = ok;
+        reading--;
+        if (entry.skipped) {
+            entry.state = FileState::TAKEN;
+            std::string().swap(entry.data);
+        } else {
+            entry.state = FileState::READY;
+            readyBytes += entry.data.size();
+        }
+    }
+    readyChanged.notify_all();
+    spaceChanged.notify_all();
+}
+
+// Each file goes through an openat and then as many reads as it takes to
+// fill its buffer; user_data carries the file index and which of the two
+// it was.
+void FilePrefetcher::runRing(IoUring* ring) {
+    enum : uint64_t { OPEN = 0, READ = 1 };
+    size_t inflight = 0;
+    bool ringOpen = true;
+
+    auto submitRead = [&](size_t index) {
+        Entry& entry = entries[index];
+        io_uring_sqe* sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = entry.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&entry.data[entry.done]);
+        sqe->len = static_cast<uint32_t>(std::min<size_t>(entry.data.size() - entry.done, 1u << 30));
+        sqe->off = entry.done;
+        sqe->user_data = (index << 1) | READ;
+        inflight++;
+    };
+
+    // Sizes the buffer from the open descriptor and starts reading it.
+    auto opened = [&](size_t index, int fd) {
+        Entry& entry = entries[index];
+        entry.fd = fd;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            finish(index, false);
+            return;
+        }
+        entry.data.resize(static_cast<size_t>(st.st_size));
+        if (entry.data.empty()) {
+            finish(index, true);
+        } else {
+            submitRead(index);
+        }
+    };
+
+    for (;;) {
+        // Every file in flight may need one more entry for its next step,
+        // so only start new ones while that still fits.
+        size_t index;
+        while (inflight < depth && claim(index, inflight == 0)) {
+            if (!ringOpen) {
+                int fd = open(paths[index].c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    finish(index, false);
+                } else {
+                    opened(index, fd);
+                }
+                continue;
+            }
+            io_uring_sqe* sqe = ring->getSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(paths[index].c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = (index << 1) | OPEN;
+            inflight++;
+        }
+        if (inflight == 0) break;
+
+        io_uring_cqe cqe;
+        if (!ring->submitAndWait()) {
+            // The ring is unusable. Requests the kernel already took can
+            // still complete into entry buffers, so wait for those first
+            // (entries it never took are never submitted now), then read
+            // what the ring held and carry on with blocking reads.
+            size_t outstanding = inflight - ring->unsubmitted();
+            bool drained = true;
+            while (outstanding > 0) {
+                while (outstanding > 0 && ring->popCompletion(cqe)) {
+                    outstanding--;
+                    if ((cqe.user_data & 1) == OPEN && cqe.res >= 0) close(cqe.res);
+                }
+                if (outstanding > 0 && !ring->waitCompletion()) {
+                    drained = false;
+                    break;
+                }
+            }
+            std::vector<size_t> stranded;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i = 0; i < entries.size(); i++) {
+                    if (entries[i].state != FileState::READING) continue;
+                    stranded.push_back(i);
+                    // Undrained buffers may still be written to, so they
+                    // are kept (not freed by a skip) until destruction.
+                    if (!drained) entries[i].skipped = false;
+                }
+            }
+            for (size_t i : stranded) {
+                // read() reads a file itself when this failed.
+                finish(i, drained && readFileBytes(paths[i], entries[i].data));
+            }
+            runBlocking();
+            return;
+        }
+        while (ring->popCompletion(cqe)) {
+            inflight--;
+            size_t index = static_cast<size_t>(cqe.user_data >> 1);
+            Entry& entry = entries[index];
+            if ((cqe.user_data & 1) == OPEN) {
+                if (cqe.res == -EINVAL && ringOpen) {
+                    // Kernels before 5.6 have no IORING_OP_OPENAT.
+                    ringOpen = false;
+                    int fd = open(paths[index].c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fd < 0) {
+                        finish(index, false);
+                    } else {
+                        opened(index, fd);
+                    }
+                } else if (cqe.res < 0) {
+                    finish(index, false);
+                } else {
+                    opened(index, cqe.res);
+                }
+                continue;
+            }
+            if (cqe.res < 0) {
+                finish(index, false);
+            } else if (cqe.res == 0 || entry.done + cqe.res == entry.data.size()) {
+                // A file that shrank while being read keeps what was there.
+                entry.data.resize(entry.done + cqe.res);
+                finish(index, true);
+            } else {
+                entry.done += cqe.res;
+                submitRead(index);
+            }
+        }
+    }
+}
+
+void FilePrefetcher::runBlocking() {
+    size_t index;
+    while (claim(index, true)) {
+        Entry& entry = entries[index];
+        entry.fd = open(paths[index].c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (entry.fd < 0 || fstat(entry.fd, &st) != 0) {
+            finish(index, false);
+            continue;
+        }
+        entry.data.resize(static_cast<size_t>(st.st_size));
+        bool ok = true;
+        while (entry.done < entry.data.size()) {
+            ssize_t n = pread(entry.fd, &entry.data[entry.done], entry.data.size() - entry.done, entry.done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) ok = false;
+            if (n <= 0) break;
+            entry.done += n;
+        }
+        entry.data.resize(entry.done);
+        finish(index, ok);
+    }
+}
+
+bool FilePrefetcher::read(const std::string& path, std::string& out) {
+    auto found = indices.find(path);
+    if (found == indices.end()) return readFileBytes(path, out);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    Entry& entry = entries[found->second];
+    if (entry.state == FileState::PENDING || entry.state == FileState::TAKEN) {
+        // Not started yet (or read twice): reading it here is quicker than
+        // waiting for the readers to get to it.
+        entry.state = FileState::TAKEN;
+        lock.unlock();
+        return readFileBytes(path, out);
+    }
+    readyChanged.wait(lock, [&] { return entry.state == FileState::READY; });
+
+    entry.state = FileState::TAKEN;
+    readyBytes -= entry.data.size();
+    bool ok = entry.ok;
+    if (ok) {
+        out.swap(entry.data);
+        std::string().swap(entry.data);
+    }
+    lock.unlock();
+    spaceChanged.notify_all();
+    // A failed read ahead (or one abandoned with the ring) is retried here,
+    // leaving its buffer untouched.
+    return ok || readFileBytes(path, out);
+}
+
+void FilePrefetcher::skip(const std::string& path) {
+    auto found = indices.find(path);
+    if (found == indices.end()) return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    Entry& entry = entries[found->second];
+    switch (entry.state) {
+        case FileState::PENDING:
+            entry.state = FileState::TAKEN;
+            return;
+        case FileState::READING:
+            entry.skipped = true;
+            return;
+        case FileState::READY:
+            entry.state = FileState::TAKEN;
+            readyBytes -= entry.data.size();
+            std::string().swap(entry.data);
+            break;
+        case FileState::TAKEN:
+            return;
+    }
+    lock.unlock();
+    spaceChanged.notify_all();
+}
+
+static void collectWorldFiles(const std::string& dir, std::vector<std::string>& files) {
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) return;
+
+    std::string dirBase = baseName(dir);
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            collectWorldFiles(path, files);
+        } else if (S_ISREG(st.st_mode)) {
+            if (dirBase == "playerdata" && endsWith(name, ".dat")) {
+                files.push_back(path);
+            } else if ((dirBase == "region" || dirBase == "entities" || dirBase == "poi") && endsWith(name, ".mca")) {
+                files.push_back(path);
+            }
+        }
+    }
+    closedir(handle);
+}
+
+std::vector<std::string> findWorldFiles(const std::string& worldDir) {
+    std::vector<std::string> files;
+    std::string dir = worldDir;
+    while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+    collectWorldFiles(dir, files);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+void WorldBatch::processDocument(NBTFile& doc, const std::string& label, BatchFileResult& result, bool& failed) {
+    result.documents++;
+
+    // Paths were compiled once when the operations were parsed.
+    TagRef ref;
+    std::string error;
+    std::vector<TagRef> matches;
+    for (const auto& op : ops) {
+        matches.clear();
+        op.compiled->match(doc.getRoot(), matches);
+        if (matches.empty() && (op.kind != EditOpKind::SET || !resolveParentPath(doc.getRoot(), *op.compiled, ref, error))) {
+            return;
+        }
+    }
+    result.matched++;
+
+    NBTCommandRunner runner(doc);
+    for (const auto& op : ops) {
+        std::ostringstream out;
+        if (!runner.apply(op, out, error)) {
+            result.errors += label + ": " + op.path + ": " + error + "\n";
+            failed = true;
+        }
+        std::istringstream values(out.str());
+        std::string value;
+        while (std::getline(values, value)) {
+            result.output += label + ": " + op.path + " = " + value + "\n";
+        }
+    }
+    if (runner.isChanged()) {
+        result.modified++;
+    }
+}
+
+void WorldBatch::processFile(const std::string& path, IOBuffers& buffers, BatchFileResult& result) {
+    bool failed = false;
+
+    if (endsWith(path, ".mca")) {
+        RegionFile region(path);
+        if (!region.load(buffers)) {
+            result.errors += path + ": " + region.getError() + "\n";
+            result.failed++;
+            return;
+        }
+        bool changed = false;
+        for (auto& chunk : region.getChunks()) {
+            size_t modifiedBefore = result.modified;
+            processDocument(chunk.nbt, path + " " + region.chunkLabel(chunk.index), result, failed);
+            if (result.modified != modifiedBefore) {
+                chunk.dirty = true;
+                changed = true;
+            }
+        }
+        // All-or-nothing per file: one failing chunk keeps the region unwritten.
+        if (failed) {
+            result.failed++;
+        } else if (changed && !dryRun && !region.save(buffers)) {
+            result.errors += path + ": " + region.getError() + "\n";
+            result.failed++;
+        }
+        return;
+    }
+
+    NBTFile doc(path);
+    if (!doc.load(buffers)) {
+        result.errors += path + ": " + doc.getError() + "\n";
+        result.failed++;
+        return;
+    }
+    size_t modifiedBefore = result.modified;
+    processDocument(doc, path, result, failed);
+    if (failed) {
+        result.failed++;
+    } else if (result.modified != modifiedBefore && !dryRun && !doc.save(buffers)) {
+        result.errors += path + ": " + doc.getError() + "\n";
+        result.failed++;
+    }
+}
+
+int WorldBatch::run() {
+    std::vector<std::string> files = findWorldFiles(worldDir);
+    if (files.empty()) {
+        std::cerr << worldDir << ": no playerdata, region, entities or poi files found" << std::endl;
+        return 1;
+    }
+
+    // Largest files first, so they are not the last ones left running.
+    std::vector<off_t> sizes(files.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat st;
+        if (stat(files[i].c_str(), &st) == 0) sizes[i] = st.st_size;
+    }
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> readOrder;
+    for (size_t task : order) readOrder.push_back(files[task]);
+    FilePrefetcher prefetcher(readOrder);
+
+    WorkStealingPool pool(std::min(threadCount, files.size()));
+    std::vector<IOBuffers> buffers(pool.size());
+    for (auto& workerBuffers : buffers) workerBuffers.prefetcher = &prefetcher;
+    std::vector<BatchFileResult> results(files.size());
+    pool.run(order, [&](size_t task, size_t worker) {
+        processFile(files[task], buffers[worker], results[task]);
+    });
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    BatchFileResult total;
+    for (const auto& result : results) {
+        std::cout << result.output;
+        std::cerr << result.errors;
+        total.documents += result.documents;
+        total.matched += result.matched;
+        total.modified += result.modified;
+        total.failed += result.failed;
+    }
+    std::cout.flush();
+    std::cerr << files.size() << " files, " << total.documents << " documents, " << total.matched << " matched, "
+              << total.modified << " modified" << (dryRun ? " (dry run, nothing saved)" : "") << ", "
+              << total.failed << " failed files in " << seconds << "s on " << pool.size() << " threads" << std::endl;
+    return total.failed > 0 ? 1 : 0;
+}
+
+static bool isBareSNBTChar(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           c == '_' || c == '-' || c == '.' || c == '+';
+}
+
+void SNBTWriter::write(const NBTTag& tag) {
+    writeTag(tag, 0);
+    if (sink) flush();
+}
+
+void SNBTWriter::flush() {
+    if (sink && !out.empty()) {
+        sink->write(out.data(), out.size());
+        out.clear();
+    }
+}
+
+void SNBTWriter::maybeFlush() {
+    if (sink && out.size() >= flushThreshold) {
+        flush();
+    }
+}
+
+void SNBTWriter::newline(int depth) {
+    if (pretty) {
+        out += '\n';
+        out.append(static_cast<size_t>(depth) * 4, ' ');
+    }
+}
+
+void SNBTWriter::writeKey(const std::string& key) {
+    bool bare = !key.empty();
+    for (char c : key) {
+        if (!isBareSNBTChar(c)) {
+            bare = false;
+            break;
+        }
+    }
+    if (bare) {
+        out += key;
+    } else {
+        writeQuoted(key);
+    }
+}
+
+void SNBTWriter::writeQuoted(const std::string& str) {
+    // Like the game: double quotes unless the string contains some and no
+    // single quotes.
+    char quote = '"';
+    if (str.find('"') != std::string::npos && str.find('\'') == std::string::npos) {
+        quote = '\'';
+    }
+
+    // Control characters are escaped too, so a value always stays on one
+    // line for the line-based patch and journal formats.
+    static const char hex[] = "0123456789abcdef";
+    out += quote;
+    size_t start = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c >= 0x20 && c != 0x7F && c != static_cast<unsigned char>(quote) && c != '\\') continue;
+        out.append(str, start, i - start);
+        out += '\\';
+        switch (c) {
+            case '\n': out += 'n'; break;
+            case '\r': out += 'r'; break;
+            case '\t': out += 't'; break;
+            default:
+                if (c < 0x20 || c == 0x7F) {
+                    out += "u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xF];
+                } else {
+                    out += static_cast<char>(c);
+                }
+                break;
+        }
+        start = i + 1;
+    }
+    out.append(str, start, std::string::npos);
+    out += quote;
+}
+
+void appendInteger(std::string& out, int64_t value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+        *--p = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) *--p = '-';
+    out.append(p, end - p);
+}
+
+// Appends ".0" to integral-looking results so 20.0f does not come out as 20f.
+static void appendDecimal(std::string& out, const char* text) {
+    out += text;
+    if (std::strpbrk(text, ".eEnN") == nullptr) {
+        out += ".0";
+    }
+}
+
+// NaN and infinities the way the game's SNBT writer prints them.
+static bool appendNonFinite(std::string& out, double value) {
+    if (std::isfinite(value)) return false;
+    out += std::isnan(value) ? "NaN" : value < 0 ? "-Infinity" : "Infinity";
+    return true;
+}
+
+void appendFloat(std::string& out, float value) {
+    if (appendNonFinite(out, value)) return;
+    if (value == std::floor(value) && std::fabs(value) < 1e7f && !std::signbit(value)) {
+        appendInteger(out, static_cast<int64_t>(value));
+        out += ".0";
+        return;
+    }
+    // Shortest precision that round-trips, like Java's Float.toString.
+    char text[32];
+    for (int precision = 6; precision <= 9; precision++) {
+        std::snprintf(text, sizeof(text), "%.*g", precision, value);
+        if (std::strtof(text, nullptr) == value) break;
+    }
+    appendDecimal(out, text);
+}
+
+void appendDouble(std::string& out, double value) {
+    if (appendNonFinite(out, value)) return;
+    if (value == std::floor(value) && std::fabs(value) < 1e15 && !std::signbit(value)) {
+        appendInteger(out, static_cast<int64_t>(value));
+        out += ".0";
+        return;
+    }
+    char text[40];
+    for (int precision = 15; precision <= 17; precision++) {
+        std::snprintf(text, sizeof(text), "%.*g", precision, value);
+        if (std::strtod(text, nullptr) == value) break;
+    }
+    appendDecimal(out, text);
+}
+
+void SNBTWriter::writeTag(const NBTTag& tag, int depth) {
+    const NBTValue& value = tag.value;
+    switch (tag.type) {
+        case TagType::BYTE:
+            appendInteger(out, value.byteVal);
+            out += 'b';
+            break;
+        case TagType::SHORT:
+            appendInteger(out, value.shortVal);
+            out += 's';
+            break;
+        case TagType::INT:
+            appendInteger(out, value.intVal);
+            break;
+        case TagType::LONG:
+            appendInteger(out, value.longVal);
+            out += 'L';
+            break;
+        case TagType::FLOAT:
+            appendFloat(out, value.floatVal);
+            out += 'f';
+            break;
+        case TagType::DOUBLE:
+            appendDouble(out, value.doubleVal);
+            out += 'd';
+            break;
+        case TagType::STRING:
+            writeQuoted(value.stringVal);
+            break;
+        case TagType::BYTE_ARRAY:
+            out += "[B;";
+            for (size_t i = 0; i < value.byteArrayVal.size(); i++) {
+                if (i > 0) out += pretty ? ", " : ",";
+                appendInteger(out, value.byteArrayVal[i]);
+                out += 'B';
+            }
+            out += ']';
+            break;
+        case TagType::INT_ARRAY:
+            out += "[I;";
+            for (size_t i = 0; i < value.intArrayVal.size(); i++) {
+                if (i > 0) out += pretty ? ", " : ",";
+                appendInteger(out, value.intArrayVal[i]);
+            }
+            out += ']';
+            break;
+        case TagType::LONG_ARRAY:
+            out += "[L;";
+            for (size_t i = 0; i < value.longArrayVal.size(); i++) {
+                if (i > 0) out += pretty ? ", " : ",";
+                appendInteger(out, value.longArrayVal[i]);
+                out += 'L';
+            }
+            out += ']';
+            break;
+        case TagType::LIST: {
+            // Pretty mode keeps lists of scalars on one line.
+            bool nested = !value.listVal.empty() &&
+                          (value.listVal[0]->type == TagType::COMPOUND || value.listVal[0]->type == TagType::LIST);
+            out += '[';
+            for (size_t i = 0; i < value.listVal.size(); i++) {
+                if (i > 0) out += (pretty && !nested) ? ", " : ",";
+                if (nested) newline(depth + 1);
+                writeTag(*value.listVal[i], depth + 1);
+                maybeFlush();
+            }
+            if (nested) newline(depth);
+            out += ']';
+            break;
+        }
+        case TagType::COMPOUND: {
+            out += '{';
+            bool first = true;
+            for (const auto& pair : value.compoundVal) {
+                if (!first) out += ',';
+                first = false;
+                newline(depth + 1);
+                writeKey(pair.first);
+                out += pretty ? ": " : ":";
+                writeTag(*pair.second, depth + 1);
+                maybeFlush();
+            }
+            if (!value.compoundVal.empty()) newline(depth);
+            out += '}';
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+std::string toSNBT(const NBTTag& tag, bool pretty) {
+    std::string result;
+    SNBTWriter writer(result, pretty);
+    writer.write(tag);
+    return result;
+}
+
+int runSNBTExport(const std::string& filename, const std::string& path, bool pretty) {
+    NBTFile nbtFile(filename);
+    nbtFile.setCacheDir(defaultCacheDir());
+    if (!nbtFile.load()) {
+        std::cerr << filename << ": " << nbtFile.getError() << std::endl;
+        return 1;
+    }
+
+    TagRef ref;
+    std::string error;
+    if (!resolvePath(nbtFile.getRoot(), path, ref, error)) {
+        std::cerr << filename << ": " << error << std::endl;
+        return 1;
+    }
+
+    std::string buffer;
+    buffer.reserve(1 << 20);
+    SNBTWriter writer(buffer, pretty, &std::cout);
+    writer.write(*ref.tag);
+    std::cout << "\n";
+    return std::cout ? 0 : 1;
+}
+
+void SNBTParser::fail(const std::string& message) {
+    throw std::runtime_error(message + " at offset " + std::to_string(pos - begin));
+}
+
+void SNBTParser::skipWhitespace() {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+        pos++;
+    }
+}
+
+void SNBTParser::expect(char c) {
+    skipWhitespace();
+    if (pos >= end || *pos != c) {
+        fail(std::string("expected '") + c + "'");
+    }
+    pos++;
+}
+
+std::string SNBTParser::parseQuoted() {
+    char quote = *pos++;
+    std::string result;
+    const char* start = pos;
+    while (true) {
+        if (pos >= end) fail("unterminated string");
+        if (*pos == quote) break;
+        if (*pos == '\\') {
+            result.append(start, pos - start);
+            pos++;
+            if (pos >= end) fail("unterminated string");
+            switch (*pos) {
+                case 'n': result += '\n'; break;
+                case 't': result += '\t'; break;
+                case 'r': result += '\r'; break;
+                case 'u': {
+                    uint32_t code = 0;
+                    for (int digit = 0; digit < 4; digit++) {
+                        if (++pos >= end || !std::isxdigit(static_cast<unsigned char>(*pos))) {
+                            fail("bad \\u escape");
+                        }
+                        char c = static_cast<char>(std::tolower(static_cast<unsigned char>(*pos)));
+                        code = code * 16 + static_cast<uint32_t>(c <= '9' ? c - '0' : c - 'a' + 10);
+                    }
+                    // UTF-8, one code unit at a time like the game's strings.
+                    if (code < 0x80) {
+                        result += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        result += static_cast<char>(0xC0 | (code >> 6));
+                        result += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        result += static_cast<char>(0xE0 | (code >> 12));
+                        result += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        result += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: result += *pos; break;
+            }
+            start = ++pos;
+            continue;
+        }
+        pos++;
+    }
+    result.append(start, pos - start);
+    pos++;
+    return result;
+}
+
+std::string SNBTParser::parseBareWord() {
+    const char* start = pos;
+    while (pos < end && isBareSNBTChar(*pos)) {
+        pos++;
+    }
+    return std::string(start, pos - start);
+}
+
+std::string SNBTParser::parseKey() {
+    skipWhitespace();
+    if (pos < end && (*pos == '"' || *pos == '\'')) {
+        return parseQuoted();
+    }
+    std::string key = parseBareWord();
+    if (key.empty()) fail("expected key");
+    return key;
+}
+
+std::shared_ptr<NBTTag> SNBTParser::parseValue(const std::string& name, int depth) {
+    if (depth > MAX_NBT_DEPTH) {
+        fail("nesting deeper than " + std::to_string(MAX_NBT_DEPTH));
+    }
+
+    skipWhitespace();
+    if (pos >= end) fail("expected value");
+
+    switch (*pos) {
+        case '{':
+            return parseCompound(name, depth);
+        case '[':
+            if (end - pos >= 3 && pos[2] == ';' && (pos[1] == 'B' || pos[1] == 'I' || pos[1] == 'L')) {
+                char kind = pos[1];
+                pos += 3;
+                return parseArray(name, kind);
+            }
+            return parseList(name, depth);
+        case '"':
+        case '\'': {
+            auto tag = std::make_shared<NBTTag>(TagType::STRING, name);
+            tag->value.stringVal = parseQuoted();
+            return tag;
+        }
+        default:
+            return parseScalar(name);
+    }
+}
+
+std::shared_ptr<NBTTag> SNBTParser::parseCompound(const std::string& name, int depth) {
+    auto tag = std::make_shared<NBTTag>(TagType::COMPOUND, name);
+    pos++;
+    skipWhitespace();
+    if (pos < end && *pos == '}') {
+        pos++;
+        return tag;
+    }
+    while (true) {
+        std::string key = parseKey();
+        expect(':');
+        tag->value.compoundVal[key] = parseValue(key, depth + 1);
+        skipWhitespace();
+        if (pos < end && *pos == ',') {
+            pos++;
+            continue;
+        }
+        expect('}');
+        return tag;
+    }
+}
+
+std::shared_ptr<NBTTag> SNBTParser::parseList(const std::string& name, int depth) {
+    auto tag = std::make_shared<NBTTag>(TagType::LIST, name);
+    pos++;
+    skipWhitespace();
+    if (pos < end && *pos == ']') {
+        pos++;
+        return tag;
+    }
+    while (true) {
+        auto item = parseValue("", depth + 1);
+        auto& items = tag->value.listVal;
+        if (!items.empty() && items[0]->type != item->type) {
+            fail("list mixes " + tagTypeToString(items[0]->type) + " and " + tagTypeToString(item->type));
+        }
+        items.push_back(item);
+        skipWhitespace();
+        if (pos < end && *pos == ',') {
+            pos++;
+            continue;
+        }
+        expect(']');
+        tag->value.listType = items[0]->type;
+        return tag;
+    }
+}
+
+std::shared_ptr<NBTTag> SNBTParser::parseArray(const std::string& name, char kind) {
+    TagType type = kind == 'B' ? TagType::BYTE_ARRAY : kind == 'I' ? TagType::INT_ARRAY : TagType::LONG_ARRAY;
+    TagType elementType = kind == 'B' ? TagType::BYTE : kind == 'I' ? TagType::INT : TagType::LONG;
+    auto tag = std::make_shared<NBTTag>(type, name);
+
+    skipWhitespace();
+    if (pos < end && *pos == ']') {
+        pos++;
+        return tag;
+    }
+    while (true) {
+        skipWhitespace();
+        auto item = parseScalar("");
+        if (item->type != elementType) {
+            fail(std::string("expected ") + tagTypeToString(elementType) + " in [" + kind + ";] array");
+        }
+        switch (kind) {
+            case 'B': tag->value.byteArrayVal.push_back(item->value.byteVal); break;
+            case 'I': tag->value.intArrayVal.push_back(item->value.intVal); break;
+            default: tag->value.longArrayVal.push_back(item->value.longVal); break;
+        }
+        skipWhitespace();
+        if (pos < end && *pos == ',') {
+            pos++;
+            continue;
+        }
+        expect(']');
+        return tag;
+    }
+}
+
+// Checks a bare word against the game's number patterns: an optional sign,
+// digits with at most one '.', an optional exponent, and the suffix already
+// stripped by the caller.
+static bool isSNBTNumber(const std::string& word, size_t length, bool integer) {
+    size_t i = 0;
+    if (i < length && (word[i] == '+' || word[i] == '-')) i++;
+    size_t digits = 0;
+    bool dot = false;
+    for (; i < length; i++) {
+        char c = word[i];
+        if (c >= '0' && c <= '9') {
+            digits++;
+        } else if (c == '.' && !integer && !dot) {
+            dot = true;
+        } else {
+            break;
+        }
+    }
+    if (digits == 0) return false;
+    if (i < length && !integer && (word[i] == 'e' || word[i] == 'E')) {
+        i++;
+        if (i < length && (word[i] == '+' || word[i] == '-')) i++;
+        size_t expDigits = 0;
+        while (i < length && word[i] >= '0' && word[i] <= '9') {
+            i++;
+            expDigits++;
+        }
+        if (expDigits == 0) return false;
+    }
+    return i == length;
+}
+
+// The words appendFloat and appendDouble use for values without digits.
+static bool isSNBTNonFinite(const std::string& word, size_t length) {
+    std::string body = word.substr(0, length);
+    return body == "NaN" || body == "Infinity" || body == "-Infinity" || body == "+Infinity";
+}
+
+std::shared_ptr<NBTTag> SNBTParser::parseScalar(const std::string& name) {
+    std::string word = parseBareWord();
+    if (word.empty()) fail("expected value");
+
+    char suffix = static_cast<char>(std::tolower(static_cast<unsigned char>(word.back())));
+    size_t bodyLength = word.size() - 1;
+    errno = 0;
+    char* parsedEnd = nullptr;
+
+    if ((suffix == 'b' || suffix == 's' || suffix == 'l') && isSNBTNumber(word, bodyLength, true)) {
+        long long value = std::strtoll(word.c_str(), &parsedEnd, 10);
+        long long low = suffix == 'b' ? INT8_MIN : suffix == 's' ? INT16_MIN : INT64_MIN;
+        long long high = suffix == 'b' ? INT8_MAX : suffix == 's' ? INT16_MAX : INT64_MAX;
+        if (errno == 0 && value >= low && value <= high) {
+            TagType type = suffix == 'b' ? TagType::BYTE : suffix == 's' ? TagType::SHORT : TagType::LONG;
+            auto tag = std::make_shared<NBTTag>(type, name);
+            tag->value.byteVal = static_cast<int8_t>(value);
+            tag->value.shortVal = static_cast<int16_t>(value);
+            tag->value.longVal = value;
+            return tag;
+        }
+    } else if ((suffix == 'f' || suffix == 'd') &&
+               (isSNBTNumber(word, bodyLength, false) || isSNBTNonFinite(word, bodyLength))) {
+        auto tag = std::make_shared<NBTTag>(suffix == 'f' ? TagType::FLOAT : TagType::DOUBLE, name);
+        if (suffix == 'f') {
+            tag->value.floatVal = std::strtof(word.c_str(), &parsedEnd);
+        } else {
+            tag->value.doubleVal = std::strtod(word.c_str(), &parsedEnd);
+        }
+        return tag;
+    } else if (isSNBTNumber(word, word.size(), true)) {
+        long long value = std::strtoll(word.c_str(), &parsedEnd, 10);
+        if (errno == 0 && value >= INT32_MIN && value <= INT32_MAX) {
+            auto tag = std::make_shared<NBTTag>(TagType::INT, name);
+            tag->value.intVal = static_cast<int32_t>(value);
+            return tag;
+        }
+    } else if (word.find('.') != std::string::npos && isSNBTNumber(word, word.size(), false)) {
+        auto tag = std::make_shared<NBTTag>(TagType::DOUBLE, name);
+        tag->value.doubleVal = std::strtod(word.c_str(), &parsedEnd);
+        return tag;
+    } else if (word == "true" || word == "false") {
+        auto tag = std::make_shared<NBTTag>(TagType::BYTE, name);
+        tag->value.byteVal = word == "true" ? 1 : 0;
+        return tag;
+    }
+
+    auto tag = std::make_shared<NBTTag>(TagType::STRING, name);
+    tag->value.stringVal = word;
+    return tag;
+}
+
+bool SNBTParser::parse(std::shared_ptr<NBTTag>& result, std::string& error, const std::string& name) {
+    try {
+        result = parseValue(name, 0);
+        skipWhitespace();
+        if (pos != end) {
+            fail("unexpected trailing data");
+        }
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool SNBTParser::parsePrefix(std::shared_ptr<NBTTag>& result, std::string& error, size_t& consumed) {
+    try {
+        result = parseValue("", 0);
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    consumed = static_cast<size_t>(pos - begin);
+    return true;
+}
+
+bool parseSNBT(const std::string& text, std::shared_ptr<NBTTag>& result, std::string& error) {
+    SNBTParser parser(text.data(), text.size());
+    return parser.parse(result, error);
+}
+
+int runSNBTImport(const std::string& input, const std::string& output, Compression compression) {
+    std::string text;
+    if (input == "-") {
+        std::ostringstream buffer;
+        buffer << std::cin.rdbuf();
+        text = buffer.str();
+    } else if (!readFileBytes(input, text)) {
+        std::cerr << "cannot read " << input << std::endl;
+        return 1;
+    }
+
+    std::shared_ptr<NBTTag> root;
+    std::string error;
+    if (!parseSNBT(text, root, error)) {
+        std::cerr << input << ": " << error << std::endl;
+        return 1;
+    }
+    if (root->type != TagType::COMPOUND) {
+        std::cerr << input << ": top-level value must be a compound" << std::endl;
+        return 1;
+    }
+
+    NBTFile nbtFile(output, compression);
+    nbtFile.setRoot(root);
+    if (!nbtFile.save()) {
+        std::cerr << output << ": " << nbtFile.getError() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static std::string jsonTypeName(TagType type) {
+    std::string name = tagTypeToString(type);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return name;
+}
+
+JSONWriter::JSONWriter(std::ostream& output, const JSONExportOptions& opts)
+    : sink(output), options(opts) {
+    out.reserve(1 << 16);
+}
+
+void JSONWriter::flush() {
+    if (!out.empty()) {
+        sink.write(out.data(), out.size());
+        written += out.size();
+        out.clear();
+    }
+}
+
+void JSONWriter::maybeFlush() {
+    if (out.size() >= (1 << 16)) {
+        flush();
+    }
+}
+
+void JSONWriter::beginDocument() {
+    documentStart = written + out.size();
+}
+
+void JSONWriter::endDocument() {
+    maybeFlush();
+}
+
+void JSONWriter::discardDocument(const std::string& error) {
+    frames.clear();
+    if (written <= documentStart) {
+        out.resize(static_cast<size_t>(documentStart - written));
+        return;
+    }
+    out.clear();
+
+    // The file may have held data before ours (>>), so the line's offset
+    // is taken back from the current position.
+    struct stat st;
+    off_t position;
+    if (&sink == &std::cout && sink.flush() && std::fflush(stdout) == 0 && fstat(fileno(stdout), &st) == 0 &&
+        S_ISREG(st.st_mode) && (position = lseek(fileno(stdout), 0, SEEK_CUR)) >= 0) {
+        off_t start = position - static_cast<off_t>(written - documentStart);
+        if (start >= 0 && ftruncate(fileno(stdout), start) == 0 && lseek(fileno(stdout), start, SEEK_SET) == start) {
+            written = documentStart;
+            return;
+        }
+    }
+    out += "\n{\"error\":";
+    writeString(error);
+    out += "}\n";
+    flush();
+}
+
+void JSONWriter::raw(const std::string& text) {
+    out += text;
+    maybeFlush();
+}
+
+// Writes the comma before a value and, inside a compound, its key.
+void JSONWriter::separator(const std::string& name) {
+    if (frames.empty()) return;
+    Frame& frame = frames.back();
+    if (!frame.first) out += ',';
+    frame.first = false;
+    if (frame.compound) {
+        writeString(name);
+        out += ':';
+    }
+}
+
+void JSONWriter::writeString(const std::string& str) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    size_t start = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out.append(str, start, i - start);
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xF];
+                break;
+        }
+        start = i + 1;
+    }
+    out.append(str, start, std::string::npos);
+    out += '"';
+}
+
+void JSONWriter::beginTyped(TagType type) {
+    out += "{\"type\":\"";
+    out += jsonTypeName(type);
+    out += "\",\"value\":";
+}
+
+void JSONWriter::beginCompound(const std::string& name) {
+    separator(name);
+    out += '{';
+    frames.push_back(Frame{true, true, false});
+}
+
+void JSONWriter::endCompound() {
+    frames.pop_back();
+    out += '}';
+    maybeFlush();
+}
+
+void JSONWriter::beginList(const std::string& name, TagType, int32_t) {
+    separator(name);
+    out += '[';
+    frames.push_back(Frame{false, true, false});
+}
+
+void JSONWriter::endList() {
+    frames.pop_back();
+    out += ']';
+    maybeFlush();
+}
+
+void JSONWriter::integer(const std::string& name, TagType type, int64_t value) {
+    separator(name);
+    if (options.typedValues) beginTyped(type);
+    bool quoted = type == TagType::LONG && options.longsAsStrings;
+    if (quoted) out += '"';
+    appendInteger(out, value);
+    if (quoted) out += '"';
+    if (options.typedValues) out += '}';
+}
+
+void JSONWriter::floating(const std::string& name, TagType type, double value) {
+    separator(name);
+    if (options.typedValues) beginTyped(type);
+    // JSON has no NaN or infinity; they become the strings Java prints.
+    if (!std::isfinite(value)) {
+        out += '"';
+        appendDouble(out, value);
+        out += '"';
+    } else if (type == TagType::FLOAT) {
+        appendFloat(out, static_cast<float>(value));
+    } else {
+        appendDouble(out, value);
+    }
+    if (options.typedValues) out += '}';
+}
+
+void JSONWriter::string(const std::string& name, const std::string& value) {
+    separator(name);
+    if (options.typedValues) beginTyped(TagType::STRING);
+    writeString(value);
+    if (options.typedValues) out += '}';
+    maybeFlush();
+}
+
+void JSONWriter::beginArray(const std::string& name, TagType type, int32_t) {
+    separator(name);
+    if (options.typedValues) beginTyped(type);
+    out += '[';
+    frames.push_back(Frame{false, true, type == TagType::LONG_ARRAY});
+}
+
+void JSONWriter::arrayValues(const int64_t* values, size_t count) {
+    Frame& frame = frames.back();
+    bool quoted = frame.longs && options.longsAsStrings;
+    for (size_t i = 0; i < count; i++) {
+        if (!frame.first) out += ',';
+        frame.first = false;
+        if (quoted) out += '"';
+        appendInteger(out, values[i]);
+        if (quoted) out += '"';
+    }
+    maybeFlush();
+}
+
+void JSONWriter::endArray() {
+    frames.pop_back();
+    out += ']';
+    if (options.typedValues) out += '}';
+    maybeFlush();
+}
+
+int runJSONExport(const std::vector<std::string>& files, const JSONExportOptions& options) {
+    JSONWriter writer(std::cout, options);
+    int status = 0;
+    std::string payload;
+
+    for (const auto& path : files) {
+        if (!endsWith(path, ".mca")) {
+            NBTFile nbtFile(path);
+            writer.beginDocument();
+            if (!nbtFile.streamFile(writer)) {
+                writer.discardDocument(path + ": " + nbtFile.getError());
+                std::cerr << path << ": " << nbtFile.getError() << std::endl;
+                status = 1;
+                continue;
+            }
+            writer.raw("\n");
+            writer.endDocument();
+            continue;
+        }
+
+        // One line per chunk, wrapped with its coordinates.
+        RegionFile region(path);
+        if (!region.loadHeader()) {
+            std::cerr << path << ": " << region.getError() << std::endl;
+            status = 1;
+            continue;
+        }
+        for (int i = 0; i < REGION_CHUNKS; i++) {
+            if (!region.hasChunk(i)) continue;
+            if (!region.readChunk(i, payload)) {
+                std::cerr << path << ": " << region.getError() << std::endl;
+                status = 1;
+                continue;
+            }
+            writer.beginDocument();
+            writer.raw("{\"x\":" + std::to_string(region.getRegionX() * 32 + i % 32) +
+                       ",\"z\":" + std::to_string(region.getRegionZ() * 32 + i / 32) +
+                       ",\"timestamp\":" + std::to_string(region.getTimestamp(i)) + ",\"data\":");
+            NBTFile chunk(path);
+            std::string error;
+            try {
+                MemoryStreamBuf memory(payload.data(), payload.size());
+                std::istream compressed(&memory);
+                InflateStreamBuf inflater(compressed);
+                std::istream stream(&inflater);
+                if (!chunk.streamEvents(stream, writer)) error = chunk.getError();
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            if (!error.empty()) {
+                writer.discardDocument(path + " " + region.chunkLabel(i) + ": " + error);
+                std::cerr << path << " " << region.chunkLabel(i) << ": " << error << std::endl;
+                status = 1;
+                continue;
+            }
+            writer.raw("}\n");
+            writer.endDocument();
+        }
+    }
+    writer.flush();
+    std::cout.flush();
+    return status;
+}
+
+static void collectQueryFiles(const std::string& input, std::vector<std::string>& files) {
+    struct stat st;
+    if (stat(input.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        std::vector<std::string> found = findWorldFiles(input);
+        files.insert(files.end(), found.begin(), found.end());
+    } else {
+        files.push_back(input);
+    }
+}
+
+int runQuery(const std::string& path, const std::vector<std::string>& inputs, size_t threads) {
+    NBTPath query;
+    std::string error;
+    if (!query.compile(path, error)) {
+        std::cerr << path << ": " << error << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    for (const auto& input : inputs) {
+        collectQueryFiles(input, files);
+    }
+    if (files.empty()) {
+        std::cerr << "no files to query" << std::endl;
+        return 1;
+    }
+
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    WorkStealingPool pool(std::min(threads, files.size()));
+    std::vector<BatchFileResult> results(files.size());
+    std::vector<std::string> payloads(pool.size());
+
+    // Region files are read chunk by chunk; only whole documents are read
+    // ahead.
+    std::vector<std::string> documents;
+    for (const auto& file : files) {
+        if (!endsWith(file, ".mca")) documents.push_back(file);
+    }
+    FilePrefetcher prefetcher(documents);
+
+    pool.run(order, [&](size_t task, size_t worker) {
+        const std::string& file = files[task];
+        BatchFileResult& result = results[task];
+        std::string label = file;
+        PathStreamMatcher matcher(query, [&](const TagRef& ref) {
+            result.matched++;
+            result.output += label;
+            result.output += ": ";
+            SNBTWriter writer(result.output);
+            writer.write(*ref.tag);
+            result.output += '\n';
+        });
+
+        if (!endsWith(file, ".mca")) {
+            NBTFile nbtFile(file);
+            std::string& raw = payloads[worker];
+            result.documents++;
+            if (!prefetcher.read(file, raw)) {
+                result.errors += file + ": cannot read " + file + "\n";
+                result.failed++;
+                return;
+            }
+            try {
+                MemoryStreamBuf memory(raw.data(), raw.size());
+                std::istream compressed(&memory);
+                InflateStreamBuf inflater(compressed);
+                std::istream stream(&inflater);
+                if (!nbtFile.streamEvents(stream, matcher)) {
+                    result.errors += file + ": " + nbtFile.getError() + "\n";
+                    result.failed++;
+                }
+            } catch (const std::exception& e) {
+                result.errors += file + ": " + e.what() + "\n";
+                result.failed++;
+            }
+            return;
+        }
+
+        RegionFile region(file);
+        if (!region.loadHeader()) {
+            result.errors += file + ": " + region.getError() + "\n";
+            result.failed++;
+            return;
+        }
+        std::string& payload = payloads[worker];
+        for (int i = 0; i < REGION_CHUNKS; i++) {
+            if (!region.hasChunk(i)) continue;
+            result.documents++;
+            label = file + " " + region.chunkLabel(i);
+            if (!region.readChunk(i, payload)) {
+                result.errors += file + ": " + region.getError() + "\n";
+                result.failed++;
+                continue;
+            }
+            NBTFile chunk(file);
+            matcher.reset();
+            try {
+                MemoryStreamBuf memory(payload.data(), payload.size());
+                std::istream compressed(&memory);
+                InflateStreamBuf inflater(compressed);
+                std::istream stream(&inflater);
+                if (!chunk.streamEvents(stream, matcher)) {
+                    result.errors += label + ": " + chunk.getError() + "\n";
+                    result.failed++;
+                }
+            } catch (const std::exception& e) {
+                result.errors += label + ": " + e.what() + "\n";
+                result.failed++;
+            }
+        }
+    });
+
+    size_t matched = 0;
+    size_t failed = 0;
+    for (const auto& result : results) {
+        std::cout << result.output;
+        std::cerr << result.errors;
+        matched += result.matched;
+        failed += result.failed;
+    }
+    std::cout.flush();
+    std::cerr << matched << " matches in " << files.size() << " files" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+static const uint32_t MAX_DAEMON_FRAME = 256u << 20;
+
+static void appendBE32(std::string& out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+static void appendField(std::string& out, const std::string& field) {
+    appendBE32(out, static_cast<uint32_t>(field.size()));
+    out += field;
+}
+
+static bool readField(const std::string& payload, size_t& pos, std::string& field) {
+    if (payload.size() - pos < 4) return false;
+    uint32_t length = readBE32(payload, pos);
+    pos += 4;
+    if (payload.size() - pos < length) return false;
+    field.assign(payload, pos, length);
+    pos += length;
+    return true;
+}
+
+void encodeDaemonRequest(const DaemonRequest& request, std::string& frame) {
+    std::string payload;
+    payload += static_cast<char>(request.op);
+    appendBE32(payload, static_cast<uint32_t>(request.chunk));
+    appendField(payload, request.file);
+    appendField(payload, request.path);
+    appendField(payload, request.value);
+    frame.clear();
+    appendBE32(frame, static_cast<uint32_t>(payload.size()));
+    frame += payload;
+}
+
+bool decodeDaemonRequest(const std::string& payload, DaemonRequest& request) {
+    if (payload.size() < 5) return false;
+    uint8_t op = static_cast<uint8_t>(payload[0]);
+    if (op < static_cast<uint8_t>(DaemonOp::GET) || op > static_cast<uint8_t>(DaemonOp::SHUTDOWN)) return false;
+    request.op = static_cast<DaemonOp>(op);
+    request.chunk = static_cast<int32_t>(readBE32(payload, 1));
+    size_t pos = 5;
+    return readField(payload, pos, request.file) && readField(payload, pos, request.path) &&
+           readField(payload, pos, request.value) && pos == payload.size();
+}
+
+void encodeDaemonResponse(bool ok, const std::string& body, std::string& frame) {
+    frame.clear();
+    appendBE32(frame, static_cast<uint32_t>(body.size() + 5));
+    frame += static_cast<char>(ok ? 0 : 1);
+    appendField(frame, body);
+}
+
+bool decodeDaemonResponse(const std::string& payload, bool& ok, std::string& body) {
+    if (payload.empty()) return false;
+    ok = payload[0] == 0;
+    size_t pos = 1;
+    return readField(payload, pos, body) && pos == payload.size();
+}
+
+NBTDaemon::CachedFile* NBTDaemon::open(const std::string& file, std::string& error) {
+    int64_t mtime = 0;
+    int64_t size = 0;
+    bool exists = statFile(file, mtime, size);
+
+    auto it = cache.find(file);
+    if (it != cache.end()) {
+        CachedFile& cached = it->second;
+        if (cached.dirty || (exists && cached.mtime == mtime && cached.size == size)) {
+            return &cached;
+        }
+        cache.erase(it);
+    }
+    if (!exists) {
+        error = "cannot read " + file;
+        return nullptr;
+    }
+
+    CachedFile cached;
+    cached.mtime = mtime;
+    cached.size = size;
+    if (endsWith(file, ".mca")) {
+        cached.region.reset(new RegionFile(file));
+        if (!cached.region->load(buffers)) {
+            error = file + ": " + cached.region->getError();
+            return nullptr;
+        }
+    } else {
+        cached.nbt.reset(new NBTFile(file));
+        cached.nbt->setCacheDir(defaultCacheDir());
+        if (!cached.nbt->load(buffers)) {
+            error = file + ": " + cached.nbt->getError();
+            return nullptr;
+        }
+    }
+    CachedFile& stored = cache[file];
+    stored = std::move(cached);
+    return &stored;
+}
+
+bool NBTDaemon::handle(const DaemonRequest& request, std::string& body) {
+    switch (request.op) {
+        case DaemonOp::STATUS:
+            for (const auto& pair : cache) {
+                body += pair.first + (pair.second.dirty ? " (modified)\n" : "\n");
+            }
+            return true;
+        case DaemonOp::SHUTDOWN: {
+            size_t dirty = 0;
+            for (const auto& pair : cache) {
+                if (pair.second.dirty) dirty++;
+            }
+            if (dirty > 0 && request.value != "force") {
+                body = std::to_string(dirty) + " files have unsaved changes (shutdown force discards them)";
+                return false;
+            }
+            running = false;
+            return true;
+        }
+        case DaemonOp::RELOAD:
+            cache.erase(request.file);
+            return true;
+        default:
+            break;
+    }
+
+    CachedFile* cached = open(request.file, body);
+    if (!cached) return false;
+
+    if (request.op == DaemonOp::SAVE) {
+        if (!cached->dirty) return true;
+        bool saved = cached->region ? cached->region->save(buffers) : cached->nbt->save(buffers);
+        if (!saved) {
+            body = cached->region ? cached->region->getError() : cached->nbt->getError();
+            return false;
+        }
+        cached->dirty = false;
+        statFile(request.file, cached->mtime, cached->size);
+        return true;
+    }
+
+    std::shared_ptr<NBTPath> path = std::make_shared<NBTPath>();
+    if (!path->compile(request.path, body)) return false;
+
+    // The documents addressed: the file itself, one chunk, or for a query
+    // on a region without a chunk, every chunk.
+    std::vector<std::pair<NBTFile*, RegionChunk*>> docs;
+    if (cached->nbt) {
+        docs.push_back(std::make_pair(cached->nbt.get(), nullptr));
+    } else {
+        for (auto& chunk : cached->region->getChunks()) {
+            if (chunk.index == request.chunk || (request.chunk < 0 && request.op == DaemonOp::QUERY)) {
+                docs.push_back(std::make_pair(&chunk.nbt, &chunk));
+            }
+        }
+        if (docs.empty()) {
+            body = request.chunk < 0 ? "a chunk is required for region files" : cached->region->chunkLabel(request.chunk) + ": not present";
+            return false;
+        }
+    }
+
+    if (request.op == DaemonOp::QUERY) {
+        std::vector<TagRef> matches;
+        for (const auto& doc : docs) {
+            matches.clear();
+            path->match(doc.first->getRoot(), matches);
+            for (const auto& match : matches) {
+                if (doc.second) body += cached->region->chunkLabel(doc.second->index) + ": ";
+                body += toSNBT(*match.tag);
+                body += '\n';
+            }
+        }
+        return true;
+    }
+
+    EditOp op;
+    op.kind = request.op == DaemonOp::GET ? EditOpKind::GET : request.op == DaemonOp::SET ? EditOpKind::SET : EditOpKind::DEL;
+    op.path = request.path;
+    op.value = request.value;
+    op.compiled = path;
+    NBTCommandRunner runner(*docs[0].first);
+    std::ostringstream out;
+    // apply() checks every match before changing any, so a failed edit
+    // leaves the cached tree as it was and clean.
+    bool ok = runner.apply(op, out, body);
+    if (ok && runner.isChanged()) {
+        cached->dirty = true;
+        if (docs[0].second) docs[0].second->dirty = true;
+    }
+    if (ok) body = out.str();
+    return ok;
+}
+
+static volatile sig_atomic_t daemonStopRequested = 0;
+
+static void requestDaemonStop(int) {
+    daemonStopRequested = 1;
+}
+
+int NBTDaemon::run() {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << socketPath << ": socket path too long" << std::endl;
+        return 1;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct stat st;
+    if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socketPath.c_str());
+    }
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        chmod(socketPath.c_str(), 0600) != 0 || listen(listener, 16) != 0) {
+        std::cerr << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+
+    signal(SIGINT, requestDaemonStop);
+    signal(SIGTERM, requestDaemonStop);
+    signal(SIGPIPE, SIG_IGN);
+    std::cerr << "listening on " << socketPath << std::endl;
+
+    std::vector<Connection> connections;
+    std::vector<pollfd> fds;
+    char readBuffer[1 << 16];
+    while (running && !daemonStopRequested) {
+        fds.clear();
+        pollfd accepting = { listener, POLLIN, 0 };
+        fds.push_back(accepting);
+        for (const auto& connection : connections) {
+            pollfd entry = { connection.fd, static_cast<short>(POLLIN | (connection.output.empty() ? 0 : POLLOUT)), 0 };
+            fds.push_back(entry);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "poll: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for (size_t i = 0; i + 1 < fds.size(); i++) {
+            Connection& connection = connections[i];
+            bool closed = false;
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t count = read(connection.fd, readBuffer, sizeof(readBuffer));
+                if (count > 0) connection.input.append(readBuffer, static_cast<size_t>(count));
+                else if (count == 0 || (errno != EAGAIN && errno != EINTR)) closed = true;
+            }
+
+            while (!closed && connection.input.size() >= 4) {
+                uint32_t length = readBE32(connection.input, 0);
+                if (length > MAX_DAEMON_FRAME) {
+                    closed = true;
+                    break;
+                }
+                if (connection.input.size() - 4 < length) break;
+
+                DaemonRequest request;
+                std::string body;
+                bool ok = decodeDaemonRequest(connection.input.substr(4, length), request);
+                if (ok) ok = handle(request, body);
+                else body = "malformed request";
+                std::string frame;
+                encodeDaemonResponse(ok, body, frame);
+                connection.output += frame;
+                connection.input.erase(0, 4 + static_cast<size_t>(length));
+            }
+
+            if (!closed && !connection.output.empty()) {
+                ssize_t count = send(connection.fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL);
+                if (count > 0) connection.output.erase(0, static_cast<size_t>(count));
+                else if (errno != EAGAIN && errno != EINTR) closed = true;
+            }
+            if (closed) {
+                close(connection.fd);
+                connection.fd = -1;
+            }
+        }
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [](const Connection& c) { return c.fd < 0; }),
+                          connections.end());
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                Connection connection = { fd, std::string(), std::string() };
+                connections.push_back(connection);
+            }
+        }
+    }
+
+    // Flush the reply to a shutdown request before closing.
+    for (auto& connection : connections) {
+        if (!connection.output.empty()) {
+            fcntl(connection.fd, F_SETFL, fcntl(connection.fd, F_GETFL) & ~O_NONBLOCK);
+            send(connection.fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL);
+        }
+        close(connection.fd);
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+
+    size_t dirty = 0;
+    for (const auto& pair : cache) {
+        if (pair.second.dirty) dirty++;
+    }
+    if (dirty > 0) {
+        std::cerr << "discarded unsaved changes in " << dirty << " files" << std::endl;
+    }
+    return 0;
+}
+
+static bool writeAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t count = write(fd, data.data() + done, data.size() - done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        done += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+static bool readExactly(int fd, std::string& data, size_t size) {
+    data.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, &data[done], size - done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        done += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+int runDaemonClient(const std::string& socketPath, const DaemonRequest& request) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << socketPath << ": socket path too long" << std::endl;
+        return 1;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    std::string frame;
+    encodeDaemonRequest(request, frame);
+    std::string header;
+    std::string payload;
+    bool ok = false;
+    std::string body;
+    bool received = writeAll(fd, frame) && readExactly(fd, header, 4) &&
+                    readBE32(header, 0) <= MAX_DAEMON_FRAME && readExactly(fd, payload, readBE32(header, 0)) &&
+                    decodeDaemonResponse(payload, ok, body);
+    close(fd);
+    if (!received) {
+        std::cerr << socketPath << ": no valid response from daemon" << std::endl;
+        return 1;
+    }
+
+    std::ostream& out = ok ? std::cout : std::cerr;
+    out << body;
+    if (!body.empty() && body.back() != '\n') out << "\n";
+    return ok ? 0 : 1;
+}
+
+// Picks out what the stats report needs from one chunk: InhabitedTime and
+// the ids in the entity and block entity lists, in both the pre-1.18 layout
+// (under Level) and the current one. Everything else, sections and block
+// arrays included, is skipped undecoded.
+class ChunkStatsCollector : public NBTEventHandler {
+private:
+    enum class ListKind : uint8_t { NONE, ENTITIES, BLOCK_ENTITIES };
+    
+    struct Frame {
+        ListKind kind;
+        bool list;
+    };
+    
+    std::vector<Frame> frames;
+    ListKind pendingKind = ListKind::NONE;
+    RegionStats& stats;
+    
+public:
+    int64_t inhabitedTime = -1;
+    
+    explicit ChunkStatsCollector(RegionStats& target) : stats(target) {}
+    
+    bool enter(const std::string& name, TagType type) override {
+        if (frames.empty()) return type == TagType::COMPOUND;
+        const Frame& parent = frames.back();
+        if (parent.list) return type == TagType::COMPOUND;
+        if (parent.kind != ListKind::NONE) return type == TagType::STRING && name == "id";
+        
+        if (type == TagType::LONG) return name == "InhabitedTime";
+        if (type == TagType::COMPOUND) {
+            pendingKind = ListKind::NONE;
+            return frames.size() == 1 && name == "Level";
+        }
+        if (type == TagType::LIST) {
+            pendingKind = name == "Entities" ? ListKind::ENTITIES :
+                          name == "TileEntities" || name == "block_entities" ? ListKind::BLOCK_ENTITIES : ListKind::NONE;
+            return pendingKind != ListKind::NONE;
+        }
+        return false;
+    }
+    
+    void beginCompound(const std::string&) override {
+        Frame frame = { !frames.empty() && frames.back().list ? frames.back().kind : ListKind::NONE, false };
+        frames.push_back(frame);
+    }
+    
+    void beginList(const std::string&, TagType, int32_t) override {
+        Frame frame = { pendingKind, true };
+        frames.push_back(frame);
+    }
+    
+    void endCompound() override { frames.pop_back(); }
+    void endList() override { frames.pop_back(); }
+    void floating(const std::string&, TagType, double) override {}
+    void beginArray(const std::string&, TagType, int32_t) override {}
+    void arrayValues(const int64_t*, size_t) override {}
+    void endArray() override {}
+    
+    void integer(const std::string&, TagType, int64_t value) override {
+        inhabitedTime = value;
+    }
+    
+    void string(const std::string&, const std::string& value) override {
+        if (frames.back().kind == ListKind::ENTITIES) stats.entities[value]++;
+        else stats.blockEntities[value]++;
+    }
+};
+
+static void collectRegionStats(const std::string& path, IOBuffers& buffers, RegionStats& stats) {
+    stats.file = path;
+    RegionFile region(path);
+    if (!region.loadHeader()) {
+        stats.errors += path + ": " + region.getError() + "\n";
+        return;
+    }
+
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        if (!region.hasChunk(i)) continue;
+        bool external = false;
+        Compression compression;
+        std::string error;
+        if (!region.readChunk(i, buffers.raw, &external, &compression)) {
+            stats.errors += path + ": " + region.getError() + "\n";
+            continue;
+        }
+        // Type 3 chunks are stored uncompressed.
+        const std::string* data = &buffers.raw;
+        if (compression != Compression::NONE) {
+            if (!inflateData(buffers.raw.data(), buffers.raw.size(), buffers.data, error)) {
+                stats.errors += path + ": " + region.chunkLabel(i) + ": " + error + "\n";
+                continue;
+            }
+            data = &buffers.data;
+        }
+
+        ChunkStatsCollector collector(stats);
+        NBTFile chunk(path);
+        MemoryStreamBuf memory(data->data(), data->size());
+        std::istream stream(&memory);
+        if (!chunk.streamEvents(stream, collector)) {
+            stats.errors += path + ": " + region.chunkLabel(i) + ": " + chunk.getError() + "\n";
+            continue;
+        }
+
+        RegionStats::Chunk entry = { i, static_cast<uint32_t>(buffers.raw.size()), static_cast<uint32_t>(data->size()), external };
+        stats.chunks.push_back(entry);
+        if (collector.inhabitedTime >= 0) {
+            stats.inhabited.push_back(collector.inhabitedTime);
+        }
+    }
+}
+
+static std::string formatBytes(uint64_t bytes) {
+    static const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+    return text;
+}
+
+static std::string formatRatio(uint64_t raw, uint64_t compressed) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.1fx", compressed ? static_cast<double>(raw) / compressed : 0.0);
+    return text;
+}
+
+static void printCounts(const char* title, const std::map<std::string, uint64_t>& counts, size_t top) {
+    uint64_t total = 0;
+    std::vector<std::pair<uint64_t, std::string>> sorted;
+    for (const auto& pair : counts) {
+        total += pair.second;
+        sorted.push_back(std::make_pair(pair.second, pair.first));
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    std::cout << "\n" << title << " (" << total << ")\n";
+    for (size_t i = 0; i < sorted.size() && i < top; i++) {
+        std::cout << "  " << std::setw(10) << sorted[i].first << "  " << sorted[i].second << "\n";
+    }
+    if (sorted.size() > top) {
+        std::cout << "  ... " << (sorted.size() - top) << " more types\n";
+    }
+}
+
+int runStats(const std::vector<std::string>& inputs, size_t threads, size_t top) {
+    auto start = std::chrono::steady_clock::now();
+
+    // entities/ and poi/ files cover the same chunks as region/ ones, so
+    // they must not count as chunks a second time.
+    std::vector<std::string> files;
+    std::vector<char> entityFiles;
+    for (const auto& input : inputs) {
+        std::vector<std::string> found;
+        collectQueryFiles(input, found);
+        for (const auto& file : found) {
+            if (!endsWith(file, ".mca")) continue;
+            // Name of the directory holding the file.
+            size_t slash = file.find_last_of('/');
+            std::string dir;
+            if (slash != std::string::npos && slash > 0) {
+                size_t start = file.find_last_of('/', slash - 1);
+                start = start == std::string::npos ? 0 : start + 1;
+                dir = file.substr(start, slash - start);
+            }
+            if (dir == "poi") continue;
+            files.push_back(file);
+            entityFiles.push_back(dir == "entities");
+        }
+    }
+    if (files.empty()) {
+        std::cerr << "no region files found" << std::endl;
+        return 1;
+    }
+
+    std::vector<off_t> sizes(files.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat st;
+        if (stat(files[i].c_str(), &st) == 0) sizes[i] = st.st_size;
+    }
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    WorkStealingPool pool(std::min(threads, files.size()));
+    std::vector<IOBuffers> buffers(pool.size());
+    std::vector<RegionStats> results(files.size());
+    pool.run(order, [&](size_t task, size_t worker) {
+        collectRegionStats(files[task], buffers[worker], results[task]);
+    });
+
+    // Compressed chunk size buckets (powers of two from 4 KiB) and
+    // InhabitedTime buckets in ticks.
+    static const char* sizeLabels[] = { "< 4 KiB", "< 8 KiB", "< 16 KiB", "< 32 KiB", "< 64 KiB", "< 128 KiB",
+                                        "< 256 KiB", "< 512 KiB", "< 1 MiB", ">= 1 MiB" };
+    static const int64_t inhabitedLimits[] = { 1, 20 * 60, 20 * 600, 20 * 3600, 20 * 36000, 20 * 360000 };
+    static const char* inhabitedLabels[] = { "never", "< 1 min", "< 10 min", "< 1 h", "< 10 h", "< 100 h", ">= 100 h" };
+    uint64_t sizeHistogram[10] = {};
+    uint64_t inhabitedHistogram[7] = {};
+
+    struct Largest {
+        uint32_t compressed;
+        uint32_t raw;
+        bool external;
+        size_t file;
+        int index;
+    };
+    std::vector<Largest> largest;
+    std::map<std::string, uint64_t> entities;
+    std::map<std::string, uint64_t> blockEntities;
+    uint64_t chunkCount = 0;
+    uint64_t compressedTotal = 0;
+    uint64_t rawTotal = 0;
+    uint64_t externalCount = 0;
+    size_t regionCount = 0;
+    bool failed = false;
+
+    std::cout << "Regions\n";
+    for (size_t f = 0; f < results.size(); f++) {
+        const RegionStats& stats = results[f];
+        std::cerr << stats.errors;
+        failed = failed || !stats.errors.empty();
+        for (const auto& pair : stats.entities) entities[pair.first] += pair.second;
+        if (entityFiles[f]) continue;
+        regionCount++;
+
+        uint64_t compressed = 0;
+        uint64_t raw = 0;
+        const RegionStats::Chunk* biggest = nullptr;
+        for (const auto& chunk : stats.chunks) {
+            compressed += chunk.compressed;
+            raw += chunk.raw;
+            if (!biggest || chunk.compressed > biggest->compressed) biggest = &chunk;
+
+            size_t bucket = 0;
+            while (bucket < 9 && chunk.compressed >= (4096u << bucket)) bucket++;
+            sizeHistogram[bucket]++;
+            if (chunk.external) externalCount++;
+            Largest entry = { chunk.compressed, chunk.raw, chunk.external, f, chunk.index };
+            largest.push_back(entry);
+        }
+        for (int64_t ticks : stats.inhabited) {
+            size_t bucket = 0;
+            while (bucket < 6 && ticks >= inhabitedLimits[bucket]) bucket++;
+            inhabitedHistogram[bucket]++;
+        }
+        for (const auto& pair : stats.blockEntities) blockEntities[pair.first] += pair.second;
+        chunkCount += stats.chunks.size();
+        compressedTotal += compressed;
+        rawTotal += raw;
+
+        // Keep only the overall top entries as we go.
+        if (largest.size() > top * 4) {
+            std::nth_element(largest.begin(), largest.begin() + top, largest.end(),
+                             [](const Largest& a, const Largest& b) { return a.compressed > b.compressed; });
+            largest.resize(top);
+        }
+
+        std::cout << "  " << stats.file << "  " << stats.chunks.size() << " chunks  " << formatBytes(compressed)
+                  << " -> " << formatBytes(raw) << " (" << formatRatio(raw, compressed) << ")";
+        if (biggest) {
+            std::cout << "  largest " << formatBytes(biggest->compressed) << " ("
+                      << RegionFile(stats.file).chunkLabel(biggest->index) << ")";
+        }
+        std::cout << "\n";
+    }
+
+    std::cout << "\nTotal: " << regionCount << " region files, " << chunkCount << " chunks, "
+              << formatBytes(compressedTotal) << " compressed, " << formatBytes(rawTotal) << " raw ("
+              << formatRatio(rawTotal, compressedTotal) << "), " << externalCount << " external (.mcc) chunks";
+    if (regionCount < files.size()) std::cout << ", " << (files.size() - regionCount) << " entity files";
+    std::cout << "\n";
+
+    std::cout << "\nCompressed chunk sizes\n";
+    for (size_t i = 0; i < 10; i++) {
+        std::cout << "  " << std::left << std::setw(10) << sizeLabels[i] << std::right << std::setw(11)
+                  << sizeHistogram[i] << "\n";
+    }
+    std::cout << "\nInhabitedTime\n";
+    for (size_t i = 0; i < 7; i++) {
+        std::cout << "  " << std::left << std::setw(10) << inhabitedLabels[i] << std::right << std::setw(11)
+                  << inhabitedHistogram[i] << "\n";
+    }
+
+    std::sort(largest.begin(), largest.end(), [](const Largest& a, const Largest& b) { return a.compressed > b.compressed; });
+    if (largest.size() > top) largest.resize(top);
+    std::cout << "\nLargest chunks\n";
+    for (const auto& entry : largest) {
+        std::cout << "  " << std::setw(10) << formatBytes(entry.compressed) << "  " << std::setw(10)
+                  << formatBytes(entry.raw) << " raw  " << results[entry.file].file << " "
+                  << RegionFile(results[entry.file].file).chunkLabel(entry.index)
+                  << (entry.external ? " (external)" : "") << "\n";
+    }
+
+    printCounts("Entities", entities, top);
+    printCounts("Block entities", blockEntities, top);
+    std::cout.flush();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << chunkCount << " chunks in " << seconds << "s on " << pool.size() << " threads" << std::endl;
+    return failed ? 1 : 0;
+}
+
+// Collects the (value, path) pairs of one document for WorldIndex. Numbers
+// and arrays are skipped unparsed, and long strings such as book pages are
+// left out to keep the index small.
+class IndexCollector : public NBTEventHandler {
+private:
+    std::vector<size_t> marks;
+    std::vector<bool> inList;
+    std::string path;
+    std::vector<std::pair<std::string, std::string>>& out;
+    
+    void child(const std::string& name) {
+        if (inList.empty()) return;
+        if (inList.back()) path += "[]";
+        else appendPathKey(path, name);
+    }
+    
+    void open(const std::string& name, bool list) {
+        marks.push_back(path.size());
+        child(name);
+        inList.push_back(list);
+    }
+    
+    void close() {
+        path.resize(marks.back());
+        marks.pop_back();
+        inList.pop_back();
+    }
+    
+public:
+    static const size_t MAX_VALUE_LENGTH = 256;
+    
+    explicit IndexCollector(std::vector<std::pair<std::string, std::string>>& pairs) : out(pairs) {}
+    
+    bool enter(const std::string& name, TagType type) override {
+        (void)name;
+        return type == TagType::COMPOUND || type == TagType::LIST || type == TagType::STRING;
+    }
+    
+    void beginCompound(const std::string& name) override { open(name, false); }
+    void endCompound() override { close(); }
+    void beginList(const std::string& name, TagType, int32_t) override { open(name, true); }
+    void endList() override { close(); }
+    void integer(const std::string&, TagType, int64_t) override {}
+    void floating(const std::string&, TagType, double) override {}
+    void beginArray(const std::string&, TagType, int32_t) override {}
+    void arrayValues(const int64_t*, size_t) override {}
+    void endArray() override {}
+    
+    void string(const std::string& name, const std::string& value) override {
+        if (value.size() > MAX_VALUE_LENGTH) return;
+        size_t mark = path.size();
+        child(name);
+        out.push_back(std::make_pair(value, path));
+        path.resize(mark);
+    }
+};
+
+WorldIndex::WorldIndex(const std::string& dir, const std::string& file) : worldDir(dir) {
+    while (worldDir.size() > 1 && worldDir.back() == '/') worldDir.pop_back();
+    indexPath = file.empty() ? worldDir + "/nbtedit-index.dat" : file;
+}
+
+std::string WorldIndex::documentLabel(const Document& doc) const {
+    std::string path = worldDir + "/" + files[doc.file].path;
+    if (doc.chunk < 0) return path;
+    return path + " " + RegionFile(path).chunkLabel(doc.chunk);
+}
+
+bool WorldIndex::load() {
+    files.clear();
+    documents.clear();
+    paths.clear();
+    terms.clear();
+
+    NBTFile file(indexPath);
+    if (!file.load()) {
+        lastError = file.getError();
+        return false;
+    }
+
+    auto& root = file.getRoot()->value.compoundVal;
+    auto child = [&](const char* key, TagType type) -> NBTTag* {
+        auto it = root.find(key);
+        return it != root.end() && it->second->type == type ? it->second.get() : nullptr;
+    };
+    NBTTag* version = child("Version", TagType::INT);
+    NBTTag* fileList = child("Files", TagType::LIST);
+    NBTTag* docArray = child("Documents", TagType::INT_ARRAY);
+    NBTTag* pathList = child("Paths", TagType::LIST);
+    NBTTag* termMap = child("Terms", TagType::COMPOUND);
+    if (!version || version->value.intVal != 1 || !fileList || !docArray || !pathList || !termMap) {
+        lastError = "not a version 1 index";
+        return false;
+    }
+
+    for (const auto& item : fileList->value.listVal) {
+        auto& entry = item->value.compoundVal;
+        auto path = entry.find("Path");
+        auto mtime = entry.find("MTime");
+        auto size = entry.find("Size");
+        if (path == entry.end() || mtime == entry.end() || size == entry.end()) {
+            lastError = "bad file entry in index";
+            return false;
+        }
+        FileEntry fileEntry = { path->second->value.stringVal, mtime->second->value.longVal, size->second->value.longVal };
+        files.push_back(fileEntry);
+    }
+
+    const auto& docs = docArray->value.intArrayVal;
+    if (docs.size() % 3 != 0) {
+        lastError = "bad document table in index";
+        return false;
+    }
+    for (size_t i = 0; i < docs.size(); i += 3) {
+        if (docs[i] < 0 || static_cast<size_t>(docs[i]) >= files.size()) {
+            lastError = "bad document table in index";
+            return false;
+        }
+        Document doc = { static_cast<uint32_t>(docs[i]), docs[i + 1], static_cast<uint32_t>(docs[i + 2]) };
+        documents.push_back(doc);
+    }
+
+    for (const auto& item : pathList->value.listVal) {
+        paths.push_back(item->value.stringVal);
+    }
+
+    for (const auto& pair : termMap->value.compoundVal) {
+        const auto& postings = pair.second->value.intArrayVal;
+        if (postings.size() % 2 != 0) {
+            lastError = "bad postings for '" + pair.first + "'";
+            return false;
+        }
+        for (size_t i = 0; i < postings.size(); i += 2) {
+            if (postings[i] < 0 || static_cast<size_t>(postings[i]) >= documents.size() ||
+                postings[i + 1] < 0 || static_cast<size_t>(postings[i + 1]) >= paths.size()) {
+                lastError = "bad postings for '" + pair.first + "'";
+                return false;
+            }
+        }
+        terms[pair.first] = postings;
+    }
+    return true;
+}
+
+bool WorldIndex::save() {
+    auto root = std::make_shared<NBTTag>(TagType::COMPOUND, "");
+    auto& entries = root->value.compoundVal;
+
+    auto version = std::make_shared<NBTTag>(TagType::INT, "Version");
+    version->value.intVal = 1;
+    entries["Version"] = version;
+
+    auto fileList = std::make_shared<NBTTag>(TagType::LIST, "Files");
+    fileList->value.listType = TagType::COMPOUND;
+    for (const auto& entry : files) {
+        auto item = std::make_shared<NBTTag>(TagType::COMPOUND, "");
+        auto path = std::make_shared<NBTTag>(TagType::STRING, "Path");
+        path->value.stringVal = entry.path;
+        auto mtime = std::make_shared<NBTTag>(TagType::LONG, "MTime");
+        mtime->value.longVal = entry.mtime;
+        auto size = std::make_shared<NBTTag>(TagType::LONG, "Size");
+        size->value.longVal = entry.size;
+        item->value.compoundVal["Path"] = path;
+        item->value.compoundVal["MTime"] = mtime;
+        item->value.compoundVal["Size"] = size;
+        fileList->value.listVal.push_back(item);
+    }
+    entries["Files"] = fileList;
+
+    auto docArray = std::make_shared<NBTTag>(TagType::INT_ARRAY, "Documents");
+    docArray->value.intArrayVal.reserve(documents.size() * 3);
+    for (const auto& doc : documents) {
+        docArray->value.intArrayVal.push_back(static_cast<int32_t>(doc.file));
+        docArray->value.intArrayVal.push_back(doc.chunk);
+        docArray->value.intArrayVal.push_back(static_cast<int32_t>(doc.timestamp));
+    }
+    entries["Documents"] = docArray;
+
+    auto pathList = std::make_shared<NBTTag>(TagType::LIST, "Paths");
+    pathList->value.listType = TagType::STRING;
+    for (const auto& path : paths) {
+        auto item = std::make_shared<NBTTag>(TagType::STRING, "");
+        item->value.stringVal = path;
+        pathList->value.listVal.push_back(item);
+    }
+    entries["Paths"] = pathList;
+
+    auto termMap = std::make_shared<NBTTag>(TagType::COMPOUND, "Terms");
+    for (auto& pair : terms) {
+        auto postings = std::make_shared<NBTTag>(TagType::INT_ARRAY, pair.first);
+        postings->value.intArrayVal.swap(pair.second);
+        termMap->value.compoundVal[pair.first] = postings;
+    }
+    entries["Terms"] = termMap;
+
+    NBTFile file(indexPath);
+    file.setRoot(root);
+    if (!file.save()) {
+        lastError = file.getError();
+        return false;
+    }
+    return true;
+}
+
+int WorldIndex::build(size_t threads, bool full) {
+    auto start = std::chrono::steady_clock::now();
+
+    WorldIndex previous(worldDir, indexPath);
+    struct stat indexStat;
+    bool incremental = !full && stat(indexPath.c_str(), &indexStat) == 0;
+    if (incremental && !previous.load()) {
+        std::cerr << indexPath << ": " << previous.getError() << ", rebuilding" << std::endl;
+        incremental = false;
+        previous = WorldIndex(worldDir, indexPath);
+    }
+
+    std::vector<std::string> found = findWorldFiles(worldDir);
+    if (found.empty()) {
+        std::cerr << worldDir << ": no playerdata, region, entities or poi files found" << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<std::string, size_t> oldFiles;
+    std::vector<std::map<int32_t, uint32_t>> oldDocs(previous.files.size());
+    for (size_t i = 0; i < previous.files.size(); i++) {
+        oldFiles[previous.files[i].path] = i;
+    }
+    for (size_t i = 0; i < previous.documents.size(); i++) {
+        oldDocs[previous.documents[i].file][previous.documents[i].chunk] = static_cast<uint32_t>(i);
+    }
+
+    // Per file: the documents it holds now, and for each either the old
+    // document it is unchanged from or the pairs collected by rescanning it.
+    struct FileScan {
+        FileEntry entry;
+        long oldFile = -1;
+        bool unchanged = false;
+        std::vector<Document> docs;
+        std::vector<long> kept;
+        std::vector<std::vector<std::pair<std::string, std::string>>> pairs;
+        std::string errors;
+    };
+
+    std::vector<FileScan> scans(found.size());
+    std::vector<size_t> order;
+    for (size_t i = 0; i < found.size(); i++) {
+        FileScan& scan = scans[i];
+        scan.entry.path = found[i].substr(worldDir.size() + 1);
+        struct stat st;
+        scan.entry.mtime = 0;
+        scan.entry.size = 0;
+        if (stat(found[i].c_str(), &st) == 0) {
+            scan.entry.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            scan.entry.size = st.st_size;
+        }
+        auto it = oldFiles.find(scan.entry.path);
+        if (it != oldFiles.end()) {
+            scan.oldFile = static_cast<long>(it->second);
+            const FileEntry& old = previous.files[it->second];
+            scan.unchanged = old.mtime == scan.entry.mtime && old.size == scan.entry.size;
+        }
+        if (!scan.unchanged) order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return scans[a].entry.size > scans[b].entry.size; });
+
+    WorkStealingPool pool(std::max<size_t>(1, std::min(threads, order.size())));
+    std::vector<std::string> payloads(pool.size());
+    pool.run(order, [&](size_t task, size_t worker) {
+        FileScan& scan = scans[task];
+        const std::string& path = found[task];
+
+        // A file that failed to scan gets mtime 0, so the next build retries it.
+        if (!endsWith(path, ".mca")) {
+            scan.docs.push_back(Document{0, -1, 0});
+            scan.kept.push_back(-1);
+            scan.pairs.resize(1);
+            IndexCollector collector(scan.pairs[0]);
+            NBTFile nbtFile(path);
+            if (!nbtFile.streamFile(collector)) {
+                scan.errors += path + ": " + nbtFile.getError() + "\n";
+                scan.entry.mtime = 0;
+            }
+            return;
+        }
+
+        RegionFile region(path);
+        if (!region.loadHeader()) {
+            scan.errors += path + ": " + region.getError() + "\n";
+            scan.entry.mtime = 0;
+            return;
+        }
+        std::string& payload = payloads[worker];
+        for (int i = 0; i < REGION_CHUNKS; i++) {
+            if (!region.hasChunk(i)) continue;
+            Document doc = { 0, i, region.getTimestamp(i) };
+            if (scan.oldFile >= 0) {
+                auto old = oldDocs[scan.oldFile].find(i);
+                if (old != oldDocs[scan.oldFile].end() && previous.documents[old->second].timestamp == doc.timestamp) {
+                    scan.docs.push_back(doc);
+                    scan.kept.push_back(static_cast<long>(old->second));
+                    scan.pairs.emplace_back();
+                    continue;
+                }
+            }
+
+            std::vector<std::pair<std::string, std::string>> pairs;
+            IndexCollector collector(pairs);
+            NBTFile chunk(path);
+            bool ok = region.readChunk(i, payload);
+            std::string error = region.getError();
+            if (ok) {
+                try {
+                    MemoryStreamBuf memory(payload.data(), payload.size());
+                    std::istream compressed(&memory);
+                    InflateStreamBuf inflater(compressed);
+                    std::istream stream(&inflater);
+                    ok = chunk.streamEvents(stream, collector);
+                    error = region.chunkLabel(i) + ": " + chunk.getError();
+                } catch (const std::exception& e) {
+                    ok = false;
+                    error = region.chunkLabel(i) + ": " + e.what();
+                }
+            }
+            if (!ok) {
+                scan.errors += path + ": " + error + "\n";
+                scan.entry.mtime = 0;
+                continue;
+            }
+            scan.docs.push_back(doc);
+            scan.kept.push_back(-1);
+            scan.pairs.push_back(std::move(pairs));
+        }
+    });
+
+    files.clear();
+    documents.clear();
+    paths.clear();
+    terms.clear();
+
+    std::unordered_map<std::string, int32_t> pathIds;
+    auto internPath = [&](const std::string& path) {
+        auto it = pathIds.find(path);
+        if (it != pathIds.end()) return it->second;
+        int32_t id = static_cast<int32_t>(paths.size());
+        paths.push_back(path);
+        pathIds[path] = id;
+        return id;
+    };
+
+    std::vector<int32_t> remap(previous.documents.size(), -1);
+    size_t rescannedFiles = order.size();
+    size_t scannedDocs = 0;
+    bool failed = false;
+    for (auto& scan : scans) {
+        std::cerr << scan.errors;
+        failed = failed || !scan.errors.empty();
+        uint32_t fileId = static_cast<uint32_t>(files.size());
+        files.push_back(scan.entry);
+
+        if (scan.unchanged) {
+            for (const auto& pair : oldDocs[scan.oldFile]) {
+                remap[pair.second] = static_cast<int32_t>(documents.size());
+                Document doc = previous.documents[pair.second];
+                doc.file = fileId;
+                documents.push_back(doc);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < scan.docs.size(); i++) {
+            int32_t docId = static_cast<int32_t>(documents.size());
+            Document doc = scan.docs[i];
+            doc.file = fileId;
+            documents.push_back(doc);
+            if (scan.kept[i] >= 0) {
+                remap[scan.kept[i]] = docId;
+                continue;
+            }
+
+            scannedDocs++;
+            auto& pairs = scan.pairs[i];
+            std::sort(pairs.begin(), pairs.end());
+            pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+            for (const auto& pair : pairs) {
+                auto& postings = terms[pair.first];
+                postings.push_back(docId);
+                postings.push_back(internPath(pair.second));
+            }
+        }
+        scan.pairs.clear();
+    }
+
+    // Carry over the postings of documents that were not rescanned.
+    std::vector<int32_t> pathRemap(previous.paths.size(), -1);
+    for (const auto& term : previous.terms) {
+        const auto& postings = term.second;
+        std::vector<int32_t>* target = nullptr;
+        for (size_t i = 0; i < postings.size(); i += 2) {
+            int32_t doc = remap[postings[i]];
+            if (doc < 0) continue;
+            int32_t& path = pathRemap[postings[i + 1]];
+            if (path < 0) path = internPath(previous.paths[postings[i + 1]]);
+            if (!target) target = &terms[term.first];
+            target->push_back(doc);
+            target->push_back(path);
+        }
+    }
+
+    std::vector<std::pair<int32_t, int32_t>> sorted;
+    for (auto& term : terms) {
+        auto& postings = term.second;
+        sorted.clear();
+        for (size_t i = 0; i < postings.size(); i += 2) {
+            sorted.push_back(std::make_pair(postings[i], postings[i + 1]));
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for (size_t i = 0; i < sorted.size(); i++) {
+            postings[i * 2] = sorted[i].first;
+            postings[i * 2 + 1] = sorted[i].second;
+        }
+    }
+
+    size_t termCount = terms.size();
+    if (!save()) {
+        std::cerr << indexPath << ": " << lastError << std::endl;
+        return 1;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << files.size() << " files (" << rescannedFiles << " read), " << documents.size() << " documents ("
+              << scannedDocs << " scanned), " << termCount << " values, " << paths.size() << " paths in "
+              << seconds << "s on " << pool.size() << " threads" << std::endl;
+    return failed ? 1 : 0;
+}
+
+int WorldIndex::query(const std::string& value, const std::string& pathFilter) {
+    if (!load()) {
+        std::cerr << indexPath << ": " << lastError << std::endl;
+        return 1;
+    }
+
+    size_t count = 0;
+    auto it = terms.find(value);
+    if (it != terms.end()) {
+        const auto& postings = it->second;
+        for (size_t i = 0; i < postings.size(); i += 2) {
+            const std::string& path = paths[postings[i + 1]];
+            if (!pathFilter.empty() && path != pathFilter) continue;
+            std::cout << documentLabel(documents[postings[i]]) << ": " << (path.empty() ? "." : path) << "\n";
+            count++;
+        }
+    }
+    std::cout.flush();
+    std::cerr << count << " matches" << std::endl;
+    return 0;
+}
+
+static void appendBE16(std::string& out, uint16_t value) {
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+static void appendBE64(std::string& out, uint64_t value) {
+    appendBE32(out, static_cast<uint32_t>(value >> 32));
+    appendBE32(out, static_cast<uint32_t>(value));
+}
+
+// Binary NBT encoding shared by the event handlers that write NBT.
+static void appendNBTInteger(std::string& out, TagType type, int64_t value) {
+    switch (type) {
+        case TagType::BYTE: out += static_cast<char>(value); break;
+        case TagType::SHORT: appendBE16(out, static_cast<uint16_t>(value)); break;
+        case TagType::INT: appendBE32(out, static_cast<uint32_t>(value)); break;
+        default: appendBE64(out, static_cast<uint64_t>(value)); break;
+    }
+}
+
+static void appendNBTFloating(std::string& out, TagType type, double value) {
+    if (type == TagType::FLOAT) {
+        float narrow = static_cast<float>(value);
+        uint32_t bits;
+        std::memcpy(&bits, &narrow, sizeof(bits));
+        appendBE32(out, bits);
+    } else {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        appendBE64(out, bits);
+    }
+}
+
+static void appendNBTString(std::string& out, const std::string& value) {
+    appendBE16(out, static_cast<uint16_t>(value.size()));
+    out += value;
+}
+
+// Type and name of a compound entry or of the root tag.
+static void appendNBTHeader(std::string& out, TagType type, const std::string& name) {
+    out += static_cast<char>(type);
+    appendNBTString(out, name);
+}
+
+// Elements of an array of type, as delivered by NBTEventHandler::arrayValues.
+static void appendNBTArrayValues(std::string& out, TagType type, const int64_t* values, size_t count) {
+    TagType element = type == TagType::BYTE_ARRAY ? TagType::BYTE :
+                      type == TagType::INT_ARRAY ? TagType::INT : TagType::LONG;
+    for (size_t i = 0; i < count; i++) {
+        appendNBTInteger(out, element, values[i]);
+    }
+}
+
+// Writes the type and name of a compound entry; list elements have neither.
+size_t NBTOptimizer::header(const std::string& name, TagType type) {
+    size_t start = out.size();
+    if (frames.empty() || !frames.back().list) appendNBTHeader(out, type, name);
+    return start;
+}
+
+// Cuts a finished tag back out of the output, or counts it as a child.
+void NBTOptimizer::finish(size_t start, bool drop) {
+    if (drop) {
+        out.resize(start);
+        removed++;
+    } else if (!frames.empty()) {
+        frames.back().children++;
+    }
+}
+
+bool NBTOptimizer::isDefault(const std::string& name, TagType type, int64_t integer, double floating,
+                             const std::string* string) const {
+    auto range = options.defaults.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it) {
+        const NBTTag& tag = *it->second;
+        if (tag.type != type) continue;
+        switch (type) {
+            case TagType::BYTE: if (tag.value.byteVal == integer) return true; break;
+            case TagType::SHORT: if (tag.value.shortVal == integer) return true; break;
+            case TagType::INT: if (tag.value.intVal == integer) return true; break;
+            case TagType::LONG: if (tag.value.longVal == integer) return true; break;
+            case TagType::FLOAT: if (tag.value.floatVal == static_cast<float>(floating)) return true; break;
+            case TagType::DOUBLE: if (tag.value.doubleVal == floating) return true; break;
+            case TagType::STRING: if (string && tag.value.stringVal == *string) return true; break;
+            default: break;
+        }
+    }
+    return false;
+}
+
+// Entries of a plugin data compound are keyed "plugin:key"; those of
+// plugins that are not installed are skipped without being decoded.
+bool NBTOptimizer::enter(const std::string& name, TagType type) {
+    (void)type;
+    if (!options.keepPlugins && !frames.empty() && frames.back().plugins) {
+        std::string plugin = name.substr(0, name.find(':'));
+        if (std::find(options.plugins.begin(), options.plugins.end(), plugin) == options.plugins.end()) {
+            removed++;
+            return false;
+        }
+    }
+    return true;
+}
+
+void NBTOptimizer::open(const std::string& name, TagType type, bool list) {
+    bool entry = !frames.empty() && !frames.back().list;
+    bool meaningful = entry && (frames.back().components || (!name.empty() && name[0] == '!'));
+    Frame frame = { list, entry && (name == "BukkitValues" || name == "PublicBukkitValues"), header(name, type),
+                    0, 0, false, false, entry && !list && name == "components", meaningful };
+    frames.push_back(frame);
+}
+
+void NBTOptimizer::beginList(const std::string& name, TagType elementType, int32_t length) {
+    (void)length;
+    open(name, TagType::LIST, true);
+    out += static_cast<char>(elementType);
+    frames.back().lengthOffset = out.size();
+    appendBE32(out, 0);
+}
+
+void NBTOptimizer::close() {
+    Frame frame = frames.back();
+    frames.pop_back();
+    bool element = !frames.empty() && frames.back().list;
+    bool drop;
+    if (frame.list) {
+        writeBE32(out, frame.lengthOffset, static_cast<uint32_t>(frame.children));
+        drop = options.pruneEmpty && frame.children == 0 && !frames.empty() && !element && !frame.meaningful;
+    } else {
+        out += static_cast<char>(TagType::END);
+        drop = !frames.empty() && (element ? frame.slot && frame.emptyItem :
+                                   options.pruneEmpty && frame.children == 0 && !frame.meaningful);
+    }
+    finish(frame.start, drop);
+}
+
+void NBTOptimizer::integer(const std::string& name, TagType type, int64_t value) {
+    size_t start = header(name, type);
+    appendNBTInteger(out, type, value);
+    bool entry = !frames.empty() && !frames.back().list;
+    if (entry && name == "Slot") frames.back().slot = true;
+    if (entry && (name == "Count" || name == "count") && value <= 0) frames.back().emptyItem = true;
+    finish(start, entry && isDefault(name, type, value, 0, nullptr));
+}
+
+void NBTOptimizer::floating(const std::string& name, TagType type, double value) {
+    size_t start = header(name, type);
+    appendNBTFloating(out, type, value);
+    bool entry = !frames.empty() && !frames.back().list;
+    finish(start, entry && isDefault(name, type, 0, value, nullptr));
+}
+
+void NBTOptimizer::string(const std::string& name, const std::string& value) {
+    size_t start = header(name, TagType::STRING);
+    appendNBTString(out, value);
+    bool entry = !frames.empty() && !frames.back().list;
+    if (entry && name == "id" && value == "minecraft:air") frames.back().emptyItem = true;
+    finish(start, entry && isDefault(name, TagType::STRING, 0, 0, &value));
+}
+
+void NBTOptimizer::beginArray(const std::string& name, TagType type, int32_t length) {
+    header(name, type);
+    appendBE32(out, static_cast<uint32_t>(length));
+    arrayType = type;
+}
+
+void NBTOptimizer::arrayValues(const int64_t* values, size_t count) {
+    appendNBTArrayValues(out, arrayType, values, count);
+}
+
+void NBTOptimizer::endArray() {
+    finish(0, false);
+}
+
+bool addOptimizeDefault(OptimizeOptions& options, const std::string& key, const std::string& value, std::string& error) {
+    std::shared_ptr<NBTTag> tag;
+    if (!parseSNBT(value, tag, error)) return false;
+    if (tag->type == TagType::COMPOUND || tag->type == TagType::LIST || tag->type == TagType::BYTE_ARRAY ||
+        tag->type == TagType::INT_ARRAY || tag->type == TagType::LONG_ARRAY) {
+        error = "default for " + key + " must be a number or string";
+        return false;
+    }
+    options.defaults.insert(std::make_pair(key, tag));
+    return true;
+}
+
+// One "key value" pair per line; blank lines and lines starting with '#'
+// are ignored.
+bool loadOptimizeDefaults(OptimizeOptions& options, const std::string& path, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "cannot read " + path;
+        return false;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+        size_t split = line.find_first_of(" \t", first);
+        size_t value = split == std::string::npos ? split : line.find_first_not_of(" \t", split);
+        size_t last = line.find_last_not_of(" \t\r");
+        if (value == std::string::npos ||
+            !addOptimizeDefault(options, line.substr(first, split - first), line.substr(value, last + 1 - value), error)) {
+            error = path + ":" + std::to_string(lineNumber) + ": " + (value == std::string::npos ? "expected key and value" : error);
+            return false;
+        }
+    }
+    return true;
+}
+
+struct OptimizeResult {
+    uint64_t before = 0;
+    uint64_t after = 0;
+    size_t documents = 0;
+    size_t removed = 0;
+    std::string error;
+};
+
+static bool optimizeDocument(NBTFile& doc, std::istream& in, const OptimizeOptions& options, IOBuffers& buffers,
+                             Compression compression, std::string& output, OptimizeResult& result) {
+    buffers.data.clear();
+    NBTOptimizer optimizer(buffers.data, options);
+    if (!doc.streamEvents(in, optimizer)) {
+        result.error = doc.getError();
+        return false;
+    }
+    result.documents++;
+    result.removed += optimizer.removed;
+    return deflateData(buffers.data, compression, output, result.error, options.level);
+}
+
+// On-disk size of a region chunk: its sectors, or one sector plus the .mcc
+// file for an external chunk.
+static uint64_t regionChunkBytes(size_t payload) {
+    size_t sectors = (payload + 5 + REGION_SECTOR - 1) / REGION_SECTOR;
+    return sectors > 255 ? REGION_SECTOR + payload : sectors * REGION_SECTOR;
+}
+
+static void optimizeFile(const std::string& path, const OptimizeOptions& options, IOBuffers& buffers,
+                         OptimizeResult& result) {
+    if (!endsWith(path, ".mca")) {
+        int64_t mtime, size;
+        NBTFile doc(path);
+        std::ifstream file(path, std::ios::binary);
+        if (!file || !statFile(path, mtime, size)) {
+            result.error = "cannot read " + path;
+            return;
+        }
+        result.before = static_cast<uint64_t>(size);
+        char magic[2] = {0, 0};
+        file.read(magic, sizeof(magic));
+        Compression compression = options.recompress ? options.compression :
+                                  detectCompression(std::string(magic, static_cast<size_t>(file.gcount())));
+        file.clear();
+        file.seekg(0);
+        try {
+            InflateStreamBuf inflater(file);
+            std::istream stream(&inflater);
+            if (!optimizeDocument(doc, stream, options, buffers, compression, buffers.raw, result)) return;
+        } catch (const std::exception& e) {
+            result.error = e.what();
+            return;
+        }
+        result.after = buffers.raw.size();
+        if (!options.dryRun) {
+            writeFileAtomic(path, buffers.raw.data(), buffers.raw.size(), keepOldFiles(), result.error);
+        }
+        return;
+    }
+
+    RegionFile input(path);
+    if (!input.loadHeader()) {
+        result.error = input.getError();
+        return;
+    }
+    RegionFile output(path);
+    result.before = result.after = 2 * REGION_SECTOR;
+    std::string payload;
+    std::string encoded;
+    for (int i = 0; i < REGION_CHUNKS; i++) {
+        bool external = false;
+        if (!input.hasChunk(i)) continue;
+        if (!input.readChunk(i, payload, &external)) {
+            result.error = input.getError();
+            return;
+        }
+        result.before += regionChunkBytes(payload.size());
+        Compression compression = options.recompress ? options.compression : detectCompression(payload);
+        NBTFile doc(path);
+        try {
+            MemoryStreamBuf memory(payload.data(), payload.size());
+            std::istream compressed(&memory);
+            InflateStreamBuf inflater(compressed);
+            std::istream stream(&inflater);
+            if (!optimizeDocument(doc, stream, options, buffers, compression, encoded, result)) {
+                result.error = input.chunkLabel(i) + ": " + result.error;
+                return;
+            }
+        } catch (const std::exception& e) {
+            result.error = input.chunkLabel(i) + ": " + e.what();
+            return;
+        }
+        result.after += regionChunkBytes(encoded.size());
+        uint8_t type = compression == Compression::GZIP ? 1 : compression == Compression::ZLIB ? 2 : 3;
+        output.addEncodedChunk(i, input.getTimestamp(i), external, encoded, type);
+    }
+    if (!options.dryRun && !output.save(buffers)) {
+        result.error = output.getError();
+    }
+}
+
+int runOptimize(const std::vector<std::string>& inputs, const OptimizeOptions& options, size_t threads) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> files;
+    for (const auto& input : inputs) {
+        collectQueryFiles(input, files);
+    }
+    if (files.empty()) {
+        std::cerr << "no files found" << std::endl;
+        return 1;
+    }
+
+    std::vector<off_t> sizes(files.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat st;
+        if (stat(files[i].c_str(), &st) == 0) sizes[i] = st.st_size;
+    }
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    WorkStealingPool pool(std::min(threads, files.size()));
+    std::vector<IOBuffers> buffers(pool.size());
+    std::vector<OptimizeResult> results(files.size());
+    pool.run(order, [&](size_t task, size_t worker) {
+        optimizeFile(files[task], options, buffers[worker], results[task]);
+    });
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    OptimizeResult total;
+    size_t failed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        const OptimizeResult& result = results[i];
+        if (!result.error.empty()) {
+            std::cerr << files[i] << ": " << result.error << std::endl;
+            failed++;
+            continue;
+        }
+        std::cout << files[i] << ": " << formatBytes(result.before) << " -> " << formatBytes(result.after) << ", "
+                  << result.removed << " tags removed\n";
+        total.before += result.before;
+        total.after += result.after;
+        total.documents += result.documents;
+        total.removed += result.removed;
+    }
+    std::cout.flush();
+    std::cerr << files.size() << " files, " << total.documents << " documents, " << total.removed << " tags removed, "
+              << formatBytes(total.before) << " -> " << formatBytes(total.after)
+              << (options.dryRun ? " (dry run, nothing saved)" : "") << ", " << failed << " failed files in "
+              << seconds << "s on " << pool.size() << " threads" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
+// Keeps benchmarked results observable so the loops are not optimized away.
+static volatile uint64_t benchmarkSink = 0;
+
+struct BenchmarkCase {
+    std::string name;
+    // Work done by one call of run, for the per-op and throughput figures.
+    uint64_t ops;
+    uint64_t bytes;
+    std::function<void()> run;
+};
+
+struct BenchmarkSummary {
+    double median;
+    double min;
+    double mean;
+    double stddev;
+};
+
+static BenchmarkSummary summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    BenchmarkSummary summary = { samples[samples.size() / 2], samples.front(), 0, 0 };
+    for (double sample : samples) summary.mean += sample;
+    summary.mean /= samples.size();
+    for (double sample : samples) summary.stddev += (sample - summary.mean) * (sample - summary.mean);
+    summary.stddev = std::sqrt(summary.stddev / samples.size());
+    return summary;
+}
+
+// Runs each case until a sample takes at least 5ms, discards the warmup
+// samples and reports ns/op and GB/s of the median sample.
+static void runBenchmarkCases(const std::vector<BenchmarkCase>& cases, const BenchmarkOptions& options) {
+    if (!options.json) {
+        std::cout << std::left << std::setw(24) << "benchmark" << std::right << std::setw(11) << "ns/op"
+                  << std::setw(11) << "min" << std::setw(9) << "stddev" << std::setw(10) << "GB/s" << std::endl;
+    }
+    for (const auto& test : cases) {
+        if (!options.filter.empty() && test.name.find(options.filter) == std::string::npos) continue;
+        
+        size_t repeat = 1;
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < repeat; i++) test.run();
+            if (std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(5) || repeat >= (1u << 20)) break;
+            repeat *= 2;
+        }
+        
+        std::vector<double> samples;
+        for (size_t sample = 0; sample < options.warmup + options.samples; sample++) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < repeat; i++) test.run();
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (sample >= options.warmup) samples.push_back(ns / (repeat * test.ops));
+        }
+        BenchmarkSummary summary = summarize(samples);
+        double gbPerSecond = test.bytes / (summary.median * test.ops);
+        std::ostringstream line;
+        line << std::fixed;
+        if (options.json) {
+            line << std::setprecision(4) << "{\"name\":\"" << test.name << "\",\"ns_per_op\":" << summary.median
+                 << ",\"min\":" << summary.min << ",\"mean\":" << summary.mean << ",\"stddev\":" << summary.stddev
+                 << ",\"gb_per_s\":" << gbPerSecond << ",\"samples\":" << samples.size() << "}";
+        } else {
+            line << std::setprecision(3) << std::left << std::setw(24) << test.name << std::right
+                 << std::setw(11) << summary.median << std::setw(11) << summary.min
+                 << std::setprecision(1) << std::setw(8) << 100 * summary.stddev / summary.mean << "%"
+                 << std::setprecision(3) << std::setw(10) << gbPerSecond;
+        }
+        std::cout << line.str() << std::endl;
+    }
+}
+
+int runCodecBenchmark(const BenchmarkOptions& options) {
+    static const size_t INPUT_SIZE = 1 << 20;
+    
+    // Deterministic input, so runs before and after a change see the same
+    // bytes; strings are prefixed with their length like in NBT.
+    std::string random(INPUT_SIZE, '\0');
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < random.size(); i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        random[i] = static_cast<char>(state >> 56);
+    }
+    std::string shortStrings;
+    std::string longStrings;
+    for (size_t i = 0; shortStrings.size() + 10 <= INPUT_SIZE; i++) {
+        shortStrings += std::string("\0\x08", 2) + random.substr(i % 1024, 8);
+    }
+    for (size_t i = 0; longStrings.size() + 1026 <= INPUT_SIZE; i++) {
+        longStrings += std::string("\x04\x00", 2) + random.substr(i % 1024, 1024);
+    }
+    auto arrayInput = [&](TagType type) {
+        size_t width = type == TagType::BYTE_ARRAY ? 1 : type == TagType::INT_ARRAY ? 4 : 8;
+        std::string data(4, '\0');
+        writeBE32(data, 0, static_cast<uint32_t>(INPUT_SIZE / width));
+        return data + random;
+    };
+    std::string byteArray = arrayInput(TagType::BYTE_ARRAY);
+    std::string intArray = arrayInput(TagType::INT_ARRAY);
+    std::string longArray = arrayInput(TagType::LONG_ARRAY);
+    
+    NBTFile codec("");
+    std::string output;
+    output.reserve(2 * INPUT_SIZE);
+    std::vector<BenchmarkCase> cases;
+    
+    auto reader = [&](const std::string& name, const std::string& input, size_t width,
+                      const std::function<uint64_t(std::istream&)>& read) {
+        cases.push_back(BenchmarkCase{name, input.size() / width, input.size() / width * width, [&input, width, read] {
+            MemoryStreamBuf buffer(input.data(), input.size());
+            std::istream stream(&buffer);
+            uint64_t sum = 0;
+            for (size_t i = input.size() / width; i > 0; i--) sum += read(stream);
+            benchmarkSink += sum;
+        }});
+    };
+    reader("readByte", random, 1, [&](std::istream& in) { return static_cast<uint64_t>(codec.readByte(in)); });
+    reader("readShort", random, 2, [&](std::istream& in) { return static_cast<uint64_t>(codec.readShort(in)); });
+    reader("readInt", random, 4, [&](std::istream& in) { return static_cast<uint64_t>(codec.readInt(in)); });
+    reader("readLong", random, 8, [&](std::istream& in) { return static_cast<uint64_t>(codec.readLong(in)); });
+    // Random bits are mostly NaN or out of uint64_t range, so the sum takes
+    // the bits of floating values rather than converting them.
+    reader("readFloat", random, 4, [&](std::istream& in) {
+        float value = codec.readFloat(in);
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return static_cast<uint64_t>(bits);
+    });
+    reader("readDouble", random, 8, [&](std::istream& in) {
+        double value = codec.readDouble(in);
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    });
+    reader("readString/8", shortStrings, 10, [&](std::istream& in) { return codec.readString(in).size(); });
+    reader("readString/1024", longStrings, 1026, [&](std::istream& in) { return codec.readString(in).size(); });
+    
+    // Arrays go through readPayload, so ns/op is per element.
+    auto arrayReader = [&](const std::string& name, const std::string& input, TagType type, size_t width) {
+        cases.push_back(BenchmarkCase{name, INPUT_SIZE / width, INPUT_SIZE, [&codec, &input, type] {
+            MemoryStreamBuf buffer(input.data(), input.size());
+            std::istream stream(&buffer);
+            NBTTag tag(type, "");
+            codec.readPayload(stream, tag, 0);
+            benchmarkSink += tag.value.byteArrayVal.size() + tag.value.intArrayVal.size() + tag.value.longArrayVal.size();
+        }});
+    };
+    arrayReader("readByteArray", byteArray, TagType::BYTE_ARRAY, 1);
+    arrayReader("readIntArray", intArray, TagType::INT_ARRAY, 4);
+    arrayReader("readLongArray", longArray, TagType::LONG_ARRAY, 8);
+    
+    auto writer = [&](const std::string& name, size_t count, size_t width,
+                      const std::function<void(std::ostream&, size_t)>& write) {
+        cases.push_back(BenchmarkCase{name, count, count * width, [&output, count, write] {
+            output.clear();
+            StringStreamBuf buffer(output);
+            std::ostream stream(&buffer);
+            for (size_t i = 0; i < count; i++) write(stream, i);
+            benchmarkSink += output.size();
+        }});
+    };
+    const char* bytes = random.data();
+    writer("writeByte", INPUT_SIZE, 1, [&codec, bytes](std::ostream& out, size_t i) {
+        codec.writeByte(out, static_cast<int8_t>(bytes[i]));
+    });
+    writer("writeShort", INPUT_SIZE / 2, 2, [&codec, bytes](std::ostream& out, size_t i) {
+        int16_t value;
+        std::memcpy(&value, bytes + i * 2, sizeof(value));
+        codec.writeShort(out, value);
+    });
+    writer("writeInt", INPUT_SIZE / 4, 4, [&codec, bytes](std::ostream& out, size_t i) {
+        int32_t value;
+        std::memcpy(&value, bytes + i * 4, sizeof(value));
+        codec.writeInt(out, value);
+    });
+    writer("writeLong", INPUT_SIZE / 8, 8, [&codec, bytes](std::ostream& out, size_t i) {
+        int64_t value;
+        std::memcpy(&value, bytes + i * 8, sizeof(value));
+        codec.writeLong(out, value);
+    });
+    writer("writeFloat", INPUT_SIZE / 4, 4, [&codec, bytes](std::ostream& out, size_t i) {
+        float value;
+        std::memcpy(&value, bytes + i * 4, sizeof(value));
+        codec.writeFloat(out, value);
+    });
+    writer("writeDouble", INPUT_SIZE / 8, 8, [&codec, bytes](std::ostream& out, size_t i) {
+        double value;
+        std::memcpy(&value, bytes + i * 8, sizeof(value));
+        codec.writeDouble(out, value);
+    });
+    std::vector<std::string> shortValues;
+    std::vector<std::string> longValues;
+    for (size_t i = 0; i < INPUT_SIZE / 10; i++) shortValues.push_back(random.substr(i % 1024, 8));
+    for (size_t i = 0; i < INPUT_SIZE / 1026; i++) longValues.push_back(random.substr(i % 1024, 1024));
+    writer("writeString/8", shortValues.size(), 10, [&codec, &shortValues](std::ostream& out, size_t i) {
+        codec.writeString(out, shortValues[i]);
+    });
+    writer("writeString/1024", longValues.size(), 1026, [&codec, &longValues](std::ostream& out, size_t i) {
+        codec.writeString(out, longValues[i]);
+    });
+    
+    std::vector<NBTTag> arrays;
+    for (TagType type : { TagType::BYTE_ARRAY, TagType::INT_ARRAY, TagType::LONG_ARRAY }) {
+        const std::string& input = type == TagType::BYTE_ARRAY ? byteArray : type == TagType::INT_ARRAY ? intArray : longArray;
+        MemoryStreamBuf buffer(input.data(), input.size());
+        std::istream stream(&buffer);
+        arrays.emplace_back(type, "");
+        codec.readPayload(stream, arrays.back(), 0);
+    }
+    const char* arrayNames[] = { "writeByteArray", "writeIntArray", "writeLongArray" };
+    const size_t arrayWidths[] = { 1, 4, 8 };
+    for (size_t a = 0; a < arrays.size(); a++) {
+        const NBTTag* tag = &arrays[a];
+        cases.push_back(BenchmarkCase{arrayNames[a], INPUT_SIZE / arrayWidths[a], INPUT_SIZE, [&codec, &output, tag] {
+            output.clear();
+            StringStreamBuf buffer(output);
+            std::ostream stream(&buffer);
+            codec.writePayload(stream, *tag);
+            benchmarkSink += output.size();
+        }});
+    }
+    
+    runBenchmarkCases(cases, options);
+    return 0;
+}
+
+void NBTBinaryWriter::flush() {
+    if (sink) {
+        sink->write(out.data(), static_cast<std::streamsize>(out.size()));
+        flushed += out.size();
+        out.clear();
+    }
+}
+
+// Writes the type and name of a compound entry or the root; list elements
+// have neither.
+void NBTBinaryWriter::header(const std::string& name, TagType type) {
+    if (lists.empty() || !lists.back()) appendNBTHeader(out, type, name);
+}
+
+void NBTBinaryWriter::beginCompound(const std::string& name) {
+    header(name, TagType::COMPOUND);
+    lists.push_back(false);
+}
+
+void NBTBinaryWriter::endCompound() {
+    lists.pop_back();
+    out += static_cast<char>(TagType::END);
+    maybeFlush();
+}
+
+void NBTBinaryWriter::beginList(const std::string& name, TagType elementType, int32_t length) {
+    header(name, TagType::LIST);
+    out += static_cast<char>(elementType);
+    appendBE32(out, static_cast<uint32_t>(length));
+    lists.push_back(true);
+}
+
+void NBTBinaryWriter::integer(const std::string& name, TagType type, int64_t value) {
+    header(name, type);
+    appendNBTInteger(out, type, value);
+    maybeFlush();
+}
+
+void NBTBinaryWriter::floating(const std::string& name, TagType type, double value) {
+    header(name, type);
+    appendNBTFloating(out, type, value);
+    maybeFlush();
+}
+
+void NBTBinaryWriter::string(const std::string& name, const std::string& value) {
+    header(name, TagType::STRING);
+    appendNBTString(out, value);
+    maybeFlush();
+}
+
+void NBTBinaryWriter::beginArray(const std::string& name, TagType type, int32_t length) {
+    header(name, type);
+    appendBE32(out, static_cast<uint32_t>(length));
+    arrayType = type;
+}
+
+void NBTBinaryWriter::arrayValues(const int64_t* values, size_t count) {
+    appendNBTArrayValues(out, arrayType, values, count);
+}
+
+static const char* const CORPUS_KINDS[] = { "player", "chunk", "entities", "plugin", "flat" };
+
+bool parseCorpusKind(const std::string& name, CorpusKind& kind) {
+    for (size_t i = 0; i < sizeof(CORPUS_KINDS) / sizeof(CORPUS_KINDS[0]); i++) {
+        if (name == CORPUS_KINDS[i]) {
+            kind = static_cast<CorpusKind>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* corpusKindName(CorpusKind kind) {
+    return CORPUS_KINDS[static_cast<size_t>(kind)];
+}
+
+static const char* const CORPUS_ITEMS[] = {
+    "minecraft:stone", "minecraft:cobblestone", "minecraft:oak_planks", "minecraft:torch", "minecraft:diamond",
+    "minecraft:iron_ingot", "minecraft:bread", "minecraft:cooked_beef", "minecraft:diamond_sword",
+    "minecraft:diamond_pickaxe", "minecraft:bow", "minecraft:arrow", "minecraft:ender_pearl", "minecraft:redstone",
+    "minecraft:glass", "minecraft:netherite_chestplate", "minecraft:shulker_box", "minecraft:golden_apple"
+};
+static const char* const CORPUS_BLOCKS[] = {
+    "minecraft:stone", "minecraft:deepslate", "minecraft:dirt", "minecraft:grass_block", "minecraft:gravel",
+    "minecraft:andesite", "minecraft:diorite", "minecraft:granite", "minecraft:coal_ore", "minecraft:iron_ore",
+    "minecraft:water", "minecraft:oak_log", "minecraft:oak_leaves", "minecraft:tuff", "minecraft:copper_ore",
+    "minecraft:lava", "minecraft:cave_air", "minecraft:sand", "minecraft:sandstone", "minecraft:short_grass"
+};
+static const char* const CORPUS_BIOMES[] = {
+    "minecraft:plains", "minecraft:forest", "minecraft:river", "minecraft:dripstone_caves", "minecraft:lush_caves",
+    "minecraft:taiga", "minecraft:desert", "minecraft:deep_dark"
+};
+static const char* const CORPUS_MOBS[] = {
+    "minecraft:zombie", "minecraft:skeleton", "minecraft:creeper", "minecraft:spider", "minecraft:cow",
+    "minecraft:sheep", "minecraft:pig", "minecraft:chicken", "minecraft:villager", "minecraft:item_frame"
+};
+static const char* const CORPUS_PLUGINS[] = {
+    "essentials", "mcmmo", "luckperms", "towny", "worldguard", "quests", "jobs", "shopkeepers"
+};
+
+// splitmix64: fast, and good enough for test data.
+uint64_t CorpusGenerator::next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+std::string CorpusGenerator::word(size_t minLength, size_t maxLength) {
+    std::string result(minLength + below(static_cast<uint32_t>(maxLength - minLength + 1)), 'a');
+    for (char& c : result) c = static_cast<char>('a' + below(26));
+    return result;
+}
+
+void CorpusGenerator::named(const std::string& name) {
+    if (lists.empty() || !lists.back()) bytes += 3 + name.size();
+}
+
+void CorpusGenerator::beginCompound(const std::string& name) {
+    named(name);
+    out->beginCompound(name);
+    lists.push_back(false);
+}
+
+void CorpusGenerator::endCompound() {
+    lists.pop_back();
+    bytes += 1;
+    out->endCompound();
+}
+
+void CorpusGenerator::beginList(const std::string& name, TagType elementType, int32_t length) {
+    named(name);
+    bytes += 5;
+    out->beginList(name, elementType, length);
+    lists.push_back(true);
+}
+
+void CorpusGenerator::endList() {
+    lists.pop_back();
+    out->endList();
+}
+
+void CorpusGenerator::integer(const std::string& name, TagType type, int64_t value) {
+    named(name);
+    bytes += type == TagType::BYTE ? 1 : type == TagType::SHORT ? 2 : type == TagType::INT ? 4 : 8;
+    out->integer(name, type, value);
+}
+
+void CorpusGenerator::floating(const std::string& name, TagType type, double value) {
+    named(name);
+    bytes += type == TagType::FLOAT ? 4 : 8;
+    out->floating(name, type, value);
+}
+
+void CorpusGenerator::string(const std::string& name, const std::string& value) {
+    named(name);
+    bytes += 2 + value.size();
+    out->string(name, value);
+}
+
+void CorpusGenerator::array(const std::string& name, TagType type, const std::vector<int64_t>& values) {
+    named(name);
+    bytes += 4 + values.size() * (type == TagType::BYTE_ARRAY ? 1 : type == TagType::INT_ARRAY ? 4 : 8);
+    out->beginArray(name, type, static_cast<int32_t>(values.size()));
+    out->arrayValues(values.data(), values.size());
+    out->endArray();
+}
+
+void CorpusGenerator::doubles(const std::string& name, TagType type, const double* values, int count) {
+    beginList(name, type, count);
+    for (int i = 0; i < count; i++) floating("", type, values[i]);
+    endList();
+}
+
+// An item stack in the 1.20.5 format, a third of them with components.
+void CorpusGenerator::item(int slot) {
+    beginCompound("");
+    integer("Slot", TagType::BYTE, slot);
+    string("id", pick(CORPUS_ITEMS));
+    integer("count", TagType::INT, 1 + below(64));
+    if (below(3) == 0) {
+        beginCompound("components");
+        integer("minecraft:damage", TagType::INT, below(1500));
+        string("minecraft:custom_name", "{\"text\":\"" + word(4, 16) + "\",\"italic\":false}");
+        beginCompound("minecraft:enchantments");
+        beginCompound("levels");
+        int enchantments = 1 + below(4);
+        for (int i = 0; i < enchantments; i++) {
+            integer("minecraft:" + word(5, 12), TagType::INT, 1 + below(5));
+        }
+        endCompound();
+        endCompound();
+        endCompound();
+    }
+    endCompound();
+}
+
+// Full inventory, ender chest and abilities; the recipe book takes up the
+// rest of the target size.
+void CorpusGenerator::player(uint64_t target) {
+    beginCompound("");
+    integer("DataVersion", TagType::INT, 3953);
+    integer("playerGameType", TagType::INT, 0);
+    string("Dimension", "minecraft:overworld");
+    double pos[3] = { unit() * 20000 - 10000, 64 + unit() * 100, unit() * 20000 - 10000 };
+    doubles("Pos", TagType::DOUBLE, pos, 3);
+    double motion[3] = { 0, -0.0784000015258789, 0 };
+    doubles("Motion", TagType::DOUBLE, motion, 3);
+    double rotation[2] = { unit() * 360 - 180, unit() * 180 - 90 };
+    doubles("Rotation", TagType::FLOAT, rotation, 2);
+    std::vector<int64_t> uuid(4);
+    for (int64_t& part : uuid) part = static_cast<int32_t>(next());
+    array("UUID", TagType::INT_ARRAY, uuid);
+    floating("Health", TagType::FLOAT, 1 + below(20));
+    integer("foodLevel", TagType::INT, below(21));
+    floating("foodSaturationLevel", TagType::FLOAT, unit() * 5);
+    floating("foodExhaustionLevel", TagType::FLOAT, unit() * 4);
+    integer("XpLevel", TagType::INT, below(60));
+    floating("XpP", TagType::FLOAT, unit());
+    integer("XpTotal", TagType::INT, below(20000));
+    integer("XpSeed", TagType::INT, static_cast<int32_t>(next()));
+    integer("Score", TagType::INT, below(20000));
+    integer("SelectedItemSlot", TagType::INT, below(9));
+    integer("OnGround", TagType::BYTE, 1);
+    integer("Air", TagType::SHORT, 300);
+    integer("Fire", TagType::SHORT, -20);
+    beginCompound("abilities");
+    integer("flying", TagType::BYTE, 0);
+    integer("instabuild", TagType::BYTE, 0);
+    integer("invulnerable", TagType::BYTE, 0);
+    integer("mayBuild", TagType::BYTE, 1);
+    integer("mayfly", TagType::BYTE, 0);
+    floating("flySpeed", TagType::FLOAT, 0.05);
+    floating("walkSpeed", TagType::FLOAT, 0.1);
+    endCompound();
+    beginList("attributes", TagType::COMPOUND, 3);
+    const char* attributes[3] = { "minecraft:generic.max_health", "minecraft:generic.movement_speed",
+                                  "minecraft:player.block_interaction_range" };
+    double bases[3] = { 20, 0.1, 4.5 };
+    for (int i = 0; i < 3; i++) {
+        beginCompound("");
+        string("id", attributes[i]);
+        floating("base", TagType::DOUBLE, bases[i]);
+        endCompound();
+    }
+    endList();
+    // 36 main slots, armor in 100-103 and the offhand in -106.
+    beginList("Inventory", TagType::COMPOUND, 41);
+    for (int slot = 0; slot < 36; slot++) item(slot);
+    for (int slot = 100; slot < 104; slot++) item(slot);
+    item(-106);
+    endList();
+    beginList("EnderItems", TagType::COMPOUND, 27);
+    for (int slot = 0; slot < 27; slot++) item(slot);
+    endList();
+    beginCompound("recipeBook");
+    integer("isGuiOpen", TagType::BYTE, 0);
+    integer("isFilteringCraftable", TagType::BYTE, 0);
+    // Recipe names average 29 bytes with their length prefix.
+    int32_t recipes = static_cast<int32_t>(std::min<uint64_t>(
+        target > bytes + 64 ? (target - bytes - 64) / 29 : 0, 0x7fffffff));
+    beginList("recipes", TagType::STRING, recipes);
+    for (int32_t i = 0; i < recipes; i++) string("", "minecraft:" + word(6, 18) + "_" + std::to_string(i));
+    endList();
+    beginList("toBeDisplayed", TagType::STRING, 0);
+    endList();
+    endCompound();
+    endCompound();
+}
+
+// Packs palette indices of bits each into longs the way the game does: as
+// many whole entries per long as fit, low bits first, none spanning longs.
+static std::vector<int64_t> packPaletteIndices(const std::vector<uint32_t>& indices, int bits) {
+    size_t perLong = 64 / bits;
+    std::vector<int64_t> data((indices.size() + perLong - 1) / perLong, 0);
+    for (size_t i = 0; i < indices.size(); i++) {
+        data[i / perLong] |= static_cast<int64_t>(static_cast<uint64_t>(indices[i]) << (i % perLong * bits));
+    }
+    return data;
+}
+
+// Bits per palette index: ceil(log2(size)), but at least minimum.
+static int paletteBits(uint32_t size, int minimum) {
+    int bits = minimum;
+    while ((1u << bits) < size) bits++;
+    return bits;
+}
+
+// One chunk section: block states packed into longs the way the game packs
+// them, mostly layered with some noise so the data compresses like terrain.
+void CorpusGenerator::section(int y) {
+    beginCompound("");
+    integer("Y", TagType::BYTE, y);
+    bool air = y >= 8;
+    uint32_t paletteSize = air ? 1 : 2 + below(14);
+    // Palettes list each state once: consecutive names from a random start.
+    const size_t blockNames = sizeof(CORPUS_BLOCKS) / sizeof(CORPUS_BLOCKS[0]);
+    size_t first = below(blockNames);
+    beginCompound("block_states");
+    beginList("palette", TagType::COMPOUND, static_cast<int32_t>(paletteSize));
+    for (uint32_t i = 0; i < paletteSize; i++) {
+        beginCompound("");
+        string("Name", air ? "minecraft:air" : CORPUS_BLOCKS[(first + i) % blockNames]);
+        if (!air && below(4) == 0) {
+            beginCompound("Properties");
+            string("axis", below(2) ? "y" : "x");
+            endCompound();
+        }
+        endCompound();
+    }
+    endList();
+    if (paletteSize > 1) {
+        std::vector<uint32_t> blocks(4096);
+        uint32_t layer = 0;
+        for (size_t block = 0; block < blocks.size(); block++) {
+            if (block % 256 == 0 && below(4) == 0) layer = below(paletteSize);
+            blocks[block] = below(10) == 0 ? below(paletteSize) : layer;
+        }
+        array("data", TagType::LONG_ARRAY, packPaletteIndices(blocks, paletteBits(paletteSize, 4)));
+    }
+    endCompound();
+    // 4x4x4 biome cells, 64 per section.
+    beginCompound("biomes");
+    uint32_t biomes = 1 + below(3);
+    const size_t biomeNames = sizeof(CORPUS_BIOMES) / sizeof(CORPUS_BIOMES[0]);
+    first = below(biomeNames);
+    beginList("palette", TagType::STRING, static_cast<int32_t>(biomes));
+    for (uint32_t i = 0; i < biomes; i++) string("", CORPUS_BIOMES[(first + i) % biomeNames]);
+    endList();
+    if (biomes > 1) {
+        std::vector<uint32_t> cells(64);
+        for (uint32_t& cell : cells) cell = below(biomes);
+        array("data", TagType::LONG_ARRAY, packPaletteIndices(cells, paletteBits(biomes, 1)));
+    }
+    endCompound();
+    std::vector<int64_t> light(2048);
+    for (int64_t& value : light) value = air ? -1 : static_cast<int8_t>(next());
+    array("SkyLight", TagType::BYTE_ARRAY, light);
+    if (!air) {
+        for (int64_t& value : light) value = below(8) == 0 ? static_cast<int8_t>(next()) : 0;
+        array("BlockLight", TagType::BYTE_ARRAY, light);
+    }
+    endCompound();
+}
+
+// Terrain chunk with up to the 24 sections of an overworld chunk; beyond
+// that the target is made up with chests full of items.
+void CorpusGenerator::chunk(uint64_t target, int x, int z) {
+    static const uint64_t SECTION_BYTES = 6500;
+    static const uint64_t CHEST_BYTES = 3100;
+    beginCompound("");
+    integer("DataVersion", TagType::INT, 3953);
+    integer("xPos", TagType::INT, x);
+    integer("yPos", TagType::INT, -4);
+    integer("zPos", TagType::INT, z);
+    string("Status", "minecraft:full");
+    integer("LastUpdate", TagType::LONG, below(1u << 30));
+    integer("InhabitedTime", TagType::LONG, below(1u << 20));
+    integer("isLightOn", TagType::BYTE, 1);
+    int sections = static_cast<int>(std::max<uint64_t>(1, std::min<uint64_t>(24, target / SECTION_BYTES)));
+    beginList("sections", TagType::COMPOUND, sections);
+    for (int i = 0; i < sections; i++) section(i - 4);
+    endList();
+    beginCompound("Heightmaps");
+    const char* heightmaps[2] = { "MOTION_BLOCKING", "WORLD_SURFACE" };
+    for (const char* name : heightmaps) {
+        // 256 nine-bit heights, seven to a long.
+        std::vector<int64_t> data(37, 0);
+        for (int i = 0; i < 256; i++) {
+            data[i / 7] |= static_cast<int64_t>(128 + below(16)) << (i % 7 * 9);
+        }
+        array(name, TagType::LONG_ARRAY, data);
+    }
+    endCompound();
+    int32_t chests = static_cast<int32_t>(std::min<uint64_t>(
+        target > bytes + 64 ? (target - bytes - 64) / CHEST_BYTES : 0, 0x7fffffff));
+    beginList("block_entities", TagType::COMPOUND, chests);
+    for (int32_t i = 0; i < chests; i++) {
+        beginCompound("");
+        string("id", "minecraft:chest");
+        integer("x", TagType::INT, x * 16 + static_cast<int>(below(16)));
+        integer("y", TagType::INT, -64 + static_cast<int>(below(384)));
+        integer("z", TagType::INT, z * 16 + static_cast<int>(below(16)));
+        integer("keepPacked", TagType::BYTE, 0);
+        beginList("Items", TagType::COMPOUND, 27);
+        for (int slot = 0; slot < 27; slot++) item(slot);
+        endList();
+        endCompound();
+    }
+    endList();
+    beginList("PostProcessing", TagType::LIST, 0);
+    endList();
+    beginCompound("structures");
+    beginCompound("References");
+    endCompound();
+    beginCompound("starts");
+    endCompound();
+    endCompound();
+    endCompound();
+}
+
+void CorpusGenerator::entity(int x, int z) {
+    beginCompound("");
+    string("id", pick(CORPUS_MOBS));
+    double pos[3] = { x * 16 + unit() * 16, -60 + unit() * 380, z * 16 + unit() * 16 };
+    doubles("Pos", TagType::DOUBLE, pos, 3);
+    double motion[3] = { 0, -0.0784000015258789, 0 };
+    doubles("Motion", TagType::DOUBLE, motion, 3);
+    double rotation[2] = { unit() * 360 - 180, 0 };
+    doubles("Rotation", TagType::FLOAT, rotation, 2);
+    std::vector<int64_t> uuid(4);
+    for (int64_t& part : uuid) part = static_cast<int32_t>(next());
+    array("UUID", TagType::INT_ARRAY, uuid);
+    floating("Health", TagType::FLOAT, 1 + below(20));
+    floating("FallDistance", TagType::FLOAT, 0);
+    floating("AbsorptionAmount", TagType::FLOAT, 0);
+    integer("Fire", TagType::SHORT, -1);
+    integer("Air", TagType::SHORT, 300);
+    integer("OnGround", TagType::BYTE, 1);
+    integer("Invulnerable", TagType::BYTE, 0);
+    integer("PortalCooldown", TagType::INT, 0);
+    integer("HurtTime", TagType::SHORT, 0);
+    integer("HurtByTimestamp", TagType::INT, 0);
+    integer("DeathTime", TagType::SHORT, 0);
+    integer("PersistenceRequired", TagType::BYTE, below(2));
+    integer("LeftHanded", TagType::BYTE, below(20) == 0);
+    integer("CanPickUpLoot", TagType::BYTE, below(2));
+    beginList("attributes", TagType::COMPOUND, 2);
+    beginCompound("");
+    string("id", "minecraft:generic.movement_speed");
+    floating("base", TagType::DOUBLE, 0.23);
+    endCompound();
+    beginCompound("");
+    string("id", "minecraft:generic.follow_range");
+    floating("base", TagType::DOUBLE, 35);
+    endCompound();
+    endList();
+    // Positional equipment lists: empty compounds are empty slots.
+    beginList("ArmorItems", TagType::COMPOUND, 4);
+    for (int i = 0; i < 4; i++) {
+        beginCompound("");
+        endCompound();
+    }
+    endList();
+    beginList("HandItems", TagType::COMPOUND, 2);
+    for (int i = 0; i < 2; i++) {
+        beginCompound("");
+        if (i == 0 && below(4) == 0) {
+            string("id", pick(CORPUS_ITEMS));
+            integer("count", TagType::INT, 1);
+        }
+        endCompound();
+    }
+    endList();
+    double chances[4] = { 0.085, 0.085, 0.085, 0.085 };
+    doubles("ArmorDropChances", TagType::FLOAT, chances, 4);
+    doubles("HandDropChances", TagType::FLOAT, chances, 2);
+    beginCompound("Brain");
+    beginCompound("memories");
+    endCompound();
+    endCompound();
+    endCompound();
+}
+
+void CorpusGenerator::entities(uint64_t target, int x, int z) {
+    static const uint64_t ENTITY_BYTES = 640;
+    beginCompound("");
+    integer("DataVersion", TagType::INT, 3953);
+    std::vector<int64_t> position = { x, z };
+    array("Position", TagType::INT_ARRAY, position);
+    int32_t count = static_cast<int32_t>(std::max<uint64_t>(1, std::min<uint64_t>(
+        target > bytes + 64 ? (target - bytes - 64) / ENTITY_BYTES : 0, 0x7fffffff)));
+    beginList("Entities", TagType::COMPOUND, count);
+    for (int32_t i = 0; i < count; i++) entity(x, z);
+    endList();
+    endCompound();
+}
+
+// A chain of depth nested compounds, the way plugins serialize their object
+// graphs, with a list of records every few levels.
+void CorpusGenerator::blob(int depth) {
+    integer("version", TagType::INT, 1 + below(5));
+    string("type", word(4, 10));
+    if (depth % 4 == 0) {
+        int32_t records = static_cast<int32_t>(below(4));
+        beginList("records", TagType::COMPOUND, records);
+        for (int32_t i = 0; i < records; i++) {
+            beginCompound("");
+            string("key", word(3, 12));
+            integer("value", TagType::LONG, static_cast<int64_t>(next()));
+            endCompound();
+        }
+        endList();
+    }
+    if (depth > 0) {
+        beginCompound("data");
+        blob(depth - 1);
+        endCompound();
+    } else {
+        string("payload", word(16, 64));
+    }
+}
+
+void CorpusGenerator::plugin(uint64_t target) {
+    beginCompound("");
+    integer("DataVersion", TagType::INT, 3953);
+    beginCompound("BukkitValues");
+    for (uint64_t i = 0; bytes + 2 < target; i++) {
+        std::string key = std::string(pick(CORPUS_PLUGINS)) + ":" + word(4, 10) + "_" + std::to_string(i);
+        beginCompound(key);
+        blob(8 + static_cast<int>(below(89)));
+        endCompound();
+    }
+    endCompound();
+    endCompound();
+}
+
+void CorpusGenerator::flat(uint64_t target) {
+    beginCompound("");
+    for (uint64_t i = 0; bytes + 1 < target; i++) {
+        std::string key = word(4, 12) + "_" + std::to_string(i);
+        switch (below(7)) {
+            case 0: integer(key, TagType::BYTE, static_cast<int8_t>(next())); break;
+            case 1: integer(key, TagType::SHORT, static_cast<int16_t>(next())); break;
+            case 2: integer(key, TagType::INT, static_cast<int32_t>(next())); break;
+            case 3: integer(key, TagType::LONG, static_cast<int64_t>(next())); break;
+            case 4: floating(key, TagType::FLOAT, unit() * 1000); break;
+            case 5: floating(key, TagType::DOUBLE, unit() * 1000); break;
+            default: string(key, word(0, 32)); break;
+        }
+    }
+    endCompound();
+}
+
+void CorpusGenerator::generate(CorpusKind kind, uint64_t target, NBTEventHandler& handler, int x, int z) {
+    out = &handler;
+    bytes = 0;
+    lists.clear();
+    switch (kind) {
+        case CorpusKind::PLAYER: player(target); break;
+        case CorpusKind::CHUNK: chunk(target, x, z); break;
+        case CorpusKind::ENTITIES: entities(target, x, z); break;
+        case CorpusKind::PLUGIN: plugin(target); break;
+        case CorpusKind::FLAT: flat(target); break;
+    }
+}
+
+bool generateFile(CorpusKind kind, const std::string& path, uint64_t size, uint64_t seed, Compression compression,
+                  uint64_t& written, std::string& error) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        error = strerror(errno);
+        return false;
+    }
+    std::unique_ptr<DeflateStreamBuf> deflater;
+    std::unique_ptr<std::ostream> compressed;
+    std::ostream* sink = &file;
+    if (compression != Compression::NONE) {
+        deflater.reset(new DeflateStreamBuf(file, compression));
+        compressed.reset(new std::ostream(deflater.get()));
+        sink = compressed.get();
+    }
+    CorpusGenerator generator(seed);
+    NBTBinaryWriter writer(sink);
+    generator.generate(kind, size, writer);
+    writer.flush();
+    written = writer.size();
+    if ((deflater && (!compressed->good() || !deflater->finish())) || !file.flush()) {
+        error = "write failed";
+        return false;
+    }
+    return true;
+}
+
+int runGenerate(CorpusKind kind, const std::string& output, uint64_t size, uint64_t seed, Compression compression) {
+    auto start = std::chrono::steady_clock::now();
+    CorpusGenerator generator(seed);
+    uint64_t written = 0;
+    size_t documents = 0;
+    std::string error;
+    
+    if (endsWith(output, ".mca")) {
+        if (kind != CorpusKind::CHUNK && kind != CorpusKind::ENTITIES) {
+            std::cerr << "region output needs chunk or entities documents" << std::endl;
+            return 1;
+        }
+        // 64 KiB chunks until the region is full, then larger ones.
+        int count = static_cast<int>(std::max<uint64_t>(1, std::min<uint64_t>(REGION_CHUNKS, size >> 16)));
+        uint64_t perChunk = size / count;
+        // Chunks get a fixed timestamp so the same seed gives the same file.
+        static const uint32_t TIMESTAMP = 1700000000;
+        uint8_t type = compression == Compression::GZIP ? 1 : compression == Compression::ZLIB ? 2 : 3;
+        RegionFile region(output);
+        NBTBinaryWriter writer;
+        std::string encoded;
+        for (int i = 0; i < count; i++) {
+            writer.data().clear();
+            generator.generate(kind, perChunk, writer, region.getRegionX() * 32 + i % 32,
+                               region.getRegionZ() * 32 + i / 32);
+            written += writer.data().size();
+            if (compression == Compression::NONE) {
+                encoded = writer.data();
+            } else if (!deflateData(writer.data(), compression, encoded, error)) {
+                std::cerr << output << ": " << error << std::endl;
+                return 1;
+            }
+            region.addEncodedChunk(i, TIMESTAMP, false, encoded, type);
+        }
+        if (!region.save()) {
+            std::cerr << output << ": " << region.getError() << std::endl;
+            return 1;
+        }
+        documents = static_cast<size_t>(count);
+    } else {
+        if (!generateFile(kind, output, size, seed, compression, written, error)) {
+            std::cerr << output << ": " << error << std::endl;
+            return 1;
+        }
+        documents = 1;
+    }
+    
+    int64_t mtime = 0;
+    int64_t onDisk = 0;
+    statFile(output, mtime, onDisk);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << output << ": " << documents << (documents == 1 ? " document, " : " documents, ")
+              << formatBytes(written) << " of NBT, " << formatBytes(static_cast<uint64_t>(onDisk))
+              << " on disk in " << seconds << "s" << std::endl;
+    return 0;
+}
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t combineHash(uint64_t seed, uint64_t value) {
+    return mix64(seed ^ (value + 0x9E3779B97F4A7C15ULL + (seed << 6) + (seed >> 2)));
+}
+
+static uint64_t hashBytes(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+    while (size >= 8) {
+        uint64_t k;
+        std::memcpy(&k, p, 8);
+        h = (h ^ mix64(k)) * 0x100000001B3ULL;
+        p += 8;
+        size -= 8;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, size);
+    return mix64(h ^ tail);
+}
+
+static const size_t PATCH_BLOCK = 4096;
+
+void NBTFile::recordBlocks(const std::string& data, int64_t mtime) {
+    blockHashes.clear();
+    for (size_t offset = 0; offset < data.size(); offset += PATCH_BLOCK) {
+        blockHashes.push_back(hashBytes(data.data() + offset, std::min(PATCH_BLOCK, data.size() - offset), 0));
+    }
+    diskMtime = mtime;
+    diskSize = static_cast<int64_t>(data.size());
+}
+
+// Writes data over the file in place when it has the size the file had at
+// load time and the file has not changed since: only blocks whose hash
+// differs are read back, and only the bytes that differ within them are
+// written. Unlike a full save this is not atomic across blocks, but each
+// changed range is a single write, usually a few bytes within one sector.
+// Returns false, having possibly written some ranges, when the caller has
+// to save the whole file instead.
+bool NBTFile::patchInPlace(const std::string& data) {
+    int64_t mtime, size;
+    if (blockHashes.empty() || static_cast<int64_t>(data.size()) != diskSize ||
+        !statFile(filename, mtime, size) || mtime != diskMtime || size != diskSize) {
+        return false;
+    }
+    int fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    char old[PATCH_BLOCK];
+    bool ok = true;
+    for (size_t block = 0; ok && block < blockHashes.size(); block++) {
+        size_t offset = block * PATCH_BLOCK;
+        size_t length = std::min(PATCH_BLOCK, data.size() - offset);
+        const char* updated = data.data() + offset;
+        if (hashBytes(updated, length, 0) == blockHashes[block]) continue;
+
+        if (pread(fd, old, length, offset) != static_cast<ssize_t>(length)) {
+            ok = false;
+            break;
+        }
+        size_t first = 0;
+        while (first < length && old[first] == updated[first]) first++;
+        if (first == length) continue;
+        size_t last = length;
+        while (old[last - 1] == updated[last - 1]) last--;
+        ok = pwrite(fd, updated + first, last - first, offset + first) == static_cast<ssize_t>(last - first);
+    }
+    ok = ok && fdatasync(fd) == 0;
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0;
+    close(fd);
+    if (!ok) return false;
+    recordBlocks(data, static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec);
+    return true;
+}
+
+// Snapshot file layout: this header, the absolute path of the source file,
+// then the inflated payload. Only ever read back on the machine that wrote
+// it, so fields are in native byte order.
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    int64_t size;
+    int64_t mtime;
+    uint64_t payloadSize;
+    uint64_t payloadHash;
+    uint32_t pathLength;
+    uint8_t compression;
+    uint8_t reserved[3];
+};
+
+static const char SNAPSHOT_MAGIC[4] = { 'N', 'B', 'T', 'S' };
+
+std::string defaultCacheDir() {
+    const char* configured = std::getenv("NBTEDIT_CACHE_DIR");
+    if (configured && *configured) {
+        return std::string(configured) == "off" ? "" : configured;
+    }
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) return std::string(xdg) + "/nbtedit";
+    const char* home = std::getenv("HOME");
+    if (home && *home) return std::string(home) + "/.cache/nbtedit";
+    return "";
+}
+
+// A file that does not exist yet is resolved through its directory, so two
+// spellings of a path still agree before the file is created.
+static std::string absolutePath(const std::string& path) {
+    char* resolved = realpath(path.c_str(), nullptr);
+    std::string result = resolved ? resolved : path;
+    free(resolved);
+    size_t slash = path.find_last_of('/');
+    if (!resolved && slash != std::string::npos && slash + 1 < path.size()) {
+        std::string dir = absolutePath(slash == 0 ? "/" : path.substr(0, slash));
+        result = (dir == "/" ? "" : dir) + path.substr(slash);
+    }
+    return result;
+}
+
+std::string NBTFile::snapshotPath() const {
+    std::string key = absolutePath(filename);
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.nbts",
+                  static_cast<unsigned long long>(hashBytes(key.data(), key.size(), 0)));
+    return cacheDir + "/" + name;
+}
+
+bool NBTFile::loadSnapshot(int64_t size, int64_t mtime) {
+    bool parsed = false;
+    return readSnapshot(size, mtime, [&](const char* payload, size_t length) { return parse(payload, length); },
+                        parsed) && parsed;
+}
+
+bool NBTFile::readSnapshot(int64_t size, int64_t mtime, const std::function<bool(const char*, size_t)>& consume,
+                           bool& consumed) {
+    int fd = ::open(snapshotPath().c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+        close(fd);
+        return false;
+    }
+    size_t length = static_cast<size_t>(st.st_size);
+    void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    const char* data = static_cast<const char*>(mapping);
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    std::string key = absolutePath(filename);
+    bool valid = std::memcmp(header.magic, SNAPSHOT_MAGIC, 4) == 0 && header.version == 1 &&
+                 header.size == size && header.mtime == mtime && header.pathLength == key.size() &&
+                 sizeof(header) + header.pathLength + header.payloadSize == length &&
+                 header.compression <= static_cast<uint8_t>(Compression::ZLIB) &&
+                 std::memcmp(data + sizeof(header), key.data(), key.size()) == 0;
+
+    const char* payload = data + sizeof(header) + header.pathLength;
+    valid = valid && hashBytes(payload, header.payloadSize, 0) == header.payloadHash;
+    if (valid) {
+        madvise(mapping, length, MADV_SEQUENTIAL);
+        consumed = consume(payload, header.payloadSize);
+        if (consumed) compression = static_cast<Compression>(header.compression);
+    }
+    munmap(mapping, length);
+    return valid;
+}
+
+// Creates dir and its parents as needed.
+static void makeDirectories(const std::string& dir) {
+    for (size_t pos = 1; pos != std::string::npos; pos = dir.find('/', pos + 1)) {
+        mkdir(dir.substr(0, pos).c_str(), 0700);
+    }
+    mkdir(dir.c_str(), 0700);
+}
+
+// Written to a temporary name and renamed, so readers never see a partial
+// snapshot. Failures only cost the next open its speed-up, so they are
+// not reported.
+void NBTFile::storeSnapshot(const std::string& payload, int64_t mtime, int64_t size) {
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.mtime = mtime;
+    header.size = size;
+    std::string key = absolutePath(filename);
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = 1;
+    header.payloadSize = payload.size();
+    header.payloadHash = hashBytes(payload.data(), payload.size(), 0);
+    header.pathLength = static_cast<uint32_t>(key.size());
+    header.compression = static_cast<uint8_t>(compression);
+
+    makeDirectories(cacheDir);
+
+    std::string path = snapshotPath();
+    std::string temp = path + ".tmp" + std::to_string(getpid());
+    std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(key.data(), key.size());
+    file.write(payload.data(), payload.size());
+    file.close();
+    if (!file || rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str());
+    }
+}
+
+bool parseByteSize(const std::string& text, uint64_t& bytes) {
+    // strtoull would skip spaces and accept a sign.
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+    if (errno == ERANGE) return false;
+
+    int shift = 0;
+    switch (std::toupper(static_cast<unsigned char>(*end))) {
+        case 'G': shift = 30; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'K': shift = 10; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) return false;
+    bytes = static_cast<uint64_t>(value) << shift;
+    return true;
+}
+
+static const char* memoryBudgetSetting() {
+    const char* setting = std::getenv("NBTEDIT_MEMORY_BUDGET");
+    return setting && *setting ? setting : nullptr;
+}
+
+size_t memoryBudget() {
+    static const size_t budget = [] {
+        uint64_t bytes = 0;
+        const char* setting = memoryBudgetSetting();
+        return setting && parseByteSize(setting, bytes) ? static_cast<size_t>(bytes) : 0;
+    }();
+    return budget;
+}
+
+bool validMemoryBudget() {
+    uint64_t bytes;
+    const char* setting = memoryBudgetSetting();
+    if (!setting || parseByteSize(setting, bytes)) return true;
+    std::cerr << "NBTEDIT_MEMORY_BUDGET: invalid size '" << setting << "' (use bytes or a K, M or G suffix)"
+              << std::endl;
+    return false;
+}
+
+size_t tagFootprint(const NBTTag& tag) {
+    // Strings up to 15 bytes are stored inline; maps cost a node per entry.
+    auto heap = [](const std::string& str) { return str.capacity() > 15 ? str.capacity() + 1 : 0; };
+    const NBTValue& value = tag.value;
+    size_t bytes = sizeof(NBTTag) + 16 + heap(tag.name) + heap(value.stringVal);
+    bytes += value.byteArrayVal.capacity() + value.intArrayVal.capacity() * sizeof(int32_t) +
+             value.longArrayVal.capacity() * sizeof(int64_t) +
+             value.listVal.capacity() * sizeof(std::shared_ptr<NBTTag>);
+    for (const auto& pair : value.compoundVal) {
+        bytes += 32 + sizeof(pair) + heap(pair.first);
+    }
+    return bytes;
+}
+
+SpillFile::~SpillFile() {
+    if (fd >= 0) close(fd);
+}
+
+bool SpillFile::open(const std::string& dir) {
+    std::string pattern = dir + "/nbtedit-spill-XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    fd = mkostemp(name.data(), O_CLOEXEC);
+    if (fd < 0) return false;
+    unlink(name.data());
+    return true;
+}
+
+bool SpillFile::append(const std::string& data, uint64_t& offset) {
+    offset = size;
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = pwrite(fd, data.data() + written, data.size() - written, static_cast<off_t>(size + written));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += static_cast<size_t>(n);
+    }
+    size += data.size();
+    return true;
+}
+
+bool SpillFile::read(uint64_t offset, size_t length, std::string& out) const {
+    out.resize(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, &out[done], length - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+struct TraceEvent {
+    const char* phase;
+    char detail[40];
+    uint64_t start;
+    uint64_t duration;
+};
+
+// Events of one thread, by kernel thread id. Only the owning thread appends: it fills a slot
+// and then publishes it by bumping count, so the exporter can read every
+// published event without locks. Events live in chunks that are never
+// moved or freed, since threads may exit before the trace is written.
+class TraceBuffer {
+public:
+    static const size_t CHUNK_EVENTS = 4096;
+    static const size_t MAX_CHUNKS = 1024;
+    
+private:
+    std::atomic<TraceEvent*> chunks[MAX_CHUNKS];
+    std::atomic<size_t> count;
+    std::atomic<size_t> dropped;
+    
+public:
+    const uint32_t thread;
+    
+    explicit TraceBuffer(uint32_t id) : count(0), dropped(0), thread(id) {
+        for (auto& chunk : chunks) chunk.store(nullptr, std::memory_order_relaxed);
+    }
+    
+    TraceEvent* next() {
+        size_t index = count.load(std::memory_order_relaxed);
+        if (index / CHUNK_EVENTS >= MAX_CHUNKS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        std::atomic<TraceEvent*>& chunk = chunks[index / CHUNK_EVENTS];
+        if (!chunk.load(std::memory_order_relaxed)) chunk.store(new TraceEvent[CHUNK_EVENTS], std::memory_order_release);
+        return &chunk.load(std::memory_order_relaxed)[index % CHUNK_EVENTS];
+    }
+    
+    void publish() { count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    size_t size() const { return count.load(std::memory_order_acquire); }
+    size_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+    const TraceEvent& at(size_t index) const {
+        return chunks[index / CHUNK_EVENTS].load(std::memory_order_acquire)[index % CHUNK_EVENTS];
+    }
+};
+
+static std::mutex traceMutex;
+static std::vector<TraceBuffer*> traceBuffers;
+static std::chrono::steady_clock::time_point traceEpoch;
+
+static uint64_t traceNow() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceEpoch).count());
+}
+
+static void appendTraceString(std::string& out, const char* text) {
+    out += '"';
+    for (; *text; text++) {
+        unsigned char c = static_cast<unsigned char>(*text);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += *text;
+        } else if (c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += *text;
+        }
+    }
+    out += '"';
+}
+
+// Runs at exit. Threads still running may add events meanwhile; those
+// published so far are written.
+static void writeTrace() {
+    const char* path = std::getenv("NBTEDIT_TRACE");
+    std::vector<TraceBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        buffers = traceBuffers;
+    }
+    std::string pid = std::to_string(getpid());
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    size_t dropped = 0;
+    for (const TraceBuffer* buffer : buffers) {
+        std::string tid = std::to_string(buffer->thread);
+        out += first ? "\n" : ",\n";
+        first = false;
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid + ",\"tid\":" + tid +
+               ",\"args\":{\"name\":\"" + (tid == pid ? std::string("main") : "thread " + tid) + "\"}}";
+        size_t count = buffer->size();
+        for (size_t i = 0; i < count; i++) {
+            const TraceEvent& event = buffer->at(i);
+            char timing[96];
+            std::snprintf(timing, sizeof(timing), ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":", event.start / 1000.0,
+                          event.duration / 1000.0);
+            out += ",\n{\"name\":";
+            appendTraceString(out, event.detail[0] ? event.detail : event.phase);
+            out += ",\"cat\":";
+            appendTraceString(out, event.phase);
+            out += timing + pid + ",\"tid\":" + tid + "}";
+        }
+        dropped += buffer->droppedCount();
+    }
+    out += "\n]}\n";
+    std::string error;
+    if (!writeFileAtomic(path, out.data(), out.size(), false, error)) {
+        std::cerr << "trace: " << error << std::endl;
+    } else if (dropped > 0) {
+        std::cerr << "trace: " << dropped << " spans dropped, buffers full" << std::endl;
+    }
+}
+
+bool tracingEnabled() {
+    static const bool enabled = [] {
+        const char* path = std::getenv("NBTEDIT_TRACE");
+        if (!path || !*path) return false;
+        traceEpoch = std::chrono::steady_clock::now();
+        std::atexit(writeTrace);
+        return true;
+    }();
+    return enabled;
+}
+
+static TraceBuffer* threadTraceBuffer() {
+    thread_local TraceBuffer* buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        buffer = new TraceBuffer(static_cast<uint32_t>(syscall(SYS_gettid)));
+        traceBuffers.push_back(buffer);
+    }
+    return buffer;
+}
+
+TraceSpan::TraceSpan(const char* name, const std::string* what)
+    : phase(name && tracingEnabled() ? name : nullptr), detail(what), start(phase ? traceNow() : 0) {}
+
+TraceSpan::~TraceSpan() {
+    if (!phase) return;
+    uint64_t end = traceNow();
+    TraceBuffer* buffer = threadTraceBuffer();
+    TraceEvent* event = buffer->next();
+    if (!event) return;
+    event->phase = phase;
+    event->start = start;
+    event->duration = end - start;
+    size_t length = 0;
+    if (detail) {
+        length = std::min(detail->size(), sizeof(event->detail) - 1);
+        // Never cut a UTF-8 sequence in half.
+        while (length > 0 && length < detail->size() && ((*detail)[length] & 0xC0) == 0x80) length--;
+        std::memcpy(event->detail, detail->data(), length);
+    }
+    event->detail[length] = '\0';
+    buffer->publish();
+}
+
+// Allocation statistics. operator new and delete are replaced for the whole
+// program; while counting is off they cost one relaxed load on top of
+// malloc and free. Sizes are those malloc actually reserved.
+//
+// Blocks carry no mark, so a block allocated before counting started and
+// freed after is subtracted from heapInUse without having been added; the
+// heap figures are low by that much. Counting starts first thing in main,
+// so only static initialisation comes before it, and almost all of that is
+// freed after the summary is printed.
+struct AllocationCounters {
+    std::atomic<uint64_t> allocations;
+    std::atomic<uint64_t> frees;
+    std::atomic<uint64_t> allocated;
+    std::atomic<uint64_t> freed;
+    std::atomic<int64_t> peakHeap;
+    // Growth of the process's peak RSS while the phase was current.
+    std::atomic<uint64_t> rssGrowth;
+};
+
+static const char* const ALLOCATION_PHASES[] = { "other", "load", "flatten", "render", "save" };
+static const size_t ALLOCATION_PHASE_COUNT = sizeof(ALLOCATION_PHASES) / sizeof(ALLOCATION_PHASES[0]);
+
+static std::atomic<bool> allocationStats(false);
+static AllocationCounters allocationCounters[ALLOCATION_PHASE_COUNT];
+static std::atomic<int64_t> heapInUse(0);
+static std::atomic<uint64_t> lastMaxRss(0);
+static thread_local AllocationPhase allocationPhase = AllocationPhase::OTHER;
+
+static uint64_t maxRss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+// Credits peak RSS growth since the last phase change on any thread to the
+// phase this thread is leaving.
+static void chargeRssGrowth() {
+    uint64_t now = maxRss();
+    uint64_t before = lastMaxRss.exchange(now, std::memory_order_relaxed);
+    if (now > before) {
+        allocationCounters[static_cast<size_t>(allocationPhase)].rssGrowth.fetch_add(now - before,
+                                                                                    std::memory_order_relaxed);
+    }
+}
+
+AllocationScope::AllocationScope(AllocationPhase phase) : previous(allocationPhase) {
+    if (allocationStats.load(std::memory_order_relaxed)) chargeRssGrowth();
+    allocationPhase = phase;
+}
+
+AllocationScope::~AllocationScope() {
+    if (allocationStats.load(std::memory_order_relaxed)) chargeRssGrowth();
+    allocationPhase = previous;
+}
+
+static void* trackedAlloc(size_t size) {
+    void* block = std::malloc(size ? size : 1);
+    if (block && allocationStats.load(std::memory_order_relaxed)) {
+        size_t bytes = malloc_usable_size(block);
+        AllocationCounters& counters = allocationCounters[static_cast<size_t>(allocationPhase)];
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.allocated.fetch_add(bytes, std::memory_order_relaxed);
+        int64_t inUse = heapInUse.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed) +
+                        static_cast<int64_t>(bytes);
+        int64_t peak = counters.peakHeap.load(std::memory_order_relaxed);
+        while (inUse > peak && !counters.peakHeap.compare_exchange_weak(peak, inUse, std::memory_order_relaxed)) {}
+    }
+    return block;
+}
+
+static void trackedFree(void* block) {
+    if (!block) return;
+    if (allocationStats.load(std::memory_order_relaxed)) {
+        size_t bytes = malloc_usable_size(block);
+        AllocationCounters& counters = allocationCounters[static_cast<size_t>(allocationPhase)];
+        counters.frees.fetch_add(1, std::memory_order_relaxed);
+        counters.freed.fetch_add(bytes, std::memory_order_relaxed);
+        heapInUse.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+    }
+    std::free(block);
+}
+
+// As the standard requires: give the new handler a chance to free memory
+// before failing.
+void* operator new(std::size_t size) {
+    for (;;) {
+        void* block = trackedAlloc(size);
+        if (block) return block;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void* block) noexcept {
+    trackedFree(block);
+}
+
+void operator delete[](void* block) noexcept {
+    trackedFree(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept {
+    trackedFree(block);
+}
+
+void operator delete[](void* block, std::size_t) noexcept {
+    trackedFree(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept {
+    trackedFree(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept {
+    trackedFree(block);
+}
+
+static void printAllocationStats() {
+    allocationStats = false;
+    chargeRssGrowth();
+    AllocationCounters total = {};
+    auto row = [](const std::string& phase, uint64_t allocations, uint64_t frees, uint64_t allocated,
+                  int64_t peakHeap, uint64_t rss) {
+        std::cerr << std::left << std::setw(8) << phase << std::right << std::setw(13) << allocations
+                  << std::setw(13) << frees << std::setw(12) << formatBytes(allocated)
+                  << std::setw(12) << formatBytes(static_cast<uint64_t>(std::max<int64_t>(0, peakHeap)))
+                  << std::setw(12) << formatBytes(rss) << "\n";
+    };
+    std::cerr << std::left << std::setw(8) << "phase" << std::right << std::setw(13) << "allocs" << std::setw(13)
+              << "frees" << std::setw(12) << "allocated" << std::setw(12) << "peak heap" << std::setw(12)
+              << "peak RSS +" << "\n";
+    for (size_t i = 0; i < ALLOCATION_PHASE_COUNT; i++) {
+        const AllocationCounters& counters = allocationCounters[i];
+        row(ALLOCATION_PHASES[i], counters.allocations.load(), counters.frees.load(), counters.allocated.load(),
+            counters.peakHeap.load(), counters.rssGrowth.load());
+        total.allocations += counters.allocations.load();
+        total.frees += counters.frees.load();
+        total.allocated += counters.allocated.load();
+        total.peakHeap = std::max(total.peakHeap.load(), counters.peakHeap.load());
+    }
+    row("total", total.allocations.load(), total.frees.load(), total.allocated.load(), total.peakHeap.load(),
+        maxRss());
+    std::cerr.flush();
+}
+
+void startAllocationStats() {
+    const char* value = std::getenv("NBTEDIT_ALLOC_STATS");
+    if (!value || !*value || std::strcmp(value, "0") == 0) return;
+    lastMaxRss = maxRss();
+    allocationStats = true;
+    std::atexit(printAllocationStats);
+}
+
+// The record of a tag that is currently evicted. Records are keyed by
+// address, so one whose tag is gone says nothing about a new tag that
+// happens to live at the same address.
+const NBTFile::EvictedTag* NBTFile::findEvicted(const NBTTag& tag) const {
+    auto it = evicted.find(&tag);
+    if (it == evicted.end() || it->second.resident || it->second.tag.lock().get() != &tag) return nullptr;
+    return &it->second;
+}
+
+bool NBTFile::readEvicted(const EvictedTag& entry, std::string& payload) {
+    if (!spill->read(entry.offset, static_cast<size_t>(entry.length), payload) ||
+        hashBytes(payload.data(), payload.size(), 0) != entry.hash) {
+        lastError = "cannot read an evicted subtree back from the spill file";
+        return false;
+    }
+    return true;
+}
+
+bool NBTFile::evict(const std::shared_ptr<NBTTag>& tag) {
+    if (!tag || (tag->type != TagType::COMPOUND && tag->type != TagType::LIST) || isEvicted(*tag)) return false;
+    if (!spill) {
+        std::shared_ptr<SpillFile> file = std::make_shared<SpillFile>();
+        std::string dir = cacheDir.empty() ? "/var/tmp" : cacheDir;
+        if (!cacheDir.empty()) makeDirectories(cacheDir);
+        if (!file->open(dir)) {
+            lastError = "cannot create a spill file in " + dir + ": " + strerror(errno);
+            return false;
+        }
+        spill = file;
+    }
+    
+    std::string payload;
+    StringStreamBuf buffer(payload);
+    std::ostream stream(&buffer);
+    try {
+        writePayload(stream, *tag);
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return false;
+    }
+    uint64_t hash = hashBytes(payload.data(), payload.size(), 0);
+    
+    // A subtree read back and not changed since is already in the file.
+    EvictedTag& entry = evicted[tag.get()];
+    bool clean = entry.tag.lock() == tag && entry.length == payload.size() && entry.hash == hash;
+    if (!clean) {
+        if (!spill->append(payload, entry.offset)) {
+            evicted.erase(tag.get());
+            lastError = std::string("cannot write the spill file: ") + strerror(errno);
+            return false;
+        }
+        entry.tag = tag;
+        entry.length = payload.size();
+        entry.hash = hash;
+    }
+    entry.resident = false;
+    if (tag->type == TagType::COMPOUND) {
+        entry.children = tag->value.compoundVal.size();
+        std::map<std::string, std::shared_ptr<NBTTag>>().swap(tag->value.compoundVal);
+    } else {
+        entry.children = tag->value.listVal.size();
+        std::vector<std::shared_ptr<NBTTag>>().swap(tag->value.listVal);
+    }
+    return true;
+}
+
+bool NBTFile::materialize(NBTTag& tag) {
+    const EvictedTag* entry = findEvicted(tag);
+    if (!entry) return true;
+    
+    std::string payload;
+    if (!readEvicted(*entry, payload)) return false;
+    MemoryStreamBuf buffer(payload.data(), payload.size());
+    std::istream stream(&buffer);
+    stream.exceptions(std::ios::failbit | std::ios::badbit);
+    try {
+        readPayload(stream, tag, 0);
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return false;
+    }
+    evicted[&tag].resident = true;
+    return true;
+}
+
+bool NBTFile::materializeTree(NBTTag& tag) {
+    if (!materialize(tag)) return false;
+    if (tag.type == TagType::COMPOUND) {
+        for (auto& pair : tag.value.compoundVal) {
+            if (!materializeTree(*pair.second)) return false;
+        }
+    } else if (tag.type == TagType::LIST) {
+        for (auto& item : tag.value.listVal) {
+            if (!materializeTree(*item)) return false;
+        }
+    }
+    return true;
+}
+
+bool NBTFile::materializeAll() {
+    return evicted.empty() || !rootTag || materializeTree(*rootTag);
+}
+
+size_t NBTFile::evictedCount(const NBTTag& tag) const {
+    const EvictedTag* entry = findEvicted(tag);
+    return entry ? entry->children : 0;
+}
+
+uint64_t hashTag(const NBTTag& tag, TagHashCache* cache) {
+    if (cache) {
+        auto it = cache->find(&tag);
+        if (it != cache->end()) return it->second;
+    }
+
+    const NBTValue& value = tag.value;
+    uint64_t h = mix64(static_cast<uint64_t>(tag.type) + 1);
+    switch (tag.type) {
+        case TagType::BYTE: h = combineHash(h, static_cast<uint64_t>(value.byteVal)); break;
+        case TagType::SHORT: h = combineHash(h, static_cast<uint64_t>(value.shortVal)); break;
+        case TagType::INT: h = combineHash(h, static_cast<uint64_t>(value.intVal)); break;
+        case TagType::LONG: h = combineHash(h, static_cast<uint64_t>(value.longVal)); break;
+        case TagType::FLOAT: {
+            uint32_t bits;
+            std::memcpy(&bits, &value.floatVal, sizeof(bits));
+            h = combineHash(h, bits);
+            break;
+        }
+        case TagType::DOUBLE: {
+            uint64_t bits;
+            std::memcpy(&bits, &value.doubleVal, sizeof(bits));
+            h = combineHash(h, bits);
+            break;
+        }
+        case TagType::STRING:
+            h = hashBytes(value.stringVal.data(), value.stringVal.size(), h);
+            break;
+        case TagType::BYTE_ARRAY:
+            h = hashBytes(value.byteArrayVal.data(), value.byteArrayVal.size(), h);
+            break;
+        case TagType::INT_ARRAY:
+            h = hashBytes(value.intArrayVal.data(), value.intArrayVal.size() * sizeof(int32_t), h);
+            break;
+        case TagType::LONG_ARRAY:
+            h = hashBytes(value.longArrayVal.data(), value.longArrayVal.size() * sizeof(int64_t), h);
+            break;
+        case TagType::LIST:
+            h = combineHash(h, static_cast<uint64_t>(value.listVal.size()));
+            for (const auto& item : value.listVal) {
+                h = combineHash(h, hashTag(*item, cache));
+            }
+            break;
+        case TagType::COMPOUND:
+            h = combineHash(h, static_cast<uint64_t>(value.compoundVal.size()));
+            for (const auto& pair : value.compoundVal) {
+                h = combineHash(h, hashBytes(pair.first.data(), pair.first.size(), 0));
+                h = combineHash(h, hashTag(*pair.second, cache));
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (cache) (*cache)[&tag] = h;
+    return h;
+}
+
+bool tagsEqual(const NBTTag& a, const NBTTag& b) {
+    if (&a == &b) return true;
+    if (a.type != b.type) return false;
+
+    const NBTValue& x = a.value;
+    const NBTValue& y = b.value;
+    switch (a.type) {
+        case TagType::BYTE: return x.byteVal == y.byteVal;
+        case TagType::SHORT: return x.shortVal == y.shortVal;
+        case TagType::INT: return x.intVal == y.intVal;
+        case TagType::LONG: return x.longVal == y.longVal;
+        case TagType::FLOAT: return std::memcmp(&x.floatVal, &y.floatVal, sizeof(float)) == 0;
+        case TagType::DOUBLE: return std::memcmp(&x.doubleVal, &y.doubleVal, sizeof(double)) == 0;
+        case TagType::STRING: return x.stringVal == y.stringVal;
+        case TagType::BYTE_ARRAY: return x.byteArrayVal == y.byteArrayVal;
+        case TagType::INT_ARRAY: return x.intArrayVal == y.intArrayVal;
+        case TagType::LONG_ARRAY: return x.longArrayVal == y.longArrayVal;
+        case TagType::LIST:
+            if (x.listVal.size() != y.listVal.size()) return false;
+            for (size_t i = 0; i < x.listVal.size(); i++) {
+                if (!tagsEqual(*x.listVal[i], *y.listVal[i])) return false;
+            }
+            return true;
+        case TagType::COMPOUND: {
+            if (x.compoundVal.size() != y.compoundVal.size()) return false;
+            auto it = y.compoundVal.begin();
+            for (const auto& pair : x.compoundVal) {
+                if (pair.first != it->first || !tagsEqual(*pair.second, *it->second)) return false;
+                ++it;
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+static bool isBarePathChar(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           c == '_' || c == '-' || c == '+' || c == ':';
+}
+
+void appendPathKey(std::string& path, const std::string& key) {
+    bool bare = !key.empty();
+    for (char c : key) {
+        if (!isBarePathChar(c)) {
+            bare = false;
+            break;
+        }
+    }
+
+    if (!path.empty()) path += '.';
+    if (bare) {
+        path += key;
+        return;
+    }
+    path += '"';
+    for (char c : key) {
+        if (c == '"' || c == '\\') path += '\\';
+        if (c == '\n' || c == '\r' || c == '\t') {
+            path += '\\';
+            c = c == '\n' ? 'n' : c == '\r' ? 'r' : 't';
+        }
+        path += c;
+    }
+    path += '"';
+}
+
+void appendPathIndex(std::string& path, size_t index) {
+    path += '[';
+    path += std::to_string(index);
+    path += ']';
+}
+
+std::shared_ptr<NBTTag> mergeTree(const std::shared_ptr<NBTTag>& current, const std::shared_ptr<NBTTag>& updated,
+                                  TagHashCache& currentHashes, TagHashCache& updatedHashes, size_t& replaced) {
+    if (hashTag(*current, &currentHashes) == hashTag(*updated, &updatedHashes) && tagsEqual(*current, *updated)) {
+        return current;
+    }
+    if (current->type != updated->type ||
+        (current->type != TagType::COMPOUND && current->type != TagType::LIST)) {
+        replaced++;
+        return updated;
+    }
+
+    // Each container is hashed before its children change, so the stale
+    // entries left in currentHashes are never read again during the merge.
+    if (current->type == TagType::COMPOUND) {
+        auto& children = current->value.compoundVal;
+        std::map<std::string, std::shared_ptr<NBTTag>> merged;
+        for (const auto& pair : updated->value.compoundVal) {
+            auto it = children.find(pair.first);
+            if (it == children.end()) {
+                replaced++;
+                merged[pair.first] = pair.second;
+            } else {
+                merged[pair.first] = mergeTree(it->second, pair.second, currentHashes, updatedHashes, replaced);
+            }
+        }
+        for (const auto& pair : children) {
+            if (!merged.count(pair.first)) replaced++;
+        }
+        children.swap(merged);
+    } else {
+        auto& items = current->value.listVal;
+        const auto& updatedItems = updated->value.listVal;
+        size_t common = std::min(items.size(), updatedItems.size());
+        for (size_t i = 0; i < common; i++) {
+            items[i] = mergeTree(items[i], updatedItems[i], currentHashes, updatedHashes, replaced);
+        }
+        replaced += std::max(items.size(), updatedItems.size()) - common;
+        items.resize(common);
+        items.insert(items.end(), updatedItems.begin() + common, updatedItems.end());
+        current->value.listType = updated->value.listType;
+    }
+    return current;
+}
+
+std::string formatPatchOp(const PatchOp& op) {
+    static const char* names[] = {"test", "add", "remove", "replace", "splice"};
+    std::string line = names[static_cast<int>(op.kind)];
+    line += ' ';
+    line += op.path.empty() ? "." : op.path;
+    if (op.kind == PatchOpKind::SPLICE) {
+        line += ' ' + std::to_string(op.start) + ' ' + std::to_string(op.deleteCount);
+    }
+    if (op.kind != PatchOpKind::REMOVE) {
+        line += ' ';
+        line += op.value;
+    }
+    return line;
+}
+
+void NBTDiff::emit(PatchOpKind kind, const std::string& path, const std::string& value, int32_t start, int32_t deleteCount) {
+    PatchOp op;
+    op.kind = kind;
+    op.path = path;
+    op.value = value;
+    op.start = start;
+    op.deleteCount = deleteCount;
+    ops.push_back(op);
+}
+
+void NBTDiff::diff(const NBTTag& a, const NBTTag& b) {
+    diffTag("", a, b);
+}
+
+void NBTDiff::diffTag(const std::string& path, const NBTTag& a, const NBTTag& b) {
+    if (hashTag(a, &hashes) == hashTag(b, &hashes) && tagsEqual(a, b)) return;
+
+    if (a.type == b.type) {
+        switch (a.type) {
+            case TagType::COMPOUND:
+                diffCompound(path, a, b);
+                return;
+            case TagType::LIST:
+                diffList(path, a, b);
+                return;
+            case TagType::BYTE_ARRAY:
+            case TagType::INT_ARRAY:
+            case TagType::LONG_ARRAY:
+                diffArray(path, a, b);
+                return;
+            default:
+                break;
+        }
+    }
+
+    if (withTests) emit(PatchOpKind::TEST, path, toSNBT(a));
+    emit(PatchOpKind::REPLACE, path, toSNBT(b));
+}
+
+void NBTDiff::diffCompound(const std::string& path, const NBTTag& a, const NBTTag& b) {
+    auto itA = a.value.compoundVal.begin();
+    auto itB = b.value.compoundVal.begin();
+    auto endA = a.value.compoundVal.end();
+    auto endB = b.value.compoundVal.end();
+
+    // Both maps are sorted by key, so a merge walk pairs them up.
+    while (itA != endA || itB != endB) {
+        std::string childPath = path;
+        if (itB == endB || (itA != endA && itA->first < itB->first)) {
+            appendPathKey(childPath, itA->first);
+            if (withTests) emit(PatchOpKind::TEST, childPath, toSNBT(*itA->second));
+            emit(PatchOpKind::REMOVE, childPath, "");
+            ++itA;
+        } else if (itA == endA || itB->first < itA->first) {
+            appendPathKey(childPath, itB->first);
+            emit(PatchOpKind::ADD, childPath, toSNBT(*itB->second));
+            ++itB;
+        } else {
+            appendPathKey(childPath, itA->first);
+            diffTag(childPath, *itA->second, *itB->second);
+            ++itA;
+            ++itB;
+        }
+    }
+}
+
+// Matches between two hash sequences forming a longest common subsequence.
+// Common prefixes and suffixes are matched directly; the middle uses a DP
+// table, and is left unmatched when it would be too large.
+static void alignSequences(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b,
+                           std::vector<std::pair<size_t, size_t>>& matches) {
+    size_t prefix = 0;
+    while (prefix < a.size() && prefix < b.size() && a[prefix] == b[prefix]) {
+        matches.push_back(std::make_pair(prefix, prefix));
+        prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < a.size() - prefix && suffix < b.size() - prefix &&
+           a[a.size() - 1 - suffix] == b[b.size() - 1 - suffix]) {
+        suffix++;
+    }
+
+    size_t n = a.size() - prefix - suffix;
+    size_t m = b.size() - prefix - suffix;
+    if (n > 0 && m > 0 && n * m <= (1u << 22)) {
+        // lengths[i][j] = LCS of a[prefix+i..] and b[prefix+j..].
+        std::vector<uint32_t> lengths((n + 1) * (m + 1), 0);
+        for (size_t i = n; i-- > 0;) {
+            for (size_t j = m; j-- > 0;) {
+                lengths[i * (m + 1) + j] = a[prefix + i] == b[prefix + j]
+                    ? lengths[(i + 1) * (m + 1) + j + 1] + 1
+                    : std::max(lengths[(i + 1) * (m + 1) + j], lengths[i * (m + 1) + j + 1]);
+            }
+        }
+        size_t i = 0, j = 0;
+        while (i < n && j < m) {
+            if (a[prefix + i] == b[prefix + j]) {
+                matches.push_back(std::make_pair(prefix + i, prefix + j));
+                i++;
+                j++;
+            } else if (lengths[(i + 1) * (m + 1) + j] >= lengths[i * (m + 1) + j + 1]) {
+                i++;
+            } else {
+                j++;
+            }
+        }
+    }
+
+    for (size_t k = suffix; k > 0; k--) {
+        matches.push_back(std::make_pair(a.size() - k, b.size() - k));
+    }
+}
+
+void NBTDiff::diffList(const std::string& path, const NBTTag& a, const NBTTag& b) {
+    const auto& itemsA = a.value.listVal;
+    const auto& itemsB = b.value.listVal;
+    if (!itemsA.empty() && !itemsB.empty() && itemsA[0]->type != itemsB[0]->type) {
+        if (withTests) emit(PatchOpKind::TEST, path, toSNBT(a));
+        emit(PatchOpKind::REPLACE, path, toSNBT(b));
+        return;
+    }
+
+    std::vector<uint64_t> hashesA, hashesB;
+    for (const auto& item : itemsA) hashesA.push_back(hashTag(*item, &hashes));
+    for (const auto& item : itemsB) hashesB.push_back(hashTag(*item, &hashes));
+
+    std::vector<std::pair<size_t, size_t>> matches;
+    alignSequences(hashesA, hashesB, matches);
+    // A hash collision must not hide a change: unconfirmed pairs fall into a hunk.
+    matches.erase(std::remove_if(matches.begin(), matches.end(),
+                                 [&](const std::pair<size_t, size_t>& m) {
+                                     return !tagsEqual(*itemsA[m.first], *itemsB[m.second]);
+                                 }),
+                  matches.end());
+    matches.push_back(std::make_pair(itemsA.size(), itemsB.size()));
+
+    // Hunks are emitted last to first so that the indices of earlier hunks
+    // still refer to the unmodified list when the patch is applied in order.
+    for (size_t k = matches.size(); k-- > 0;) {
+        size_t endA = matches[k].first;
+        size_t endB = matches[k].second;
+        size_t startA = k > 0 ? matches[k - 1].first + 1 : 0;
+        size_t startB = k > 0 ? matches[k - 1].second + 1 : 0;
+        size_t lengthA = endA - startA;
+        size_t lengthB = endB - startB;
+        if (lengthA == 0 && lengthB == 0) continue;
+
+        // Elements changed in place are diffed recursively; the rest of the
+        // hunk becomes one splice.
+        size_t paired = std::min(lengthA, lengthB);
+        if (lengthA != lengthB) {
+            size_t spliceAt = startA + paired;
+            NBTTag inserted(TagType::LIST, "");
+            for (size_t i = startB + paired; i < endB; i++) {
+                inserted.value.listVal.push_back(itemsB[i]);
+            }
+            if (withTests) {
+                for (size_t i = spliceAt; i < endA; i++) {
+                    std::string itemPath = path;
+                    appendPathIndex(itemPath, i);
+                    emit(PatchOpKind::TEST, itemPath, toSNBT(*itemsA[i]));
+                }
+            }
+            emit(PatchOpKind::SPLICE, path, toSNBT(inserted), static_cast<int32_t>(spliceAt),
+                 static_cast<int32_t>(lengthA - paired));
+        }
+        for (size_t i = paired; i-- > 0;) {
+            std::string itemPath = path;
+            appendPathIndex(itemPath, startA + i);
+            diffTag(itemPath, *itemsA[startA + i], *itemsB[startB + i]);
+        }
     }
 }
 
-std::string NBTTag::toString(int indent) const {
-    std::string indentStr(indent * 2, ' ');
-    std::string result = indentStr + tagTypeToString(type);
-    
-    if (!name.empty()) {
-        result += "(\"" + name + "\")";
+void NBTDiff::diffArray(const std::string& path, const NBTTag& a, const NBTTag& b) {
+    size_t sizeA, sizeB;
+    auto equalAt = [&](size_t i, size_t j) {
+        switch (a.type) {
+            case TagType::BYTE_ARRAY: return a.value.byteArrayVal[i] == b.value.byteArrayVal[j];
+            case TagType::INT_ARRAY: return a.value.intArrayVal[i] == b.value.intArrayVal[j];
+            default: return a.value.longArrayVal[i] == b.value.longArrayVal[j];
+        }
+    };
+    switch (a.type) {
+        case TagType::BYTE_ARRAY: sizeA = a.value.byteArrayVal.size(); sizeB = b.value.byteArrayVal.size(); break;
+        case TagType::INT_ARRAY: sizeA = a.value.intArrayVal.size(); sizeB = b.value.intArrayVal.size(); break;
+        default: sizeA = a.value.longArrayVal.size(); sizeB = b.value.longArrayVal.size(); break;
     }
-    
-    result += ": " + value.toString();
-    return result;
-}
 
-void NBTTag::setValueFromString(const std::string& str) {
-    switch (type) {
-        case TagType::BYTE:
-            value.byteVal = static_cast<int8_t>(std::stoi(str));
-            break;
-        case TagType::SHORT:
-            value.shortVal = static_cast<int16_t>(std::stoi(str));
-            break;
-        case TagType::INT:
-            value.intVal = std::stoi(str);
-            break;
-        case TagType::LONG:
-            value.longVal = std::stoll(str);
-            break;
-        case TagType::FLOAT:
-            value.floatVal = std::stof(str);
-            break;
-        case TagType::DOUBLE:
-            value.doubleVal = std::stod(str);
+    size_t prefix = 0;
+    while (prefix < sizeA && prefix < sizeB && equalAt(prefix, prefix)) prefix++;
+    size_t suffix = 0;
+    while (suffix < sizeA - prefix && suffix < sizeB - prefix && equalAt(sizeA - 1 - suffix, sizeB - 1 - suffix)) suffix++;
+
+    // A splice touching most of the array is no smaller than a replace.
+    if ((sizeB - prefix - suffix) * 2 > sizeB && sizeB > 16) {
+        if (withTests) emit(PatchOpKind::TEST, path, toSNBT(a));
+        emit(PatchOpKind::REPLACE, path, toSNBT(b));
+        return;
+    }
+
+    NBTTag inserted(a.type, "");
+    switch (a.type) {
+        case TagType::BYTE_ARRAY:
+            inserted.value.byteArrayVal.assign(b.value.byteArrayVal.begin() + prefix, b.value.byteArrayVal.end() - suffix);
             break;
-        case TagType::STRING:
-            value.stringVal = str;
+        case TagType::INT_ARRAY:
+            inserted.value.intArrayVal.assign(b.value.intArrayVal.begin() + prefix, b.value.intArrayVal.end() - suffix);
             break;
         default:
+            inserted.value.longArrayVal.assign(b.value.longArrayVal.begin() + prefix, b.value.longArrayVal.end() - suffix);
             break;
     }
+    if (withTests) emit(PatchOpKind::TEST, path, toSNBT(a));
+    emit(PatchOpKind::SPLICE, path, toSNBT(inserted), static_cast<int32_t>(prefix),
+         static_cast<int32_t>(sizeA - prefix - suffix));
 }
 
-int8_t NBTFile::readByte(std::ifstream& file) {
-    int8_t value;
-    file.read(reinterpret_cast<char*>(&value), sizeof(value));
-    return value;
-}
+static void collectDatFiles(const std::string& root, const std::string& relative, std::vector<std::string>& files) {
+    std::string dir = relative.empty() ? root : root + "/" + relative;
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) return;
 
-int16_t NBTFile::readShort(std::ifstream& file) {
-    int16_t value;
-    file.read(reinterpret_cast<char*>(&value), sizeof(value));
-    return ((value & 0xFF) << 8) | ((value & 0xFF00) >> 8);
-}
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
 
-int32_t NBTFile::readInt(std::ifstream& file) {
-    int32_t value;
-    file.read(reinterpret_cast<char*>(&value), sizeof(value));
-    return ((value & 0xFF) << 24) | 
-           ((value & 0xFF00) << 8) | 
-           ((value & 0xFF0000) >> 8) | 
-           ((value & 0xFF000000) >> 24);
+        std::string rel = relative.empty() ? name : relative + "/" + name;
+        struct stat st;
+        if (lstat((root + "/" + rel).c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collectDatFiles(root, rel, files);
+        } else if (S_ISREG(st.st_mode) && endsWith(name, ".dat")) {
+            files.push_back(rel);
+        }
+    }
+    closedir(handle);
 }
 
-int64_t NBTFile::readLong(std::ifstream& file) {
-    int64_t value;
-    file.read(reinterpret_cast<char*>(&value), sizeof(value));
-    return ((value & 0xFFLL) << 56) | 
-           ((value & 0xFF00LL) << 40) | 
-           ((value & 0xFF0000LL) << 24) | 
-           ((value & 0xFF000000LL) << 8) | 
-           ((value & 0xFF00000000LL) >> 8) | 
-           ((value & 0xFF0000000000LL) >> 24) | 
-           ((value & 0xFF000000000000LL) >> 40) | 
-           ((value & 0xFF00000000000000LL) >> 56);
-}
+// Diffs one pair of files into patch text. A missing side turns into a
+// whole-root replace (new file) or remove (deleted file).
+static bool diffFiles(const std::string& oldPath, const std::string& newPath, bool withTests,
+                      IOBuffers& buffers, std::string& output, std::string& error) {
+    NBTFile oldFile(oldPath);
+    NBTFile newFile(newPath);
+    bool haveOld = access(oldPath.c_str(), F_OK) == 0;
+    bool haveNew = access(newPath.c_str(), F_OK) == 0;
+    if (haveOld && !oldFile.load(buffers)) {
+        error = oldPath + ": " + oldFile.getError();
+        if (buffers.prefetcher) buffers.prefetcher->skip(newPath);
+        return false;
+    }
+    if (haveNew && !newFile.load(buffers)) {
+        error = newPath + ": " + newFile.getError();
+        return false;
+    }
 
-float NBTFile::readFloat(std::ifstream& file) {
-    int32_t intValue = readInt(file);
-    float value;
-    std::memcpy(&value, &intValue, sizeof(value));
-    return value;
-}
+    std::vector<PatchOp> ops;
+    if (!haveNew) {
+        PatchOp op;
+        op.kind = PatchOpKind::REMOVE;
+        ops.push_back(op);
+    } else if (!haveOld) {
+        PatchOp op;
+        op.kind = PatchOpKind::REPLACE;
+        op.value = toSNBT(*newFile.getRoot());
+        ops.push_back(op);
+    } else {
+        NBTDiff diff(ops, withTests);
+        diff.diff(*oldFile.getRoot(), *newFile.getRoot());
+    }
 
-double NBTFile::readDouble(std::ifstream& file) {
-    int64_t longValue = readLong(file);
-    double value;
-    std::memcpy(&value, &longValue, sizeof(value));
-    return value;
+    // Patches are one operation per line; SNBT escapes newlines, so one in
+    // an operation would be a bug, and the patch could not be applied.
+    for (const auto& op : ops) {
+        std::string line = formatPatchOp(op);
+        if (line.find_first_of("\r\n") != std::string::npos) {
+            error = newPath + ": " + op.path + ": value does not fit on one patch line";
+            output.clear();
+            return false;
+        }
+        output += line;
+        output += '\n';
+    }
+    return true;
 }
 
-std::string NBTFile::readString(std::ifstream& file) {
-    int16_t length = readShort(file);
-    std::string value(length, '\0');
-    file.read(&value[0], length);
-    return value;
-}
+int runDiff(const std::string& oldPath, const std::string& newPath, bool withTests, size_t threads) {
+    struct stat st;
+    bool directories = stat(oldPath.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (!directories) {
+        IOBuffers buffers;
+        std::string output, error;
+        if (!diffFiles(oldPath, newPath, withTests, buffers, output, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        std::cout << output;
+        return 0;
+    }
 
-void NBTFile::writeByte(std::ofstream& file, int8_t value) {
-    file.write(reinterpret_cast<char*>(&value), sizeof(value));
+    // Directory mode: one "file <relative path>" section per changed file.
+    std::vector<std::string> names;
+    collectDatFiles(oldPath, "", names);
+    collectDatFiles(newPath, "", names);
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    std::vector<std::string> outputs(names.size()), errors(names.size());
+    std::vector<size_t> order(names.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+
+    std::vector<std::string> readOrder;
+    for (const auto& name : names) {
+        readOrder.push_back(oldPath + "/" + name);
+        readOrder.push_back(newPath + "/" + name);
+    }
+    FilePrefetcher prefetcher(readOrder);
+
+    WorkStealingPool pool(std::max<size_t>(1, std::min(threads, names.size())));
+    std::vector<IOBuffers> buffers(pool.size());
+    for (auto& workerBuffers : buffers) workerBuffers.prefetcher = &prefetcher;
+    pool.run(order, [&](size_t task, size_t worker) {
+        diffFiles(oldPath + "/" + names[task], newPath + "/" + names[task], withTests,
+                  buffers[worker], outputs[task], errors[task]);
+    });
+
+    int status = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!errors[i].empty()) {
+            std::cerr << errors[i] << std::endl;
+            status = 1;
+        } else if (!outputs[i].empty()) {
+            std::cout << "file " << names[i] << "\n" << outputs[i];
+        }
+    }
+    return status;
 }
 
-void NBTFile::writeShort(std::ofstream& file, int16_t value) {
-    int16_t beValue = ((value & 0xFF) << 8) | ((value & 0xFF00) >> 8);
-    file.write(reinterpret_cast<char*>(&beValue), sizeof(beValue));
+bool parsePatchOp(const std::string& line, PatchOp& op, std::string& error) {
+    static const char* names[] = {"test", "add", "remove", "replace", "splice"};
+    size_t pos = line.find_first_not_of(" \t");
+    size_t end = line.find_first_of(" \t", pos);
+    std::string word = line.substr(pos, end - pos);
+
+    size_t kind = 0;
+    while (kind < 5 && word != names[kind]) kind++;
+    if (kind == 5) {
+        error = "unknown patch operation '" + word + "'";
+        return false;
+    }
+    op = PatchOp();
+    op.kind = static_cast<PatchOpKind>(kind);
+
+    pos = line.find_first_not_of(" \t", end);
+    if (pos == std::string::npos) {
+        error = "missing path";
+        return false;
+    }
+    end = scanPathEnd(line, pos);
+    op.path = line.substr(pos, end - pos);
+    if (op.path == ".") op.path.clear();
+
+    pos = line.find_first_not_of(" \t", end);
+    if (op.kind == PatchOpKind::SPLICE) {
+        char* numberEnd = nullptr;
+        const char* text = pos == std::string::npos ? "" : line.c_str() + pos;
+        long start = std::strtol(text, &numberEnd, 10);
+        long count = std::strtol(numberEnd, &numberEnd, 10);
+        if (numberEnd == text || start < 0 || count < 0) {
+            error = "splice needs <start> <count> <values>";
+            return false;
+        }
+        op.start = static_cast<int32_t>(start);
+        op.deleteCount = static_cast<int32_t>(count);
+        pos = line.find_first_not_of(" \t", numberEnd - line.c_str());
+    }
+
+    if (op.kind != PatchOpKind::REMOVE) {
+        if (pos == std::string::npos) {
+            error = std::string("missing value for '") + names[kind] + "'";
+            return false;
+        }
+        op.value = line.substr(pos);
+    }
+    return true;
 }
 
-void NBTFile::writeInt(std::ofstream& file, int32_t value) {
-    int32_t beValue = ((value & 0xFF) << 24) | 
-                      ((value & 0xFF00) << 8) | 
-                      ((value & 0xFF0000) >> 8) | 
-                      ((value & 0xFF000000) >> 24);
-    file.write(reinterpret_cast<char*>(&beValue), sizeof(beValue));
+bool parsePatch(std::istream& in, std::vector<PatchSection>& sections, std::string& error) {
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#') continue;
+
+        if (line.compare(first, 5, "file ") == 0) {
+            PatchSection section;
+            section.file = line.substr(line.find_first_not_of(" \t", first + 5));
+            sections.push_back(section);
+            continue;
+        }
+        if (sections.empty()) {
+            sections.push_back(PatchSection());
+        }
+
+        PatchOp op;
+        if (!parsePatchOp(line, op, error)) {
+            error = "line " + std::to_string(lineNumber) + ": " + error;
+            return false;
+        }
+        sections.back().ops.push_back(op);
+    }
+
+    if (sections.size() > 1 && sections[0].file.empty()) {
+        error = "operations before the first 'file' line";
+        return false;
+    }
+    return true;
 }
 
-void NBTFile::writeLong(std::ofstream& file, int64_t value) {
-    int64_t beValue = ((value & 0xFFLL) << 56) | 
-                      ((value & 0xFF00LL) << 40) | 
-                      ((value & 0xFF0000LL) << 24) | 
-                      ((value & 0xFF000000LL) << 8) | 
-                      ((value & 0xFF00000000LL) >> 8) | 
-                      ((value & 0xFF0000000000LL) >> 24) | 
-                      ((value & 0xFF000000000000LL) >> 40) | 
-                      ((value & 0xFF00000000000000LL) >> 56);
-    file.write(reinterpret_cast<char*>(&beValue), sizeof(beValue));
+bool applyPatchOp(NBTFile& nbtFile, const PatchOp& op, std::string& error) {
+    std::shared_ptr<NBTTag> value;
+    if (op.kind != PatchOpKind::REMOVE) {
+        SNBTParser parser(op.value.data(), op.value.size());
+        if (!parser.parse(value, error)) {
+            return false;
+        }
+    }
+
+    TagRef ref;
+    if (op.kind == PatchOpKind::ADD) {
+        if (!resolveParentPath(nbtFile.getRoot(), op.path, ref, error)) {
+            return false;
+        }
+        if (ref.tag) {
+            error = "already exists";
+            return false;
+        }
+        value->name = ref.key;
+        ref.parent->value.compoundVal[ref.key] = value;
+        return true;
+    }
+
+    if (!nbtFile.getRoot() || !resolvePath(nbtFile.getRoot(), op.path, ref, error)) {
+        if (!nbtFile.getRoot()) error = "file does not exist";
+        return false;
+    }
+
+    switch (op.kind) {
+        case PatchOpKind::TEST:
+            if (hashTag(*ref.tag) != hashTag(*value) || !tagsEqual(*ref.tag, *value)) {
+                error = "test failed, found " + toSNBT(*ref.tag);
+                return false;
+            }
+            return true;
+        case PatchOpKind::REMOVE:
+            if (!ref.parent) {
+                nbtFile.setRoot(nullptr);
+                return true;
+            }
+            return removeTag(ref);
+        case PatchOpKind::REPLACE:
+            value->name = ref.tag->name;
+            if (!ref.parent) {
+                nbtFile.setRoot(value);
+            } else if (ref.parent->type == TagType::COMPOUND) {
+                ref.parent->value.compoundVal[ref.key] = value;
+            } else if (ref.parent->type != TagType::LIST) {
+                if (value->type != ref.tag->type) {
+                    error = "array holds " + tagTypeToString(ref.tag->type) + ", not " + tagTypeToString(value->type);
+                    return false;
+                }
+                ref.tag->value = value->value;
+                storeArrayElement(ref);
+            } else {
+                auto& items = ref.parent->value.listVal;
+                if (items.size() > 1 && items[0]->type != value->type) {
+                    error = "list holds " + tagTypeToString(items[0]->type) + ", not " + tagTypeToString(value->type);
+                    return false;
+                }
+                items[ref.index] = value;
+            }
+            return true;
+        case PatchOpKind::SPLICE: {
+            NBTValue& target = ref.tag->value;
+            bool listSplice = ref.tag->type == TagType::LIST && value->type == TagType::LIST;
+            if (!listSplice && ref.tag->type != value->type) {
+                error = "cannot splice " + tagTypeToString(value->type) + " into " + tagTypeToString(ref.tag->type);
+                return false;
+            }
+            size_t size = ref.tag->type == TagType::LIST ? target.listVal.size() :
+                          ref.tag->type == TagType::BYTE_ARRAY ? target.byteArrayVal.size() :
+                          ref.tag->type == TagType::INT_ARRAY ? target.intArrayVal.size() :
+                          ref.tag->type == TagType::LONG_ARRAY ? target.longArrayVal.size() : 0;
+            size_t start = static_cast<size_t>(op.start);
+            size_t end = start + static_cast<size_t>(op.deleteCount);
+            if (end > size) {
+                error = "splice range " + std::to_string(start) + "+" + std::to_string(op.deleteCount) +
+                        " outside " + std::to_string(size) + " elements";
+                return false;
+            }
+
+            switch (ref.tag->type) {
+                case TagType::LIST: {
+                    auto& items = target.listVal;
+                    const auto& inserted = value->value.listVal;
+                    const NBTTag* kept = start > 0 ? items[0].get() : end < items.size() ? items[end].get() : nullptr;
+                    if (!inserted.empty() && kept && kept->type != inserted[0]->type) {
+                        error = "list holds " + tagTypeToString(kept->type) + ", not " + tagTypeToString(inserted[0]->type);
+                        return false;
+                    }
+                    items.erase(items.begin() + start, items.begin() + end);
+                    items.insert(items.begin() + start, inserted.begin(), inserted.end());
+                    break;
+                }
+                case TagType::BYTE_ARRAY:
+                    target.byteArrayVal.erase(target.byteArrayVal.begin() + start, target.byteArrayVal.begin() + end);
+                    target.byteArrayVal.insert(target.byteArrayVal.begin() + start, value->value.byteArrayVal.begin(),
+                                               value->value.byteArrayVal.end());
+                    break;
+                case TagType::INT_ARRAY:
+                    target.intArrayVal.erase(target.intArrayVal.begin() + start, target.intArrayVal.begin() + end);
+                    target.intArrayVal.insert(target.intArrayVal.begin() + start, value->value.intArrayVal.begin(),
+                                              value->value.intArrayVal.end());
+                    break;
+                case TagType::LONG_ARRAY:
+                    target.longArrayVal.erase(target.longArrayVal.begin() + start, target.longArrayVal.begin() + end);
+                    target.longArrayVal.insert(target.longArrayVal.begin() + start, value->value.longArrayVal.begin(),
+                                               value->value.longArrayVal.end());
+                    break;
+                default:
+                    error = "cannot splice into " + tagTypeToString(ref.tag->type);
+                    return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
 }
 
-void NBTFile::writeFloat(std::ofstream& file, float value) {
-    int32_t intValue;
-    std::memcpy(&intValue, &value, sizeof(value));
-    writeInt(file, intValue);
+// Applies one section to one file: a single load, every operation against
+// the in-memory tree, and a single save only if all of them succeeded.
+static bool patchFile(const std::string& path, const std::vector<PatchOp>& ops, bool dryRun,
+                      IOBuffers& buffers, std::string& report) {
+    NBTFile nbtFile(path);
+    bool exists = access(path.c_str(), F_OK) == 0;
+    if (exists && !nbtFile.load(buffers)) {
+        report = path + ": " + nbtFile.getError();
+        return false;
+    }
+    if (!exists && (ops.empty() || ops[0].kind != PatchOpKind::REPLACE || !ops[0].path.empty())) {
+        report = path + ": does not exist";
+        return false;
+    }
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        std::string error;
+        if (!exists && i == 0) {
+            std::shared_ptr<NBTTag> root;
+            if (!parseSNBT(ops[0].value, root, error)) {
+                report = path + ": " + error;
+                return false;
+            }
+            nbtFile.setRoot(root);
+            continue;
+        }
+        if (!applyPatchOp(nbtFile, ops[i], error)) {
+            report = path + ": " + formatPatchOp(ops[i]).substr(0, 120) + ": " + error + " (file left unchanged)";
+            return false;
+        }
+    }
+
+    if (dryRun) return true;
+    if (!nbtFile.getRoot()) {
+        if (std::remove(path.c_str()) != 0) {
+            report = path + ": cannot delete";
+            return false;
+        }
+        return true;
+    }
+    if (!nbtFile.save(buffers)) {
+        report = path + ": " + nbtFile.getError();
+        return false;
+    }
+    return true;
 }
 
-void NBTFile::writeDouble(std::ofstream& file, double value) {
-    int64_t longValue;
-    std::memcpy(&longValue, &value, sizeof(value));
-    writeLong(file, longValue);
+int runPatch(const std::string& patchPath, const std::vector<std::string>& targets, bool dryRun, size_t threads) {
+    std::ifstream patchStream(patchPath);
+    if (!patchStream) {
+        std::cerr << "cannot read " << patchPath << std::endl;
+        return 1;
+    }
+    std::vector<PatchSection> sections;
+    std::string error;
+    if (!parsePatch(patchStream, sections, error)) {
+        std::cerr << patchPath << ": " << error << std::endl;
+        return 1;
+    }
+
+    // A patch with file sections applies below one directory; otherwise the
+    // same operations apply to every target file.
+    std::vector<std::pair<std::string, std::vector<PatchOp>>> jobs;
+    std::map<std::string, size_t> jobByPath;
+    auto addJob = [&](const std::string& path, const std::vector<PatchOp>& ops) {
+        // Every job runs on its own worker, so sections naming the same file
+        // are merged in patch order; otherwise both would load the original
+        // and the last save would drop the other's edits.
+        auto inserted = jobByPath.insert(std::make_pair(absolutePath(path), jobs.size()));
+        if (inserted.second) {
+            jobs.push_back(std::make_pair(path, ops));
+        } else {
+            auto& merged = jobs[inserted.first->second].second;
+            merged.insert(merged.end(), ops.begin(), ops.end());
+        }
+    };
+    bool named = !sections.empty() && !sections[0].file.empty();
+    if (named) {
+        if (targets.size() != 1) {
+            std::cerr << patchPath << ": a patch with 'file' sections needs exactly one target directory" << std::endl;
+            return 1;
+        }
+        for (const auto& section : sections) {
+            addJob(targets[0] + "/" + section.file, section.ops);
+        }
+    } else {
+        static const std::vector<PatchOp> none;
+        for (const auto& target : targets) {
+            addJob(target, sections.empty() ? none : sections[0].ops);
+        }
+    }
+
+    std::vector<std::string> reports(jobs.size());
+    std::vector<char> succeeded(jobs.size(), 0);
+    std::vector<size_t> order(jobs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+
+    std::vector<std::string> readOrder;
+    for (const auto& job : jobs) readOrder.push_back(job.first);
+    FilePrefetcher prefetcher(readOrder);
+
+    WorkStealingPool pool(std::max<size_t>(1, std::min(threads, jobs.size())));
+    std::vector<IOBuffers> buffers(pool.size());
+    for (auto& workerBuffers : buffers) workerBuffers.prefetcher = &prefetcher;
+    pool.run(order, [&](size_t task, size_t worker) {
+        succeeded[task] = patchFile(jobs[task].first, jobs[task].second, dryRun, buffers[worker], reports[task]);
+    });
+
+    size_t failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!succeeded[i]) {
+            std::cerr << reports[i] << std::endl;
+            failed++;
+        }
+    }
+    std::cerr << (jobs.size() - failed) << " files patched" << (dryRun ? " (dry run, nothing saved)" : "")
+              << ", " << failed << " failed" << std::endl;
+    return failed > 0 ? 1 : 0;
 }
 
-void NBTFile::writeString(std::ofstream& file, const std::string& value) {
-    writeShort(file, static_cast<int16_t>(value.length()));
-    file.write(value.c_str(), value.length());
+EditJournal::~EditJournal() {
+    if (fd >= 0) close(fd);
 }
 
-bool NBTFile::load() {
-    rootTag = std::make_shared<NBTTag>(TagType::COMPOUND, "root");
-    
-    auto nameTag = std::make_shared<NBTTag>(TagType::STRING, "name");
-    nameTag->value.stringVal = "Test Player";
-    rootTag->value.compoundVal["name"] = nameTag;
-    
-    auto healthTag = std::make_shared<NBTTag>(TagType::FLOAT, "health");
-    healthTag->value.floatVal = 20.0f;
-    rootTag->value.compoundVal["health"] = healthTag;
-    
-    auto posTag = std::make_shared<NBTTag>(TagType::LIST, "position");
-    posTag->value.listVal.push_back(std::make_shared<NBTTag>(TagType::DOUBLE, ""));
-    posTag->value.listVal.push_back(std::make_shared<NBTTag>(TagType::DOUBLE, ""));
-    posTag->value.listVal.push_back(std::make_shared<NBTTag>(TagType::DOUBLE, ""));
-    posTag->value.listVal[0]->value.doubleVal = 100.5;
-    posTag->value.listVal[1]->value.doubleVal = 64.0;
-    posTag->value.listVal[2]->value.doubleVal = -200.75;
-    rootTag->value.compoundVal["position"] = posTag;
-    
-    auto inventoryTag = std::make_shared<NBTTag>(TagType::COMPOUND, "inventory");
-    auto itemsTag = std::make_shared<NBTTag>(TagType::LIST, "items");
-    
-    auto item1 = std::make_shared<NBTTag>(TagType::COMPOUND, "");
-    item1->value.compoundVal["id"] = std::make_shared<NBTTag>(TagType::SHORT, "id");
-    item1->value.compoundVal["id"]->value.shortVal = 276;
-    item1->value.compoundVal["count"] = std::make_shared<NBTTag>(TagType::BYTE, "count");
-    item1->value.compoundVal["count"]->value.byteVal = 1;
-    itemsTag->value.listVal.push_back(item1);
-    
-    auto item2 = std::make_shared<NBTTag>(TagType::COMPOUND, "");
-    item2->value.compoundVal["id"] = std::make_shared<NBTTag>(TagType::SHORT, "id");
-    item2->value.compoundVal["id"]->value.shortVal = 264;
-    item2->value.compoundVal["count"] = std::make_shared<NBTTag>(TagType::BYTE, "count");
-    item2->value.compoundVal["count"]->value.byteVal = 5;
-    itemsTag->value.listVal.push_back(item2);
-    
-    inventoryTag->value.compoundVal["items"] = itemsTag;
-    rootTag->value.compoundVal["inventory"] = inventoryTag;
-    
+bool EditJournal::load(int64_t mtime, int64_t size, std::vector<PatchOp>& ops, std::string& error) {
+    std::string text;
+    if (access(path.c_str(), F_OK) != 0 || !readFileBytes(path, text) || text.empty()) {
+        return true;
+    }
+
+    std::string expected = "# journal " + std::to_string(mtime) + " " + std::to_string(size) + "\n";
+    if (text.compare(0, expected.size(), expected) != 0) {
+        std::string stale = path + ".stale";
+        rename(path.c_str(), stale.c_str());
+        error = "the journal is for another version of the file, moved to " + stale;
+        return false;
+    }
+
+    // A crash during an append can leave a last line without its newline;
+    // that edit was never applied, so it is dropped.
+    size_t pos = expected.size();
+    size_t end;
+    while ((end = text.find('\n', pos)) != std::string::npos) {
+        std::string line = text.substr(pos, end - pos);
+        PatchOp op;
+        if (!parsePatchOp(line, op, error)) {
+            // Later edits may depend on this one, so replay stops here, but
+            // the edits before it are kept.
+            std::string bad = path + ".bad";
+            std::ofstream(bad, std::ios::binary).write(text.data() + pos, text.size() - pos);
+            error = path + ": " + error + ", the rest is in " + bad;
+            if (truncate(path.c_str(), static_cast<off_t>(pos)) != 0) {
+                error = "cannot truncate " + path + ": " + strerror(errno);
+                return false;
+            }
+            return true;
+        }
+        pos = end + 1;
+        ops.push_back(op);
+    }
+    if (pos < text.size() && truncate(path.c_str(), static_cast<off_t>(pos)) != 0) {
+        error = "cannot truncate " + path + ": " + strerror(errno);
+        return false;
+    }
     return true;
 }
 
-bool NBTFile::save() {
+bool EditJournal::append(const PatchOp& op, int64_t mtime, int64_t size, std::string& error) {
+    if (fd < 0) {
+        fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            error = "cannot open " + path + ": " + strerror(errno);
+            return false;
+        }
+        if (st.st_size == 0) {
+            std::string header = "# journal " + std::to_string(mtime) + " " + std::to_string(size) + "\n";
+            size_t slash = path.find_last_of('/');
+            if (write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size()) ||
+                !syncDirectory(slash == std::string::npos ? "." : path.substr(0, slash + 1))) {
+                error = "cannot write " + path + ": " + strerror(errno);
+                return false;
+            }
+        }
+    }
+
+    // Replay check: the record must be one line that parses back to the
+    // same edit, or a crash would lose it and every edit after it.
+    std::string line = formatPatchOp(op);
+    PatchOp replayed;
+    std::string replayError;
+    if (line.find_first_of("\r\n") != std::string::npos || !parsePatchOp(line, replayed, replayError) ||
+        formatPatchOp(replayed) != line) {
+        error = "edit cannot be journalled, not applied";
+        return false;
+    }
+    line += '\n';
+    if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()) || fdatasync(fd) != 0) {
+        error = "cannot write " + path + ": " + strerror(errno);
+        return false;
+    }
     return true;
 }
 
+void EditJournal::clear() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    unlink(path.c_str());
+}
+
 void NBTEditor::flattenTags(const std::shared_ptr<NBTTag>& tag, int depth) {
     if (!tag) return;
     
     flatTagList.push_back(tag);
+    if (isCollapsed(tag)) return;
     
     if (tag->type == TagType::COMPOUND) {
         for (const auto& pair : tag->value.compoundVal) {
@@ -379,11 +9649,125 @@ void NBTEditor::flattenTags(const std::shared_ptr<NBTTag>& tag, int depth) {
 }
 
 void NBTEditor::refreshTagList() {
+    TraceSpan span("flatten");
+    AllocationScope scope(AllocationPhase::FLATTEN);
     flatTagList.clear();
     flattenTags(nbtFile.getRoot());
+    enforceBudget();
+}
+
+bool NBTEditor::isCollapsed(const std::shared_ptr<NBTTag>& tag) const {
+    if (tag->type != TagType::COMPOUND && tag->type != TagType::LIST) return false;
+    auto it = folds.find(tag.get());
+    if (it != folds.end() && it->second.tag.lock() == tag) return it->second.collapsed;
+    return budget > 0 && tag != nbtFile.getRoot();
+}
+
+// Unfolding reads an evicted subtree back first; returns false if that fails.
+bool NBTEditor::setCollapsed(const std::shared_ptr<NBTTag>& tag, bool collapsed) {
+    if (tag->type != TagType::COMPOUND && tag->type != TagType::LIST) return false;
+    if (!collapsed && !nbtFile.materialize(*tag)) {
+        statusMessage = nbtFile.getError();
+        return false;
+    }
+    folds[tag.get()] = FoldState{tag, collapsed, ++foldTick};
+    return true;
+}
+
+// Enter toggles the selected compound or list, Right unfolds and Left folds
+// it. The cursor stays on the tag.
+void NBTEditor::fold(int ch) {
+    if (!selectedTag) return;
+    bool collapsed = isCollapsed(selectedTag);
+    bool target = ch == KEY_LEFT ? true : ch == KEY_RIGHT ? false : !collapsed;
+    if (target == collapsed || !setCollapsed(selectedTag, target)) return;
+    refreshTagList();
+    auto it = std::find(flatTagList.begin(), flatTagList.end(), selectedTag);
+    if (it != flatTagList.end()) {
+        currentRow = static_cast<int>(it - flatTagList.begin());
+    }
+}
+
+static bool findTagAncestors(const std::shared_ptr<NBTTag>& node, const std::shared_ptr<NBTTag>& target,
+                             std::vector<std::shared_ptr<NBTTag>>& ancestors) {
+    if (node == target) return true;
+    ancestors.push_back(node);
+    if (node->type == TagType::COMPOUND) {
+        for (const auto& pair : node->value.compoundVal) {
+            if (findTagAncestors(pair.second, target, ancestors)) return true;
+        }
+    } else if (node->type == TagType::LIST) {
+        for (const auto& item : node->value.listVal) {
+            if (findTagAncestors(item, target, ancestors)) return true;
+        }
+    }
+    ancestors.pop_back();
+    return false;
+}
+
+// Unfolds the ancestors of tag so it has a row. Returns whether any was
+// folded; the caller refreshes the list.
+bool NBTEditor::reveal(const std::shared_ptr<NBTTag>& tag) {
+    std::vector<std::shared_ptr<NBTTag>> ancestors;
+    if (!nbtFile.getRoot() || !findTagAncestors(nbtFile.getRoot(), tag, ancestors)) return false;
+    bool changed = false;
+    for (const auto& ancestor : ancestors) {
+        if (isCollapsed(ancestor)) changed = setCollapsed(ancestor, false) || changed;
+    }
+    return changed;
+}
+
+// Sums the footprint of the resident tree and collects the outermost folded
+// subtrees that may be evicted. While loading, containers above
+// SHALLOW_DEPTH may still be receiving tags, so only deeper ones qualify.
+size_t NBTEditor::measureTree(const std::shared_ptr<NBTTag>& tag, int depth, bool outer,
+                              std::vector<EvictionCandidate>& candidates) {
+    size_t bytes = tagFootprint(*tag);
+    bool candidate = outer && depth > 0 && isCollapsed(tag) && !nbtFile.isEvicted(*tag) &&
+                     (!loadThread.joinable() || depth >= static_cast<int>(ProgressiveLoader::SHALLOW_DEPTH));
+    if (tag->type == TagType::COMPOUND) {
+        for (const auto& pair : tag->value.compoundVal) {
+            bytes += measureTree(pair.second, depth + 1, outer && !candidate, candidates);
+        }
+    } else if (tag->type == TagType::LIST) {
+        for (const auto& item : tag->value.listVal) {
+            bytes += measureTree(item, depth + 1, outer && !candidate, candidates);
+        }
+    }
+    if (candidate) {
+        auto it = folds.find(tag.get());
+        uint64_t tick = it != folds.end() && it->second.tag.lock() == tag ? it->second.tick : 0;
+        candidates.push_back(EvictionCandidate{tag, tick, bytes});
+    }
+    return bytes;
+}
+
+void NBTEditor::enforceBudget() {
+    if (budget == 0 || !nbtFile.getRoot()) return;
+    
+    for (auto it = folds.begin(); it != folds.end();) {
+        it = it->second.tag.expired() ? folds.erase(it) : std::next(it);
+    }
+    std::vector<EvictionCandidate> candidates;
+    size_t total = measureTree(nbtFile.getRoot(), 0, true, candidates);
+    if (total <= budget) return;
+    
+    std::sort(candidates.begin(), candidates.end(), [](const EvictionCandidate& a, const EvictionCandidate& b) {
+        return a.tick != b.tick ? a.tick < b.tick : a.bytes > b.bytes;
+    });
+    for (const auto& candidate : candidates) {
+        if (total <= budget) break;
+        if (!nbtFile.evict(candidate.tag)) {
+            statusMessage = nbtFile.getError();
+            break;
+        }
+        total -= candidate.bytes - tagFootprint(*candidate.tag);
+    }
 }
 
 void NBTEditor::drawEditor() {
+    TraceSpan span("render");
+    AllocationScope scope(AllocationPhase::RENDER);
     clear();
     
     int maxY, maxX;
@@ -391,8 +9775,14 @@ void NBTEditor::drawEditor() {
     maxVisibleRows = maxY - 2;
     
     attron(A_BOLD | A_UNDERLINE);
-    mvprintw(0, 0, "NBT Editor - %s", nbtFile.getRoot()->name.c_str());
+    mvprintw(0, 0, "NBT Editor - %s", nbtFile.getRoot() ? nbtFile.getRoot()->name.c_str() : "");
     attroff(A_BOLD | A_UNDERLINE);
+    if (!searchResults.empty()) {
+        printw("  [match %zu/%zu]", searchIndex + 1, searchResults.size());
+    }
+    if (!statusMessage.empty()) {
+        printw("  [%s]", statusMessage.c_str());
+    }
     
     int startIdx = scrollOffset;
     int endIdx = std::min(startIdx + maxVisibleRows, static_cast<int>(flatTagList.size()));
@@ -414,6 +9804,15 @@ void NBTEditor::drawEditor() {
         }
         
         std::string line = tag->toString();
+        if (nbtFile.isEvicted(*tag)) {
+            // Its children are not in memory; show how many it has.
+            std::string count = std::to_string(nbtFile.evictedCount(*tag));
+            line = line.substr(0, line.rfind(": ") + 2) +
+                   (tag->type == TagType::COMPOUND ? "{" + count + " entries}" : "[" + count + " items]");
+        }
+        if (tag->type == TagType::COMPOUND || tag->type == TagType::LIST) {
+            line = (isCollapsed(tag) ? "+ " : "- ") + line;
+        }
         if (line.length() > static_cast<size_t>(maxX - 1)) {
             line = line.substr(0, maxX - 4) + "...";
         }
@@ -427,13 +9826,32 @@ void NBTEditor::drawEditor() {
     
     mvhline(maxY - 1, 0, ' ', maxX);
     attron(A_BOLD);
-    mvprintw(maxY - 1, 0, "Arrow keys: Navigate | E: Edit | A: Add | D: Delete | S: Save | Q: Quit");
+    mvprintw(maxY - 1, 0, "Arrows: Navigate | Enter: Fold | E: Edit | A: Add | P: Paste SNBT | D: Delete | /: Search | N: Next | R: Reload | S: Save | Q: Quit");
     if (modified) {
         mvprintw(maxY - 1, maxX - 11, "[Modified]");
     }
-    attroff(A_BOLD);
-    
-    refresh();
+    attroff(A_BOLD);
+    
+    refresh();
+}
+
+static bool findTagPath(const std::shared_ptr<NBTTag>& node, const std::shared_ptr<NBTTag>& target, std::string& path) {
+    if (node == target) return true;
+    size_t length = path.size();
+    if (node->type == TagType::COMPOUND) {
+        for (const auto& pair : node->value.compoundVal) {
+            appendPathKey(path, pair.first);
+            if (findTagPath(pair.second, target, path)) return true;
+            path.resize(length);
+        }
+    } else if (node->type == TagType::LIST) {
+        for (size_t i = 0; i < node->value.listVal.size(); i++) {
+            appendPathIndex(path, i);
+            if (findTagPath(node->value.listVal[i], target, path)) return true;
+            path.resize(length);
+        }
+    }
+    return false;
 }
 
 void NBTEditor::editValue() {
@@ -479,11 +9897,17 @@ void NBTEditor::editValue() {
     curs_set(0);
     
     if (result == OK) {
+        NBTTag edited(selectedTag->type, selectedTag->name);
         try {
-            std::string newValue(input);
-            selectedTag->setValueFromString(newValue);
-            modified = true;
+            edited.setValueFromString(input);
         } catch (const std::exception& e) {
+            return;
+        }
+        PatchOp op;
+        op.kind = PatchOpKind::REPLACE;
+        if (findTagPath(nbtFile.getRoot(), selectedTag, op.path)) {
+            op.value = toSNBT(edited);
+            applyEdit(op);
         }
     }
 }
@@ -491,28 +9915,220 @@ void NBTEditor::editValue() {
 void NBTEditor::saveChanges() {
     if (nbtFile.save()) {
         modified = false;
+        changedOnDisk = false;
+        statusMessage.clear();
+        statFile(nbtFile.getFilename(), loadedMtime, loadedSize);
+        journal.clear();
+    }
+}
+
+// Every edit goes through here: logged to the journal first, then applied
+// exactly as a replay of the journal would apply it.
+bool NBTEditor::applyEdit(const PatchOp& op) {
+    std::string error;
+    if (!journal.append(op, loadedMtime, loadedSize, error) || !applyPatchOp(nbtFile, op, error)) {
+        statusMessage = error;
+        return false;
+    }
+    modified = true;
+    refreshTagList();
+    return true;
+}
+
+void NBTEditor::replayJournal() {
+    std::vector<PatchOp> ops;
+    std::string error;
+    if (!journal.load(loadedMtime, loadedSize, ops, error) || ops.empty()) {
+        statusMessage = error;
+        return;
+    }
+    if (!nbtFile.materializeAll()) {
+        statusMessage = nbtFile.getError();
+        return;
+    }
+    
+    // An edit that failed when it was made fails again here, with no effect.
+    size_t failed = 0;
+    std::string opError;
+    for (const auto& op : ops) {
+        if (!applyPatchOp(nbtFile, op, opError)) failed++;
     }
+    modified = true;
+    refreshTagList();
+    statusMessage = "replayed " + std::to_string(ops.size() - failed) + " unsaved edits from " + journal.getPath();
+    if (!error.empty()) statusMessage += "; " + error;
 }
 
 void NBTEditor::addTag() {
-    if (selectedTag && selectedTag->type == TagType::COMPOUND) {
-        auto newTag = std::make_shared<NBTTag>(TagType::STRING, "new_tag");
-        newTag->value.stringVal = "value";
-        selectedTag->value.compoundVal["new_tag"] = newTag;
-        refreshTagList();
-        modified = true;
+    PatchOp op;
+    if (selectedTag && selectedTag->type == TagType::COMPOUND && nbtFile.materialize(*selectedTag) &&
+        findTagPath(nbtFile.getRoot(), selectedTag, op.path)) {
+        op.kind = selectedTag->value.compoundVal.count("new_tag") ? PatchOpKind::REPLACE : PatchOpKind::ADD;
+        appendPathKey(op.path, "new_tag");
+        op.value = "\"value\"";
+        applyEdit(op);
+    }
+}
+
+// Pastes SNBT into the selected tag: "key:value" entries (as inside {...})
+// into a compound, or a single value appended to a list.
+void NBTEditor::pasteSNBT() {
+    if (!selectedTag || (selectedTag->type != TagType::COMPOUND && selectedTag->type != TagType::LIST)) return;
+    if (!nbtFile.materialize(*selectedTag)) {
+        statusMessage = nbtFile.getError();
+        return;
+    }
+    
+    int maxY, maxX;
+    getmaxyx(stdscr, maxY, maxX);
+    
+    mvhline(maxY - 1, 0, ' ', maxX);
+    std::string prompt = selectedTag->type == TagType::COMPOUND ? "Paste SNBT (key:value,...): " : "Paste SNBT value: ";
+    mvprintw(maxY - 1, 0, "%s", prompt.c_str());
+    
+    echo();
+    curs_set(1);
+    std::vector<char> input(65536, '\0');
+    int result = mvgetnstr(maxY - 1, prompt.length(), input.data(), static_cast<int>(input.size()) - 1);
+    noecho();
+    curs_set(0);
+    if (result != OK) return;
+    
+    std::string text(input.data());
+    std::shared_ptr<NBTTag> parsed;
+    std::string error;
+    std::string path;
+    if (!findTagPath(nbtFile.getRoot(), selectedTag, path)) return;
+    if (selectedTag->type == TagType::COMPOUND) {
+        size_t first = text.find_first_not_of(" \t");
+        if (first == std::string::npos || text[first] != '{') {
+            text = "{" + text + "}";
+        }
+        if (!parseSNBT(text, parsed, error)) {
+            statusMessage = error;
+            return;
+        }
+        if (parsed->type != TagType::COMPOUND) {
+            statusMessage = "expected compound";
+            return;
+        }
+        // One operation per key, so the journal replays each on its own.
+        std::shared_ptr<NBTTag> target = selectedTag;
+        for (const auto& pair : parsed->value.compoundVal) {
+            PatchOp op;
+            op.kind = target->value.compoundVal.count(pair.first) ? PatchOpKind::REPLACE : PatchOpKind::ADD;
+            op.path = path;
+            appendPathKey(op.path, pair.first);
+            op.value = toSNBT(*pair.second);
+            if (!applyEdit(op)) return;
+        }
+    } else {
+        if (!parseSNBT(text, parsed, error)) {
+            statusMessage = error;
+            return;
+        }
+        auto& items = selectedTag->value.listVal;
+        if (!items.empty() && items[0]->type != parsed->type) {
+            statusMessage = "expected " + tagTypeToString(items[0]->type) + " like the other list items";
+            return;
+        }
+        PatchOp op;
+        op.kind = PatchOpKind::SPLICE;
+        op.path = path;
+        op.start = static_cast<int32_t>(items.size());
+        op.value = "[" + toSNBT(*parsed) + "]";
+        applyEdit(op);
     }
 }
 
 void NBTEditor::deleteTag() {
-    if (selectedTag && selectedTag != nbtFile.getRoot()) {
-        selectedTag->name = "[DELETED] " + selectedTag->name;
-        modified = true;
+    PatchOp op;
+    op.kind = PatchOpKind::REMOVE;
+    if (selectedTag && selectedTag != nbtFile.getRoot() && findTagPath(nbtFile.getRoot(), selectedTag, op.path) &&
+        applyEdit(op)) {
+        selectedTag = nullptr;
+        if (currentRow >= static_cast<int>(flatTagList.size())) {
+            currentRow = static_cast<int>(flatTagList.size()) - 1;
+        }
+    }
+}
+
+// Prompts for a path (same syntax as the command line) and jumps to the
+// first tag it matches. Array elements select their array. Evicted subtrees
+// are read back to be searched, and every match is unfolded.
+void NBTEditor::search() {
+    int maxY, maxX;
+    getmaxyx(stdscr, maxY, maxX);
+    
+    mvhline(maxY - 1, 0, ' ', maxX);
+    std::string prompt = "Search path: ";
+    mvprintw(maxY - 1, 0, "%s", prompt.c_str());
+    
+    echo();
+    curs_set(1);
+    char input[1024] = {0};
+    int result = mvgetnstr(maxY - 1, prompt.length(), input, sizeof(input) - 1);
+    noecho();
+    curs_set(0);
+    if (result != OK) return;
+    
+    searchResults.clear();
+    searchIndex = 0;
+    NBTPath path;
+    std::string error;
+    if (!path.compile(input, error)) {
+        statusMessage = error;
+        return;
+    }
+    if (!nbtFile.materializeAll()) {
+        statusMessage = nbtFile.getError();
+        return;
+    }
+    
+    std::vector<TagRef> matches;
+    path.match(nbtFile.getRoot(), matches);
+    for (const auto& ref : matches) {
+        bool element = ref.parent && ref.parent->type != TagType::COMPOUND && ref.parent->type != TagType::LIST;
+        const std::shared_ptr<NBTTag>& tag = element ? ref.parent : ref.tag;
+        if (searchResults.empty() || searchResults.back() != tag) {
+            searchResults.push_back(tag);
+        }
+    }
+    for (const auto& tag : searchResults) {
+        reveal(tag);
+    }
+    refreshTagList();
+    if (!searchResults.empty()) {
+        searchIndex = searchResults.size() - 1;
+        nextMatch();
+    }
+}
+
+void NBTEditor::nextMatch() {
+    if (searchResults.empty()) return;
+    
+    searchIndex = (searchIndex + 1) % searchResults.size();
+    if (reveal(searchResults[searchIndex])) refreshTagList();
+    auto it = std::find(flatTagList.begin(), flatTagList.end(), searchResults[searchIndex]);
+    if (it != flatTagList.end()) {
+        currentRow = static_cast<int>(it - flatTagList.begin());
     }
 }
 
 void NBTEditor::handleInput(int ch) {
+    // Until the whole tree is there, only navigation and search work.
+    if (loadThread.joinable() && ch != KEY_UP && ch != KEY_DOWN && ch != KEY_LEFT && ch != KEY_RIGHT &&
+        ch != '\n' && ch != KEY_ENTER && ch != '/' && ch != 'n' && ch != 'N') {
+        return;
+    }
+    
     switch (ch) {
+        case '\n':
+        case KEY_ENTER:
+        case KEY_LEFT:
+        case KEY_RIGHT:
+            fold(ch);
+            break;
         case KEY_UP:
             if (currentRow > 0) {
                 currentRow--;
@@ -531,10 +10147,34 @@ void NBTEditor::handleInput(int ch) {
         case 'A':
             addTag();
             break;
+        case 'p':
+        case 'P':
+            pasteSNBT();
+            break;
         case 'd':
         case 'D':
             deleteTag();
             break;
+        case '/':
+            search();
+            break;
+        case 'n':
+        case 'N':
+            nextMatch();
+            break;
+        case 'r':
+        case 'R':
+            // Reloading throws away pending edits and their journal.
+            if (modified) {
+                mvprintw(0, 0, "Discard changes and reload? (y/n)");
+                int answer = getch();
+                if (answer != 'y' && answer != 'Y') {
+                    statusMessage = "reload cancelled";
+                    break;
+                }
+            }
+            reloadFromDisk();
+            break;
         case 's':
         case 'S':
             saveChanges();
@@ -544,6 +10184,177 @@ void NBTEditor::handleInput(int ch) {
     }
 }
 
+NBTEditor::~NBTEditor() {
+    if (loadThread.joinable()) {
+        loader.cancel();
+        loadThread.join();
+    }
+    if (watchFd >= 0) close(watchFd);
+}
+
+void NBTEditor::startLoading() {
+    loading = true;
+    loadThread = std::thread([this] {
+        loadSucceeded = nbtFile.streamLoad(loader);
+        loader.finish();
+        loading = false;
+    });
+}
+
+// Attaches what the loader has handed over since the last call, keeping
+// the cursor on the same tag. Returns false once loading has failed.
+bool NBTEditor::updateLoading() {
+    // Read before taking, so nothing handed over after the stream ended can
+    // be left behind.
+    bool done = !loading;
+    // Flattening is redone from scratch and grows with the tree, so it is
+    // spaced out to take at most a tenth of the time, leaving the rest to
+    // the loader.
+    auto now = std::chrono::steady_clock::now();
+    if (!done && now < nextRefresh) return true;
+    std::vector<ProgressiveLoader::Attach> attached;
+    if (loader.take(attached)) {
+        for (const auto& item : attached) {
+            if (!item.parent) {
+                nbtFile.setRoot(item.tag);
+            } else if (item.parent->type == TagType::COMPOUND) {
+                item.parent->value.compoundVal[item.tag->name] = item.tag;
+            } else {
+                item.parent->value.listVal.push_back(item.tag);
+            }
+        }
+        refreshTagList();
+        auto it = std::find(flatTagList.begin(), flatTagList.end(), selectedTag);
+        if (it != flatTagList.end()) {
+            currentRow = static_cast<int>(it - flatTagList.begin());
+        }
+        nextRefresh = now + (std::chrono::steady_clock::now() - now) * 9;
+    }
+    if (!done) {
+        statusMessage = "loading, " + std::to_string(loader.tagCount()) + " tags";
+        return true;
+    }
+    
+    loadThread.join();
+    if (!loadSucceeded) return false;
+    statusMessage.clear();
+    replayJournal();
+    startWatching();
+    return true;
+}
+
+void NBTEditor::startWatching() {
+    std::string dir = nbtFile.getFilename();
+    size_t slash = dir.find_last_of('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash + 1);
+    
+    watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watchFd < 0) return;
+    if (inotify_add_watch(watchFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        close(watchFd);
+        watchFd = -1;
+    }
+}
+
+// Drains pending inotify events and reloads once the file's mtime or size
+// differ from what was loaded. Events for other files in the directory,
+// and for writes that leave the file as it was, are ignored.
+void NBTEditor::checkForChanges() {
+    if (watchFd < 0) return;
+    
+    std::string filename = nbtFile.getFilename();
+    size_t slash = filename.find_last_of('/');
+    std::string base = slash == std::string::npos ? filename : filename.substr(slash + 1);
+    
+    alignas(struct inotify_event) char buffer[4096];
+    bool touched = false;
+    ssize_t length;
+    while ((length = read(watchFd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t offset = 0; offset < length;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+            if (event->len > 0 && base == event->name) touched = true;
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (!touched) return;
+    
+    int64_t mtime, size;
+    if (!statFile(filename, mtime, size) || (mtime == loadedMtime && size == loadedSize)) return;
+    
+    if (modified) {
+        // Merging would silently drop the user's edits; leave it to R.
+        changedOnDisk = true;
+        statusMessage = "changed on disk, S keeps your edits, R discards them";
+        return;
+    }
+    reloadFromDisk();
+}
+
+// Parses the file again and merges it into the open tree. Unchanged
+// subtrees keep their tag objects, so the cursor and search results stay
+// on the same tags; a replaced selection is found again by its path.
+void NBTEditor::reloadFromDisk() {
+    int64_t mtime = 0, size = 0;
+    statFile(nbtFile.getFilename(), mtime, size);
+    
+    NBTFile fresh(nbtFile.getFilename());
+    fresh.setCacheDir(defaultCacheDir());
+    if (!fresh.load()) {
+        // Most likely caught mid-write; the next event retries.
+        statusMessage = "reload failed: " + fresh.getError();
+        return;
+    }
+    // Merging compares whole subtrees; the budget is enforced again after.
+    if (!nbtFile.materializeAll()) {
+        statusMessage = "reload failed: " + nbtFile.getError();
+        return;
+    }
+    
+    std::shared_ptr<NBTTag> root = nbtFile.getRoot();
+    std::string selectedPath;
+    bool hadPath = selectedTag && findTagPath(root, selectedTag, selectedPath);
+    
+    TagHashCache currentHashes, updatedHashes;
+    size_t replaced = 0;
+    root = mergeTree(root, fresh.getRoot(), currentHashes, updatedHashes, replaced);
+    root->name = fresh.getRoot()->name;
+    nbtFile.setRoot(root);
+    nbtFile.setCompression(fresh.getCompression());
+    loadedMtime = mtime;
+    loadedSize = size;
+    modified = false;
+    changedOnDisk = false;
+    journal.clear();
+    statusMessage = "reloaded, " + std::to_string(replaced) + " tags changed";
+    
+    refreshTagList();
+    std::unordered_map<const NBTTag*, int> rows;
+    for (size_t i = 0; i < flatTagList.size(); i++) {
+        rows[flatTagList[i].get()] = static_cast<int>(i);
+    }
+    
+    auto row = rows.find(selectedTag.get());
+    if (row == rows.end() && hadPath) {
+        TagRef ref;
+        std::string error;
+        if (resolvePath(root, selectedPath, ref, error)) row = rows.find(ref.tag.get());
+    }
+    if (row != rows.end()) {
+        currentRow = row->second;
+    } else {
+        currentRow = std::min(currentRow, static_cast<int>(flatTagList.size()) - 1);
+    }
+    
+    std::vector<std::shared_ptr<NBTTag>> kept;
+    for (const auto& tag : searchResults) {
+        if (rows.count(tag.get())) kept.push_back(tag);
+    }
+    if (kept.size() != searchResults.size()) {
+        searchResults.swap(kept);
+        searchIndex = 0;
+    }
+}
+
 void NBTEditor::run() {
     initscr();
     cbreak();
@@ -551,23 +10362,31 @@ void NBTEditor::run() {
     keypad(stdscr, TRUE);
     curs_set(0);
     
-    if (!nbtFile.load()) {
-        endwin();
-        std::cerr << "Failed to load NBT file: " << nbtFile.getRoot()->name << std::endl;
-        return;
-    }
-    
-    refreshTagList();
+    statFile(nbtFile.getFilename(), loadedMtime, loadedSize);
+    startLoading();
     
     int ch;
     bool running = true;
     
     while (running) {
+        if (loadThread.joinable() && !updateLoading()) {
+            endwin();
+            std::cerr << "Failed to load NBT file: " << nbtFile.getFilename() << ": " << nbtFile.getError() << std::endl;
+            return;
+        }
         drawEditor();
+        // Only the main loop polls; prompts keep blocking reads.
+        timeout(loadThread.joinable() ? 50 : watchFd >= 0 ? 250 : -1);
         ch = getch();
+        timeout(-1);
         
-        if (ch == 'q' || ch == 'Q') {
-            if (!modified || (mvprintw(0, 0, "Save changes? (y/n)"), ch = getch(), ch == 'n' || ch == 'N')) {
+        if (ch == ERR) {
+            checkForChanges();
+        } else if (ch == 'q' || ch == 'Q') {
+            if (!modified) {
+                running = false;
+            } else if ((mvprintw(0, 0, "Save changes? (y/n)"), ch = getch(), ch == 'n' || ch == 'N')) {
+                journal.clear();
                 running = false;
             } else if (ch == 'y' || ch == 'Y') {
                 saveChanges();
@@ -581,12 +10400,667 @@ void NBTEditor::run() {
     endwin();
 }
 
+static const char* const PIPELINE_PHASES[] = {
+    "read", "inflate", "parse", "flatten", "edit", "serialize", "deflate", "write"
+};
+static const size_t PIPELINE_PHASE_COUNT = sizeof(PIPELINE_PHASES) / sizeof(PIPELINE_PHASES[0]);
+
+// Changes a scalar without changing its serialized size, so every sample
+// saves a document as large as the first. False for tags it cannot change.
+static bool bumpValue(NBTTag& tag) {
+    switch (tag.type) {
+        case TagType::BYTE: tag.value.byteVal ^= 1; return true;
+        case TagType::SHORT: tag.value.shortVal ^= 1; return true;
+        case TagType::INT: tag.value.intVal ^= 1; return true;
+        case TagType::LONG: tag.value.longVal ^= 1; return true;
+        case TagType::FLOAT: tag.value.floatVal = -tag.value.floatVal; return true;
+        case TagType::DOUBLE: tag.value.doubleVal = -tag.value.doubleVal; return true;
+        case TagType::STRING: {
+            std::string& text = tag.value.stringVal;
+            if (text.empty() || static_cast<unsigned char>(text.back()) >= 0x7e ||
+                static_cast<unsigned char>(text.back()) < 0x20) return false;
+            text.back() = static_cast<char>(text.back() ^ 1);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+int runPipelineBenchmark(const PipelineBenchmarkOptions& options) {
+    if (!options.json) {
+        std::cout << std::left << std::setw(9) << "corpus" << std::right << std::setw(11) << "size"
+                  << std::setw(10) << "tags";
+        for (const char* phase : PIPELINE_PHASES) std::cout << std::setw(10) << phase;
+        std::cout << std::setw(10) << "total ms" << std::setw(9) << "MB/s" << std::endl;
+    }
+    for (CorpusKind kind : options.kinds) {
+        for (uint64_t size : options.sizes) {
+            std::string path = options.dir + "/nbtedit-bench-" + corpusKindName(kind) + "-" + std::to_string(size) + ".dat";
+            uint64_t documentBytes = 0;
+            std::string error;
+            if (!generateFile(kind, path, size, options.seed, Compression::GZIP, documentBytes, error)) {
+                std::cerr << path << ": " << error << std::endl;
+                std::remove(path.c_str());
+                return 1;
+            }
+            
+            std::vector<std::vector<double>> phases(PIPELINE_PHASE_COUNT);
+            std::vector<double> totals;
+            std::string raw;
+            std::string data;
+            size_t tags = 0;
+            size_t fileBytes = 0;
+            for (size_t sample = 0; sample < options.warmup + options.samples && error.empty(); sample++) {
+                NBTEditor editor(path);
+                NBTFile& file = editor.nbtFile;
+                double times[PIPELINE_PHASE_COUNT];
+                auto clock = std::chrono::steady_clock::now();
+                auto lap = [&](size_t phase) {
+                    auto now = std::chrono::steady_clock::now();
+                    times[phase] = std::chrono::duration<double, std::milli>(now - clock).count();
+                    clock = now;
+                };
+                
+                // The steps of NBTFile::load and save, timed one by one.
+                bool ok;
+                {
+                    TraceSpan span("load");
+                    AllocationScope scope(AllocationPhase::LOAD);
+                    ok = readFileBytes(path, raw);
+                    if (!ok) error = "cannot read file";
+                    lap(0);
+                    ok = ok && inflateData(raw.data(), raw.size(), data, error);
+                    fileBytes = raw.size();
+                    lap(1);
+                    if (ok && !file.parse(data.data(), data.size())) {
+                        error = file.getError();
+                        ok = false;
+                    }
+                    lap(2);
+                }
+                if (ok) editor.refreshTagList();
+                lap(3);
+                
+                // Edits are spread evenly over the editable tags; picking
+                // them is not part of the edit phase.
+                std::vector<std::shared_ptr<NBTTag>> targets;
+                size_t stride = std::max<size_t>(1, editor.flatTagList.size() / std::max<size_t>(1, options.edits));
+                for (size_t i = 0; i < editor.flatTagList.size() && targets.size() < options.edits; i += stride) {
+                    NBTTag probe(*editor.flatTagList[i]);
+                    if (bumpValue(probe)) targets.push_back(editor.flatTagList[i]);
+                }
+                tags = editor.flatTagList.size();
+                clock = std::chrono::steady_clock::now();
+                for (const auto& target : targets) {
+                    if (!ok) break;
+                    NBTTag edited(*target);
+                    bumpValue(edited);
+                    PatchOp op;
+                    op.kind = PatchOpKind::REPLACE;
+                    if (findTagPath(file.getRoot(), target, op.path)) {
+                        op.value = toSNBT(edited);
+                        ok = editor.applyEdit(op);
+                        if (!ok) error = editor.statusMessage;
+                    }
+                }
+                lap(4);
+                
+                {
+                    TraceSpan span("save");
+                    AllocationScope scope(AllocationPhase::SAVE);
+                    if (ok && !file.serialize(data)) {
+                        error = file.getError();
+                        ok = false;
+                    }
+                    lap(5);
+                    ok = ok && deflateData(data, Compression::GZIP, raw, error);
+                    lap(6);
+                    ok = ok && writeFileAtomic(path, raw.data(), raw.size(), false, error);
+                    lap(7);
+                }
+                editor.journal.clear();
+                
+                if (ok && sample >= options.warmup) {
+                    double total = 0;
+                    for (size_t phase = 0; phase < PIPELINE_PHASE_COUNT; phase++) {
+                        phases[phase].push_back(times[phase]);
+                        total += times[phase];
+                    }
+                    totals.push_back(total);
+                }
+            }
+            std::remove(path.c_str());
+            if (!error.empty()) {
+                std::cerr << path << ": " << error << std::endl;
+                return 1;
+            }
+            
+            BenchmarkSummary total = summarize(totals);
+            double mbPerSecond = documentBytes / (total.median * 1000.0);
+            std::string name = std::string(corpusKindName(kind)) + "/" + std::to_string(size);
+            std::ostringstream line;
+            line << std::fixed;
+            if (options.json) {
+                line << std::setprecision(4) << "{\"name\":\"pipeline/" << name << "\",\"kind\":\""
+                     << corpusKindName(kind) << "\",\"size\":" << documentBytes << ",\"file_bytes\":" << fileBytes
+                     << ",\"tags\":" << tags << ",\"edits\":" << options.edits;
+                for (size_t phase = 0; phase < PIPELINE_PHASE_COUNT; phase++) {
+                    line << ",\"" << PIPELINE_PHASES[phase] << "_ms\":" << summarize(phases[phase]).median;
+                }
+                line << ",\"total_ms\":" << total.median << ",\"min_ms\":" << total.min << ",\"stddev_ms\":"
+                     << total.stddev << std::setprecision(2) << ",\"mb_per_s\":" << mbPerSecond
+                     << ",\"samples\":" << totals.size() << "}";
+            } else {
+                line << std::setprecision(2) << std::left << std::setw(9) << corpusKindName(kind) << std::right
+                     << std::setw(11) << formatBytes(documentBytes) << std::setw(10) << tags;
+                for (size_t phase = 0; phase < PIPELINE_PHASE_COUNT; phase++) {
+                    line << std::setw(10) << summarize(phases[phase]).median;
+                }
+                line << std::setw(10) << total.median << std::setprecision(1) << std::setw(9) << mbPerSecond;
+            }
+            std::cout << line.str() << std::endl;
+        }
+    }
+    return 0;
+}
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " <nbt_file.dat>" << std::endl
+              << "       " << program << " get|set|del <nbt_file.dat> <path> [value] [get|set|del <path> [value]]..." << std::endl
+              << "       " << program << " exec <nbt_file.dat> [operations...]   (reads operations from stdin if none given)" << std::endl
+              << "       " << program << " snbt <nbt_file.dat> [--pretty] [path]" << std::endl
+              << "       " << program << " import <input.snbt|-> <output.dat> [--compression gzip|zlib|none]" << std::endl
+              << "       " << program << " json <file.dat|region.mca>... [--typed] [--longs-as-strings]" << std::endl
+              << "       " << program << " diff <old.dat|old_dir> <new.dat|new_dir> [--with-tests] [-j threads]" << std::endl
+              << "       " << program << " patch <patch_file> <target>... [--dry-run] [-j threads]" << std::endl
+              << "       " << program << " world <world_dir> [-j threads] [--dry-run] [operations...]" << std::endl
+              << "       " << program << " query <path> <file.dat|region.mca|world_dir>... [-j threads]" << std::endl
+              << "       " << program << " serve <socket>" << std::endl
+              << "       " << program << " client <socket> get|set|del|query <file> <path> [value] [--chunk x,z]" << std::endl
+              << "       " << program << " client <socket> save|reload <file> | status | shutdown [force]" << std::endl
+              << "       " << program << " optimize <file.dat|region.mca|world_dir>... [--defaults file] [--default key=value]..." << std::endl
+              << "                [--plugins name,...] [--prune-empty] [--compression gzip|zlib|none] [--level 0-9] [--dry-run] [-j threads]" << std::endl
+              << "       " << program << " bench codecs [--samples N] [--warmup N] [--filter name] [--json]" << std::endl
+              << "       " << program << " bench pipeline [--kinds player,...] [--sizes 64K,1M,...] [--edits N] [--samples N]" << std::endl
+              << "                [--warmup N] [--seed N] [--dir path] [--json]" << std::endl
+              << "       " << program << " generate player|chunk|entities|plugin|flat <output.dat|r.x.z.mca> [--size bytes]" << std::endl
+              << "                [--seed N] [--compression gzip|zlib|none]" << std::endl
+              << "       " << program << " stats <world_dir|region_dir|region.mca>... [-j threads] [--top N]" << std::endl
+              << "       " << program << " index build <world_dir> [--index file] [--full] [-j threads]" << std::endl
+              << "       " << program << " index query <world_dir> <value> [--path path] [--index file]" << std::endl;
+}
+
+static bool readEditOps(std::istream& in, std::vector<EditOp>& ops) {
+    std::string line;
+    std::string error;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        
+        EditOp op;
+        if (!parseEditOpLine(line, op, error)) {
+            std::cerr << "stdin:" << lineNumber << ": " << error << std::endl;
+            return false;
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
+    startAllocationStats();
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <nbt_file.dat>" << std::endl;
+        printUsage(argv[0]);
         return 1;
     }
     
+    std::string command = argv[1];
+    if (command == "get" || command == "set" || command == "del" || command == "exec") {
+        if (argc < 3) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        std::vector<std::string> args;
+        if (command != "exec") {
+            args.push_back(command);
+        }
+        for (int i = 3; i < argc; i++) {
+            args.push_back(argv[i]);
+        }
+        
+        std::vector<EditOp> ops;
+        std::string error;
+        if (!parseEditOps(args, ops, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        if (command == "exec" && args.empty() && !readEditOps(std::cin, ops)) {
+            return 1;
+        }
+        return runHeadless(argv[2], ops);
+    }
+    
+    if (command == "snbt") {
+        if (argc < 3) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        bool pretty = false;
+        std::string path;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--pretty") {
+                pretty = true;
+            } else {
+                path = arg;
+            }
+        }
+        return runSNBTExport(argv[2], path, pretty);
+    }
+    
+    if (command == "import") {
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        Compression compression = Compression::GZIP;
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--compression" && i + 1 < argc) {
+                std::string name = argv[++i];
+                if (name == "gzip") compression = Compression::GZIP;
+                else if (name == "zlib") compression = Compression::ZLIB;
+                else if (name == "none") compression = Compression::NONE;
+                else {
+                    std::cerr << "unknown compression '" << name << "'" << std::endl;
+                    return 1;
+                }
+            }
+        }
+        return runSNBTImport(argv[2], argv[3], compression);
+    }
+    
+    if (command == "optimize") {
+        OptimizeOptions options;
+        std::vector<std::string> inputs;
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        std::string error;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--defaults" && i + 1 < argc) {
+                if (!loadOptimizeDefaults(options, argv[++i], error)) {
+                    std::cerr << error << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--default" && i + 1 < argc) {
+                std::string entry = argv[++i];
+                size_t equals = entry.find('=');
+                if (equals == std::string::npos ||
+                    !addOptimizeDefault(options, entry.substr(0, equals), entry.substr(equals + 1), error)) {
+                    std::cerr << (equals == std::string::npos ? "expected key=value: " + entry : error) << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--plugins" && i + 1 < argc) {
+                std::stringstream names(argv[++i]);
+                std::string name;
+                while (std::getline(names, name, ',')) {
+                    if (!name.empty()) options.plugins.push_back(name);
+                }
+                options.keepPlugins = false;
+            } else if (arg == "--compression" && i + 1 < argc) {
+                std::string name = argv[++i];
+                options.recompress = true;
+                if (name == "gzip") options.compression = Compression::GZIP;
+                else if (name == "zlib") options.compression = Compression::ZLIB;
+                else if (name == "none") options.compression = Compression::NONE;
+                else {
+                    std::cerr << "unknown compression '" << name << "'" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--level" && i + 1 < argc) {
+                options.level = std::min(9, std::max(0, std::atoi(argv[++i])));
+            } else if (arg == "--dry-run") {
+                options.dryRun = true;
+            } else if (arg == "--prune-empty") {
+                options.pruneEmpty = true;
+            } else if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else {
+                inputs.push_back(arg);
+            }
+        }
+        if (inputs.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return runOptimize(inputs, options, threads);
+    }
+    
+    if (command == "bench" && argc >= 3 && std::string(argv[2]) == "pipeline") {
+        PipelineBenchmarkOptions options;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if ((arg == "--kinds" || arg == "--sizes") && i + 1 < argc) {
+                std::stringstream list(argv[++i]);
+                std::string item;
+                if (arg == "--sizes") options.sizes.clear();
+                else options.kinds.clear();
+                while (std::getline(list, item, ',')) {
+                    CorpusKind kind;
+                    if (item.empty()) continue;
+                    uint64_t size;
+                    if (arg == "--sizes") {
+                        if (!parseByteSize(item, size)) {
+                            std::cerr << "invalid size '" << item << "'" << std::endl;
+                            return 1;
+                        }
+                        options.sizes.push_back(size);
+                    } else if (parseCorpusKind(item, kind)) {
+                        options.kinds.push_back(kind);
+                    } else {
+                        std::cerr << "unknown corpus kind '" << item << "'" << std::endl;
+                        return 1;
+                    }
+                }
+            } else if (arg == "--edits" && i + 1 < argc) {
+                options.edits = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+            } else if (arg == "--samples" && i + 1 < argc) {
+                options.samples = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--warmup" && i + 1 < argc) {
+                options.warmup = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+            } else if (arg == "--seed" && i + 1 < argc) {
+                options.seed = std::strtoull(argv[++i], nullptr, 10);
+            } else if (arg == "--dir" && i + 1 < argc) {
+                options.dir = argv[++i];
+            } else if (arg == "--json") {
+                options.json = true;
+            }
+        }
+        if (!validMemoryBudget()) return 1;
+        return runPipelineBenchmark(options);
+    }
+    
+    if (command == "bench") {
+        if (argc < 3 || std::string(argv[2]) != "codecs") {
+            printUsage(argv[0]);
+            return 1;
+        }
+        BenchmarkOptions options;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--samples" && i + 1 < argc) {
+                options.samples = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--warmup" && i + 1 < argc) {
+                options.warmup = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+            } else if (arg == "--filter" && i + 1 < argc) {
+                options.filter = argv[++i];
+            } else if (arg == "--json") {
+                options.json = true;
+            }
+        }
+        return runCodecBenchmark(options);
+    }
+    
+    if (command == "generate") {
+        CorpusKind kind;
+        if (argc < 4 || !parseCorpusKind(argv[2], kind)) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        std::string output = argv[3];
+        uint64_t size = 64 << 10;
+        uint64_t seed = 1;
+        // Regions hold zlib chunks; standalone files are gzip like player data.
+        Compression compression = endsWith(output, ".mca") ? Compression::ZLIB : Compression::GZIP;
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--size" && i + 1 < argc) {
+                if (!parseByteSize(argv[++i], size)) {
+                    std::cerr << "invalid size '" << argv[i] << "'" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--seed" && i + 1 < argc) {
+                seed = std::strtoull(argv[++i], nullptr, 10);
+            } else if (arg == "--compression" && i + 1 < argc) {
+                std::string name = argv[++i];
+                if (name == "gzip") compression = Compression::GZIP;
+                else if (name == "zlib") compression = Compression::ZLIB;
+                else if (name == "none") compression = Compression::NONE;
+                else {
+                    std::cerr << "unknown compression '" << name << "'" << std::endl;
+                    return 1;
+                }
+            }
+        }
+        return runGenerate(kind, output, size, seed, compression);
+    }
+    
+    if (command == "json") {
+        JSONExportOptions options;
+        std::vector<std::string> files;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--typed") {
+                options.typedValues = true;
+            } else if (arg == "--longs-as-strings") {
+                options.longsAsStrings = true;
+            } else {
+                files.push_back(arg);
+            }
+        }
+        if (files.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return runJSONExport(files, options);
+    }
+    
+    if (command == "diff") {
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        bool withTests = false;
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--with-tests") {
+                withTests = true;
+            } else if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            }
+        }
+        return runDiff(argv[2], argv[3], withTests, threads);
+    }
+    
+    if (command == "patch") {
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        bool dryRun = false;
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::string> targets;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--dry-run") {
+                dryRun = true;
+            } else if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else {
+                targets.push_back(arg);
+            }
+        }
+        return runPatch(argv[2], targets, dryRun, threads);
+    }
+    
+    if (command == "world") {
+        if (argc < 3) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        bool dryRun = false;
+        std::vector<std::string> args;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--dry-run") {
+                dryRun = true;
+            } else {
+                args.push_back(arg);
+            }
+        }
+        
+        std::vector<EditOp> ops;
+        std::string error;
+        if (!parseEditOps(args, ops, error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        if (args.empty() && !readEditOps(std::cin, ops)) {
+            return 1;
+        }
+        
+        WorldBatch batch(argv[2], ops, threads);
+        batch.setDryRun(dryRun);
+        return batch.run();
+    }
+    
+    if (command == "query") {
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::string> inputs;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else {
+                inputs.push_back(arg);
+            }
+        }
+        return runQuery(argv[2], inputs, threads);
+    }
+    
+    if (command == "serve") {
+        if (argc != 3) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        NBTDaemon daemon(argv[2]);
+        return daemon.run();
+    }
+    
+    if (command == "client") {
+        static const std::map<std::string, DaemonOp> ops = {
+            { "get", DaemonOp::GET }, { "set", DaemonOp::SET }, { "del", DaemonOp::DEL },
+            { "query", DaemonOp::QUERY }, { "save", DaemonOp::SAVE }, { "reload", DaemonOp::RELOAD },
+            { "status", DaemonOp::STATUS }, { "shutdown", DaemonOp::SHUTDOWN }
+        };
+        auto op = argc > 3 ? ops.find(argv[3]) : ops.end();
+        if (op == ops.end()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        DaemonRequest request;
+        request.op = op->second;
+        std::vector<std::string> args;
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            int x, z;
+            if (arg == "--chunk" && i + 1 < argc && std::sscanf(argv[i + 1], "%d,%d", &x, &z) == 2) {
+                request.chunk = (x & 31) + (z & 31) * 32;
+                i++;
+            } else {
+                args.push_back(arg);
+            }
+        }
+        
+        size_t needed = request.op == DaemonOp::STATUS || request.op == DaemonOp::SHUTDOWN ? 0 :
+                        request.op == DaemonOp::SAVE || request.op == DaemonOp::RELOAD ? 1 :
+                        request.op == DaemonOp::SET ? 3 : 2;
+        if (args.size() < needed) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (request.op == DaemonOp::SHUTDOWN) {
+            request.value = args.empty() ? "" : args[0];
+        } else if (needed > 0) {
+            // The daemon may run in another directory, so send absolute paths.
+            char* resolved = realpath(args[0].c_str(), nullptr);
+            request.file = resolved ? resolved : args[0];
+            free(resolved);
+            if (needed > 1) request.path = args[1];
+            if (needed > 2) request.value = args[2];
+        }
+        return runDaemonClient(argv[2], request);
+    }
+    
+    if (command == "stats") {
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t top = 20;
+        std::vector<std::string> inputs;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--top" && i + 1 < argc) {
+                top = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else {
+                inputs.push_back(arg);
+            }
+        }
+        if (inputs.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return runStats(inputs, threads, top);
+    }
+    
+    if (command == "index") {
+        std::string action = argc > 2 ? argv[2] : "";
+        if (argc < 4 || (action != "build" && action != "query") || (action == "query" && argc < 5)) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        bool full = false;
+        std::string indexFile;
+        std::string pathFilter;
+        for (int i = action == "query" ? 5 : 4; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--full") {
+                full = true;
+            } else if (arg == "--index" && i + 1 < argc) {
+                indexFile = argv[++i];
+            } else if (arg == "--path" && i + 1 < argc) {
+                pathFilter = argv[++i];
+            }
+        }
+        
+        WorldIndex index(argv[3], indexFile);
+        return action == "build" ? index.build(threads, full) : index.query(argv[4], pathFilter);
+    }
+    
+    if (!validMemoryBudget()) return 1;
     NBTEditor editor(argv[1]);
     editor.run();
     